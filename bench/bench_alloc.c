@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Allocator benchmark suite, it calls the standard malloc family so the allocator under test is
+// whatever the process is linked with: the C library by default, or libmyalloc.so with LD_PRELOAD
+// --compare runs every workload once on each of them, in separate processes
+
+#define MAX_SAMPLES (1 << 21)
+#define SAMPLE_EVERY 8
+#define MAX_THREADS 16
+
+/*
+Latency samples of one thread, kept in memory that does not come from the allocator under test
+@param ns Latency of the sampled calls in nanoseconds
+@param count Number of samples taken
+@param calls Number of calls made, one in SAMPLE_EVERY is sampled
+*/
+struct samples {
+    uint32_t *ns;
+    size_t count;
+    size_t calls;
+};
+
+/*
+Result of a workload
+@param ops Number of allocator calls
+@param seconds Wall time of the workload
+*/
+struct result {
+    size_t ops;
+    double seconds;
+};
+
+/*
+Parameters shared by the threads of a workload
+@param iterations Iterations per thread
+@param live Number of slots per thread
+@param min_size Smallest request
+@param max_size Largest request
+*/
+struct config {
+    size_t iterations;
+    size_t live;
+    size_t min_size;
+    size_t max_size;
+};
+
+static struct samples thread_samples[MAX_THREADS];
+static size_t live_bytes, peak_live;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *map_zeroed(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    // touched up front so the buffer is part of the baseline RSS
+    memset(p, 0, size);
+    return p;
+}
+
+/*
+Time a call and record it if it is sampled
+@param s Samples of the calling thread
+@param start Time taken before the call
+*/
+static inline void record(struct samples *s, uint64_t start) {
+    uint64_t end = now_ns();
+    if(s->calls++ % SAMPLE_EVERY == 0 && s->count < MAX_SAMPLES / MAX_THREADS)
+        s->ns[s->count++] = (uint32_t)(end - start > UINT32_MAX ? UINT32_MAX : end - start);
+}
+
+// the timer is only read for sampled calls, so the other calls run at full speed
+#define TIMED(s, call) do { \
+        if((s)->calls % SAMPLE_EVERY == 0) { uint64_t t0 = now_ns(); call; record((s), t0); } \
+        else { (s)->calls++; call; } \
+    } while(0)
+
+// atomics rather than a lock so the accounting does not serialize the threaded workloads
+static void track(long delta) {
+    size_t live = __atomic_add_fetch(&live_bytes, delta, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_live, __ATOMIC_RELAXED);
+    while(live > peak && !__atomic_compare_exchange_n(&peak_live, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static size_t random_size(unsigned int *seed, const struct config *c) {
+    // sizes are drawn on a log scale, small requests dominate like in real programs
+    double r = (double)rand_r(seed) / RAND_MAX;
+    double lo = c->min_size, hi = c->max_size;
+    return (size_t)(lo * __builtin_exp(r * __builtin_log(hi / lo)));
+}
+
+/*
+Sequential workload, one block of a fixed size is allocated and freed in a loop
+@param c Parameters of the workload
+@return Measured result
+*/
+static struct result bench_sequential(const struct config *c) {
+    struct samples *s = &thread_samples[0];
+    struct result r = {0};
+    uint64_t start = now_ns();
+    void *p;
+    for(size_t i = 0; i < c->iterations; i++) {
+        TIMED(s, p = malloc(c->min_size));
+        *(volatile char *)p = 1;
+        TIMED(s, free(p));
+    }
+    r.seconds = (now_ns() - start) / 1e9;
+    r.ops = 2 * c->iterations;
+    return r;
+}
+
+/*
+Random workload, a random slot is freed and refilled with a block of a random size
+@param c Parameters of the workload
+@return Measured result
+*/
+static struct result bench_random(const struct config *c) {
+    struct samples *s = &thread_samples[0];
+    struct result r = {0};
+    void **slots = map_zeroed(c->live * sizeof(void *));
+    size_t *sizes = map_zeroed(c->live * sizeof(size_t));
+    unsigned int seed = 42;
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < c->iterations; i++) {
+        size_t k = rand_r(&seed) % c->live;
+        if(slots[k]) {
+            TIMED(s, free(slots[k]));
+            track(-(long)sizes[k]);
+            r.ops++;
+        }
+        sizes[k] = random_size(&seed, c);
+        TIMED(s, slots[k] = malloc(sizes[k]));
+        memset(slots[k], 1, sizes[k] < 64 ? sizes[k] : 64);
+        track(sizes[k]);
+        r.ops++;
+    }
+    r.seconds = (now_ns() - start) / 1e9;
+    for(size_t k = 0; k < c->live; k++)
+        free(slots[k]);
+    munmap(slots, c->live * sizeof(void *));
+    munmap(sizes, c->live * sizeof(size_t));
+    return r;
+}
+
+/*
+State of one thread of the Larson workload, the slots are inherited by the thread of the next round
+@param c Parameters of the workload
+@param slots Blocks owned by the thread
+@param sizes Sizes of the blocks
+@param seed Random seed of the thread
+@param samples Latency samples of the thread
+@param ops Number of calls made
+*/
+struct larson_state {
+    const struct config *c;
+    void **slots;
+    size_t *sizes;
+    unsigned int seed;
+    struct samples *samples;
+    size_t ops;
+};
+
+static void *larson_thread(void *arg) {
+    struct larson_state *st = arg;
+    for(size_t i = 0; i < st->c->iterations; i++) {
+        size_t k = rand_r(&st->seed) % st->c->live;
+        // blocks allocated by the thread of the previous round are freed here
+        if(st->slots[k]) {
+            TIMED(st->samples, free(st->slots[k]));
+            track(-(long)st->sizes[k]);
+            st->ops++;
+        }
+        st->sizes[k] = random_size(&st->seed, st->c);
+        TIMED(st->samples, st->slots[k] = malloc(st->sizes[k]));
+        *(volatile char *)st->slots[k] = 1;
+        track(st->sizes[k]);
+        st->ops++;
+    }
+    return NULL;
+}
+
+/*
+Larson-style server simulation, every round new threads take over the blocks of the previous ones
+@param c Parameters of the workload
+@param threads Number of threads per round
+@return Measured result
+*/
+static struct result bench_larson(const struct config *c, int threads) {
+    struct larson_state st[MAX_THREADS];
+    pthread_t t[MAX_THREADS];
+    struct result r = {0};
+    const int rounds = 8;
+    uint64_t start;
+    for(int i = 0; i < threads; i++) {
+        st[i] = (struct larson_state){c, map_zeroed(c->live * sizeof(void *)),
+            map_zeroed(c->live * sizeof(size_t)), (unsigned int)i + 1, &thread_samples[i], 0};
+    }
+    start = now_ns();
+    for(int round = 0; round < rounds; round++) {
+        for(int i = 0; i < threads; i++)
+            pthread_create(&t[i], NULL, larson_thread, &st[i]);
+        for(int i = 0; i < threads; i++)
+            pthread_join(t[i], NULL);
+        // the slots move to another thread so the next round frees remote blocks
+        struct larson_state first = st[0];
+        for(int i = 0; i + 1 < threads; i++) {
+            st[i].slots = st[i + 1].slots;
+            st[i].sizes = st[i + 1].sizes;
+        }
+        st[threads - 1].slots = first.slots;
+        st[threads - 1].sizes = first.sizes;
+    }
+    r.seconds = (now_ns() - start) / 1e9;
+    for(int i = 0; i < threads; i++) {
+        r.ops += st[i].ops;
+        for(size_t k = 0; k < c->live; k++)
+            free(st[i].slots[k]);
+    }
+    return r;
+}
+
+/*
+Ring of blocks passed from a producer to a consumer
+@param slots Blocks in flight
+@param head Next slot written by the producer
+@param tail Next slot read by the consumer
+*/
+#define RING_SIZE 4096
+struct ring {
+    void *slots[RING_SIZE];
+    size_t head;
+    size_t tail;
+    const struct config *c;
+    struct samples *producer_samples;
+    struct samples *consumer_samples;
+};
+
+static void *producer_thread(void *arg) {
+    struct ring *q = arg;
+    unsigned int seed = 7;
+    for(size_t i = 0; i < q->c->iterations; i++) {
+        void *p;
+        size_t size = random_size(&seed, q->c);
+        TIMED(q->producer_samples, p = malloc(size));
+        *(size_t *)p = size;
+        track(size);
+        while(__atomic_load_n(&q->head, __ATOMIC_RELAXED) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+            sched_yield();
+        q->slots[q->head % RING_SIZE] = p;
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consumer_thread(void *arg) {
+    struct ring *q = arg;
+    for(size_t i = 0; i < q->c->iterations; i++) {
+        void *p;
+        while(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail)
+            sched_yield();
+        p = q->slots[q->tail % RING_SIZE];
+        __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+        track(-(long)*(size_t *)p);
+        TIMED(q->consumer_samples, free(p));
+    }
+    return NULL;
+}
+
+/*
+Multithreaded producer/consumer workload, every block is freed by another thread than its allocator
+@param c Parameters of the workload
+@param pairs Number of producer/consumer pairs
+@return Measured result
+*/
+static struct result bench_prodcons(const struct config *c, int pairs) {
+    struct ring *rings = map_zeroed(pairs * sizeof(struct ring));
+    pthread_t t[MAX_THREADS];
+    struct result r = {0};
+    uint64_t start;
+    for(int i = 0; i < pairs; i++) {
+        rings[i].c = c;
+        rings[i].producer_samples = &thread_samples[2 * i];
+        rings[i].consumer_samples = &thread_samples[2 * i + 1];
+    }
+    start = now_ns();
+    for(int i = 0; i < pairs; i++) {
+        pthread_create(&t[2 * i], NULL, producer_thread, &rings[i]);
+        pthread_create(&t[2 * i + 1], NULL, consumer_thread, &rings[i]);
+    }
+    for(int i = 0; i < 2 * pairs; i++)
+        pthread_join(t[i], NULL);
+    r.seconds = (now_ns() - start) / 1e9;
+    r.ops = 2 * c->iterations * pairs;
+    munmap(rings, pairs * sizeof(struct ring));
+    return r;
+}
+
+/*
+Realloc growth workload, buffers grow a few bytes at a time like a string builder
+@param c Parameters of the workload
+@return Measured result
+*/
+static struct result bench_realloc(const struct config *c) {
+    struct samples *s = &thread_samples[0];
+    struct result r = {0};
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < c->iterations; i++) {
+        char *p = NULL;
+        for(size_t size = c->min_size; size <= c->max_size; size += size / 8 + 16) {
+            TIMED(s, p = realloc(p, size));
+            p[size - 1] = 1;
+            r.ops++;
+        }
+        track(c->max_size);
+        track(-(long)c->max_size);
+        TIMED(s, free(p));
+        r.ops++;
+    }
+    r.seconds = (now_ns() - start) / 1e9;
+    return r;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static size_t rss_kb(void) {
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(f) {
+        if(fscanf(f, "%*s %ld", &pages) != 1)
+            pages = 0;
+        fclose(f);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+Run a workload and print one line of results
+@param name Name of the workload
+@param label Name of the allocator under test
+@param live Slots per thread, also used as the size of the scaling runs
+*/
+static void run(const char *name, const char *label, size_t live) {
+    struct config c = {0};
+    struct result r;
+    struct rusage usage;
+    uint32_t *all;
+    size_t base_rss, peak_rss, n = 0;
+    char frag[16] = "n/a";
+    for(int i = 0; i < MAX_THREADS; i++)
+        thread_samples[i] = (struct samples){map_zeroed(MAX_SAMPLES / MAX_THREADS * sizeof(uint32_t)), 0, 0};
+    all = map_zeroed(MAX_SAMPLES * sizeof(uint32_t));
+    live_bytes = peak_live = 0;
+    base_rss = rss_kb();
+    if(!strcmp(name, "sequential")) {
+        c = (struct config){4000000, 1, 64, 64};
+        r = bench_sequential(&c);
+    }
+    else if(!strcmp(name, "random") || !strcmp(name, "scale")) {
+        c = (struct config){2000000, live, 16, 4096};
+        r = bench_random(&c);
+    }
+    else if(!strcmp(name, "larson")) {
+        c = (struct config){200000, 1000, 16, 1024};
+        r = bench_larson(&c, 4);
+    }
+    else if(!strcmp(name, "prodcons")) {
+        c = (struct config){1000000, 0, 16, 512};
+        r = bench_prodcons(&c, 2);
+    }
+    else if(!strcmp(name, "pairs")) {
+        // live is the number of producer/consumer pairs, blocks go up to the heap sizes
+        c = (struct config){500000, live, 16, 2048};
+        r = bench_prodcons(&c, (int)live);
+    }
+    else if(!strcmp(name, "realloc")) {
+        c = (struct config){2000, 0, 16, 1024 * 1024};
+        r = bench_realloc(&c);
+    }
+    else {
+        fprintf(stderr, "unknown workload %s\n", name);
+        exit(1);
+    }
+    getrusage(RUSAGE_SELF, &usage);
+    peak_rss = usage.ru_maxrss > (long)base_rss ? usage.ru_maxrss - base_rss : 0;
+    // the sequential workload keeps a single block live, its ratio would only measure the baseline
+    if(peak_live)
+        snprintf(frag, sizeof(frag), "%.2f", (double)peak_rss * 1024 / peak_live);
+    for(int i = 0; i < MAX_THREADS; i++) {
+        memcpy(all + n, thread_samples[i].ns, thread_samples[i].count * sizeof(uint32_t));
+        n += thread_samples[i].count;
+    }
+    qsort(all, n, sizeof(uint32_t), compare_u32);
+    printf("%-10s %7zu %-8s %12.0f %7u %7u %7u %10zu %7s\n", name, c.live, label, r.ops / r.seconds,
+           n ? all[n / 2] : 0, n ? all[n * 99 / 100] : 0, n ? all[n * 999 / 1000] : 0, peak_rss, frag);
+}
+
+static void header(void) {
+    printf("%-10s %7s %-8s %12s %7s %7s %7s %10s %7s\n", "workload", "live", "malloc", "ops/s",
+           "p50 ns", "p99 ns", "p999 ns", "peak KiB", "frag");
+    fflush(stdout);
+}
+
+/*
+Run one workload in a child process so that its peak RSS is its own
+@param argv0 Path of this program
+@param name Name of the workload
+@param live Slots of the random workload
+@param preload Shared library to preload or NULL for the system malloc
+*/
+static void spawn(const char *argv0, const char *name, size_t live, const char *preload) {
+    char live_arg[32];
+    pid_t pid;
+    snprintf(live_arg, sizeof(live_arg), "%zu", live);
+    pid = fork();
+    if(pid == 0) {
+        if(preload)
+            setenv("LD_PRELOAD", preload, 1);
+        else
+            unsetenv("LD_PRELOAD");
+        setenv("BENCH_LABEL", preload ? "my" : "system", 1);
+        execl(argv0, argv0, "--one", name, live_arg, (char *)NULL);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+    static const char *workloads[] = {"sequential", "random", "larson", "prodcons", "realloc"};
+    static const size_t scale[] = {1000, 10000, 100000, 1000000};
+    static const size_t pairs[] = {1, 2, 4, 8};
+    const char *preload = NULL;
+    int compare = 0;
+    char lib[4096];
+    // child mode: run a single workload and print its line
+    if(argc == 4 && !strcmp(argv[1], "--one")) {
+        const char *label = getenv("BENCH_LABEL");
+        run(argv[2], label ? label : "current", strtoul(argv[3], NULL, 10));
+        return 0;
+    }
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--compare"))
+            compare = 1;
+        else if(!strncmp(argv[i], "--lib=", 6))
+            preload = argv[i] + 6;
+        else {
+            fprintf(stderr, "usage: %s [--compare] [--lib=path/to/libmyalloc.so]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(compare && !preload) {
+        if(!realpath("libmyalloc.so", lib)) {
+            fprintf(stderr, "libmyalloc.so not found, build it with make lib or pass --lib=\n");
+            return 1;
+        }
+        preload = lib;
+    }
+    header();
+    for(size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        if(compare)
+            spawn(argv[0], workloads[w], 10000, NULL);
+        spawn(argv[0], workloads[w], 10000, compare ? preload : getenv("LD_PRELOAD"));
+    }
+    // the cost per call must not grow with the number of live blocks
+    for(size_t s = 0; s < sizeof(scale) / sizeof(scale[0]); s++) {
+        if(compare)
+            spawn(argv[0], "scale", scale[s], NULL);
+        spawn(argv[0], "scale", scale[s], compare ? preload : getenv("LD_PRELOAD"));
+    }
+    // the throughput of cross-thread frees must grow with the pairs of threads, up to the number of cores
+    for(size_t p = 0; p < sizeof(pairs) / sizeof(pairs[0]); p++) {
+        if(compare)
+            spawn(argv[0], "pairs", pairs[p], NULL);
+        spawn(argv[0], "pairs", pairs[p], compare ? preload : getenv("LD_PRELOAD"));
+    }
+    return 0;
+}
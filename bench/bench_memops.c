@@ -0,0 +1,95 @@
+#include "memops.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microbenchmark of the copy and zero kernels, reports GB/s per kernel and buffer size
+
+#define TOTAL_BYTES (1UL << 31)
+
+typedef void (*copy_fn)(void *, const void *, size_t);
+typedef void (*zero_fn)(void *, size_t);
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void copy_libc(void *dst, const void *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+static void zero_libc(void *dst, size_t n) {
+    memset(dst, 0, n);
+}
+
+/*
+Time a copy kernel over the same two buffers until TOTAL_BYTES are moved
+@param copy Kernel to measure
+@param dst Destination buffer
+@param src Source buffer
+@param n Size of one copy in bytes
+@return Throughput in GB/s
+*/
+static double bench_copy(copy_fn copy, char *dst, const char *src, size_t n) {
+    size_t rounds = TOTAL_BYTES / n;
+    double start;
+    copy(dst, src, n);
+    start = now();
+    for(size_t i = 0; i < rounds; i++) {
+        copy(dst, src, n);
+        __asm__ volatile("" : : "r"(dst) : "memory");
+    }
+    return (double)rounds * n / (now() - start) / 1e9;
+}
+
+/*
+Time a zero kernel over the same buffer until TOTAL_BYTES are cleared
+@param zero Kernel to measure
+@param dst Buffer to clear
+@param n Size of one fill in bytes
+@return Throughput in GB/s
+*/
+static double bench_zero(zero_fn zero, char *dst, size_t n) {
+    size_t rounds = TOTAL_BYTES / n;
+    double start;
+    zero(dst, n);
+    start = now();
+    for(size_t i = 0; i < rounds; i++) {
+        zero(dst, n);
+        __asm__ volatile("" : : "r"(dst) : "memory");
+    }
+    return (double)rounds * n / (now() - start) / 1e9;
+}
+
+int main(void) {
+    static const size_t sizes[] = {4096, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024};
+    struct { const char *name; copy_fn copy; zero_fn zero; } kernels[] = {
+        {"scalar", copy_bytes, zero_words},
+        {"sse2", copy_sse2, zero_sse2},
+        {"avx2", copy_avx2, zero_avx2},
+        {"libc", copy_libc, zero_libc},
+    };
+    size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char *src = malloc(max + 64), *dst = malloc(max + 64);
+    if(!src || !dst)
+        return 1;
+    memset(src, 'x', max + 64);
+    memset(dst, 0, max + 64);
+    printf("%-8s %-6s %12s %10s\n", "kernel", "op", "size", "GB/s");
+    for(size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if(kernels[k].copy == copy_avx2 && !memops_has_avx2())
+            continue;
+        for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            printf("%-8s %-6s %12zu %10.2f\n", kernels[k].name, "copy", sizes[s],
+                   bench_copy(kernels[k].copy, dst, src, sizes[s]));
+            printf("%-8s %-6s %12zu %10.2f\n", kernels[k].name, "zero", sizes[s],
+                   bench_zero(kernels[k].zero, dst, sizes[s]));
+        }
+    }
+    free(src);
+    free(dst);
+    return 0;
+}
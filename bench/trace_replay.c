@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Replays a trace recorded with my_trace_start (or MYALLOC_TRACE) through the standard malloc family,
+// so it runs on the system malloc, or on libmyalloc.so with LD_PRELOAD. --compare runs both
+// The calls are replayed in timestamp order by a single thread, the pointers are renumbered
+// before the timed run so the replay loop only indexes an array
+
+#define NO_ID UINT32_MAX
+
+/*
+Call of the replay, pointers replaced by block numbers
+@param op Operation of the record
+@param id Number of the block allocated or freed
+@param old Number of the block passed to realloc
+@param size Requested size
+@param align Alignment of an aligned allocation
+*/
+struct call {
+    uint32_t op;
+    uint32_t id;
+    uint32_t old;
+    size_t size;
+    size_t align;
+};
+
+/*
+Open addressing map from a recorded address to the number of the live block at that address
+@param keys Recorded addresses, 0 for an unused slot
+@param ids Block numbers
+@param mask Number of slots minus one
+@param count Number of used slots
+*/
+struct id_map {
+    uint64_t *keys;
+    uint32_t *ids;
+    size_t mask;
+    size_t count;
+};
+
+static void *map_zeroed(size_t size) {
+    void *p = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static size_t slot_of(const struct id_map *m, uint64_t key) {
+    return (size_t)((key >> 4) * 0x9E3779B97F4A7C15ULL >> 20) & m->mask;
+}
+
+static void map_init(struct id_map *m, size_t slots) {
+    m->keys = map_zeroed(slots * sizeof(uint64_t));
+    m->ids = map_zeroed(slots * sizeof(uint32_t));
+    m->mask = slots - 1;
+    m->count = 0;
+}
+
+static void map_put(struct id_map *m, uint64_t key, uint32_t id);
+
+static void map_grow(struct id_map *m) {
+    struct id_map old = *m;
+    map_init(m, (old.mask + 1) * 2);
+    for(size_t i = 0; i <= old.mask; i++)
+        if(old.keys[i])
+            map_put(m, old.keys[i], old.ids[i]);
+    munmap(old.keys, (old.mask + 1) * sizeof(uint64_t));
+    munmap(old.ids, (old.mask + 1) * sizeof(uint32_t));
+}
+
+static void map_put(struct id_map *m, uint64_t key, uint32_t id) {
+    size_t i;
+    if(2 * (m->count + 1) > m->mask + 1)
+        map_grow(m);
+    for(i = slot_of(m, key); m->keys[i] && m->keys[i] != key; i = (i + 1) & m->mask)
+        ;
+    if(!m->keys[i])
+        m->count++;
+    m->keys[i] = key;
+    m->ids[i] = id;
+}
+
+/*
+Remove an address from the map, the entries after it are shifted back to close the hole
+@param m Pointer to the map
+@param key Recorded address
+@return Number of the block at that address or NO_ID if it is unknown
+*/
+static uint32_t map_take(struct id_map *m, uint64_t key) {
+    size_t i, j, k;
+    uint32_t id;
+    for(i = slot_of(m, key); m->keys[i] && m->keys[i] != key; i = (i + 1) & m->mask)
+        ;
+    if(!m->keys[i])
+        return NO_ID;
+    id = m->ids[i];
+    for(j = i;;) {
+        j = (j + 1) & m->mask;
+        if(!m->keys[j])
+            break;
+        k = slot_of(m, m->keys[j]);
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        m->keys[i] = m->keys[j];
+        m->ids[i] = m->ids[j];
+        i = j;
+    }
+    m->keys[i] = 0;
+    m->count--;
+    return id;
+}
+
+// records being sorted, qsort gives no way to pass them to the comparison
+static const struct trace_record *sorted;
+
+static int by_time(const void *a, const void *b) {
+    size_t i = *(const size_t *)a, j = *(const size_t *)b;
+    uint64_t x = TRACE_TIME(sorted[i].head), y = TRACE_TIME(sorted[j].head);
+    // records of the same time keep the order of the file
+    if(x == y)
+        return i < j ? -1 : i > j;
+    return x < y ? -1 : 1;
+}
+
+/*
+Sort the records by time and turn the recorded addresses into block numbers
+Frees and reallocs of blocks allocated before the trace started are dropped, a realloc to 0 bytes is replayed as a free
+@param records Records of the trace
+@param n Number of records
+@param calls Set to the calls to replay
+@param blocks Set to the number of blocks
+@return Number of calls
+*/
+static size_t prepare(const struct trace_record *records, size_t n, struct call **calls, uint32_t *blocks) {
+    struct id_map map;
+    struct call *c = map_zeroed(n * sizeof(struct call));
+    size_t *order = map_zeroed(n * sizeof(size_t));
+    size_t count = 0;
+    uint32_t next = 0;
+    for(size_t i = 0; i < n; i++)
+        order[i] = i;
+    sorted = records;
+    qsort(order, n, sizeof(size_t), by_time);
+    map_init(&map, 1 << 16);
+    for(size_t i = 0; i < n; i++) {
+        const struct trace_record *r = &records[order[i]];
+        struct call call = {TRACE_OP(r->head), NO_ID, NO_ID, r->size, 0};
+        switch(call.op) {
+        case TRACE_FREE:
+            if(!r->ptr || (call.id = map_take(&map, r->ptr)) == NO_ID)
+                continue;
+            break;
+        case TRACE_REALLOC:
+            // a realloc to 0 bytes frees the block, any other realloc without a result failed and left it where it was
+            if(!r->ptr && r->old && !r->size) {
+                call.op = TRACE_FREE;
+                if((call.id = map_take(&map, r->old)) == NO_ID)
+                    continue;
+                break;
+            }
+            if(!r->ptr)
+                continue;
+            if(r->old && (call.old = map_take(&map, r->old)) == NO_ID)
+                continue;
+            call.id = next++;
+            map_put(&map, r->ptr, call.id);
+            break;
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+        case TRACE_MEMALIGN:
+            if(!r->ptr)
+                continue;
+            call.align = r->old;
+            call.id = next++;
+            map_put(&map, r->ptr, call.id);
+            break;
+        default:
+            continue;
+        }
+        c[count++] = call;
+    }
+    munmap(order, n * sizeof(size_t));
+    munmap(map.keys, (map.mask + 1) * sizeof(uint64_t));
+    munmap(map.ids, (map.mask + 1) * sizeof(uint32_t));
+    *calls = c;
+    *blocks = next;
+    return count;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t rss_kb(void) {
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(f) {
+        if(fscanf(f, "%*s %ld", &pages) != 1)
+            pages = 0;
+        fclose(f);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+Touch every page of a new block, as the traced program wrote to it, so that the RSS is comparable
+@param p Pointer to the block
+@param size Size of the block
+*/
+static void touch(char *p, size_t size) {
+    for(size_t i = 0; p && i < size; i += 4096)
+        p[i] = 1;
+}
+
+/*
+Replay a trace with the malloc family of the process and print the time and the peak RSS
+@param path Path of the trace
+@param label Name of the allocator printed in the report
+@return 0 on success or 1 if the trace can not be read
+*/
+static int replay(const char *path, const char *label) {
+    const struct trace_record *records;
+    struct call *calls;
+    struct rusage usage;
+    struct stat st;
+    char **blocks;
+    uint32_t nblocks;
+    size_t n, count, base_rss, peak_rss;
+    double start, seconds;
+    char *file;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) || st.st_size < TRACE_MAGIC_SIZE) {
+        fprintf(stderr, "%s: can not read the trace\n", path);
+        return 1;
+    }
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(file == MAP_FAILED || memcmp(file, TRACE_MAGIC, TRACE_MAGIC_SIZE)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        return 1;
+    }
+    records = (const struct trace_record *)(file + TRACE_MAGIC_SIZE);
+    n = (st.st_size - TRACE_MAGIC_SIZE) / sizeof(struct trace_record);
+    count = prepare(records, n, &calls, &nblocks);
+    munmap(file, st.st_size);
+    blocks = map_zeroed(nblocks * sizeof(char *));
+    base_rss = rss_kb();
+    start = now();
+    for(size_t i = 0; i < count; i++) {
+        struct call *c = &calls[i];
+        switch(c->op) {
+        case TRACE_MALLOC:
+            blocks[c->id] = malloc(c->size ? c->size : 1);
+            touch(blocks[c->id], c->size);
+            break;
+        case TRACE_CALLOC:
+            blocks[c->id] = calloc(1, c->size ? c->size : 1);
+            break;
+        case TRACE_MEMALIGN:
+            if(posix_memalign((void **)&blocks[c->id], c->align, c->size ? c->size : 1))
+                blocks[c->id] = NULL;
+            touch(blocks[c->id], c->size);
+            break;
+        case TRACE_REALLOC:
+            blocks[c->id] = realloc(c->old == NO_ID ? NULL : blocks[c->old], c->size ? c->size : 1);
+            if(c->old != NO_ID)
+                blocks[c->old] = NULL;
+            touch(blocks[c->id], c->size);
+            break;
+        case TRACE_FREE:
+            free(blocks[c->id]);
+            blocks[c->id] = NULL;
+            break;
+        }
+    }
+    seconds = now() - start;
+    getrusage(RUSAGE_SELF, &usage);
+    peak_rss = usage.ru_maxrss > (long)base_rss ? usage.ru_maxrss - base_rss : 0;
+    printf("%-8s %10zu calls %10.3f s %8.1f ns/call %10zu KiB peak RSS\n", label, count, seconds,
+           count ? seconds * 1e9 / count : 0, peak_rss);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *lib = NULL, *trace = NULL, *label;
+    char path[4096];
+    int compare = 0;
+    pid_t pid;
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--compare"))
+            compare = 1;
+        else if(!strncmp(argv[i], "--lib=", 6))
+            lib = argv[i] + 6;
+        else
+            trace = argv[i];
+    }
+    if(!trace) {
+        fprintf(stderr, "usage: %s [--compare] [--lib=path/to/libmyalloc.so] trace\n", argv[0]);
+        return 1;
+    }
+    if(!compare) {
+        label = getenv("REPLAY_LABEL");
+        return replay(trace, label ? label : getenv("LD_PRELOAD") ? "my" : "system");
+    }
+    if(!lib) {
+        if(!realpath("libmyalloc.so", path)) {
+            fprintf(stderr, "libmyalloc.so not found, build it with make lib or pass --lib=\n");
+            return 1;
+        }
+        lib = path;
+    }
+    // each allocator runs in its own process so that its peak RSS is its own
+    for(int run = 0; run < 2; run++) {
+        fflush(stdout);
+        pid = fork();
+        if(pid == 0) {
+            if(run)
+                setenv("LD_PRELOAD", lib, 1);
+            else
+                unsetenv("LD_PRELOAD");
+            setenv("REPLAY_LABEL", run ? "my" : "system", 1);
+            execl(argv[0], argv[0], trace, (char *)NULL);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include "alloc.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Standard allocation functions on top of the allocator, built as libmyalloc.so for LD_PRELOAD
+// Every entry point of the malloc family is replaced, so the C library never mixes in its own heap
+
+/*
+Check that a request can be passed to the allocator, whose sizes are signed
+@param size Bytes requested by the program
+@return 1 if the size is valid, 0 otherwise with errno set to ENOMEM
+*/
+static int valid_size(size_t size) {
+    if(size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+Set errno when an allocation fails, as the C library does
+@param p Result of the allocation
+@return The same pointer
+*/
+static void *checked(void *p) {
+    if(!p)
+        errno = ENOMEM;
+    return p;
+}
+
+void *malloc(size_t size) {
+    if(!valid_size(size))
+        return NULL;
+    // malloc(0) returns a unique pointer
+    return checked(my_malloc(size ? size : 1));
+}
+
+void free(void *p) {
+    my_free(p);
+}
+
+// sized frees of C23, the size spares the lookup of the size class of small blocks
+void free_sized(void *p, size_t size) {
+    my_free_sized(p, size);
+}
+
+void free_aligned_sized(void *p, size_t alignment, size_t size) {
+    (void)alignment;
+    my_free_sized(p, size);
+}
+
+void *calloc(size_t num, size_t size) {
+    size_t total;
+    if(__builtin_mul_overflow(num, size, &total) || !valid_size(total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return checked(my_calloc(1, total ? total : 1));
+}
+
+void *realloc(void *p, size_t size) {
+    if(!p)
+        return malloc(size);
+    if(!size) {
+        my_free(p);
+        return NULL;
+    }
+    if(!valid_size(size))
+        return NULL;
+    return checked(my_realloc(p, size));
+}
+
+void *reallocarray(void *p, size_t num, size_t size) {
+    size_t total;
+    if(__builtin_mul_overflow(num, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(p, total);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if(!valid_size(size))
+        return ENOMEM;
+    return my_posix_memalign(memptr, alignment, size ? size : 1);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if(!alignment || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if(!valid_size(size))
+        return NULL;
+    return checked(my_aligned_alloc(alignment, size ? size : 1));
+}
+
+void *memalign(size_t alignment, size_t size) {
+    size_t a = 1;
+    // the legacy interface rounds the alignment up to a power of two
+    while(a < alignment && a <= PTRDIFF_MAX / 2)
+        a <<= 1;
+    return aligned_alloc(a, size);
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if(size > PTRDIFF_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *p) {
+    return my_usable_size(p);
+}
+
+/*
+Write the heap profile to the file named by MYALLOC_PROF_FILE when the program exits
+MYALLOC_PROF_FORMAT picks the format: pprof (default), live or total collapsed stacks
+*/
+static void prof_at_exit(void) {
+    const char *path = getenv("MYALLOC_PROF_FILE");
+    const char *format = getenv("MYALLOC_PROF_FORMAT");
+    int fd;
+    if(!path || (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return;
+    if(format && !strcmp(format, "live"))
+        my_heap_profile(fd, MY_PROF_COLLAPSED_LIVE);
+    else if(format && !strcmp(format, "total"))
+        my_heap_profile(fd, MY_PROF_COLLAPSED_TOTAL);
+    else
+        my_heap_profile(fd, MY_PROF_PPROF);
+    close(fd);
+}
+
+/*
+Start the sampling heap profiler of an unmodified program, MYALLOC_PROF_SAMPLE is the mean number
+of bytes between two samples
+*/
+__attribute__((constructor)) static void prof_from_env(void) {
+    const char *rate = getenv("MYALLOC_PROF_SAMPLE");
+    if(!rate || !strtoul(rate, NULL, 10))
+        return;
+    my_mallopt(MY_M_PROF_SAMPLE, strtoul(rate, NULL, 10));
+    if(getenv("MYALLOC_PROF_FILE"))
+        atexit(prof_at_exit);
+}
+
+static void trace_at_exit(void) {
+    my_trace_stop();
+}
+
+/*
+Record every call of an unmodified program to the file named by MYALLOC_TRACE, a %p in the name is
+replaced by the process id so that the programs it runs do not overwrite its trace
+*/
+__attribute__((constructor)) static void trace_from_env(void) {
+    const char *name = getenv("MYALLOC_TRACE");
+    const char *pid;
+    char path[4096];
+    if(!name || !*name)
+        return;
+    pid = strstr(name, "%p");
+    if(pid)
+        snprintf(path, sizeof(path), "%.*s%ld%s", (int)(pid - name), name, (long)getpid(), pid + 2);
+    else
+        snprintf(path, sizeof(path), "%s", name);
+    if(!my_trace_start(path))
+        atexit(trace_at_exit);
+}
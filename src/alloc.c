@@ -1,74 +1,538 @@
+#define _GNU_SOURCE
 #include "alloc.h"
+#include "slab.h"
+#include "memops.h"
+#include "prof.h"
+#include "trace.h"
+#include "pagemap.h"
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <errno.h>
+#include <stdarg.h>
+#ifdef MY_ALLOC_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <sys/sysinfo.h>
+#endif
+#ifdef MY_ALLOC_DEBUG
+#include <stdlib.h>
+#endif
 
 #define BLOCK_SIZE offsetof(struct block, anchor)
+#define NUM_BINS 256
+#define BIN_MAP_WORDS (NUM_BINS / 64)
+#define SMALL_BIN_LIMIT 256
+// Free blocks store their bin links in the first 16 bytes of the payload
+#define NEXT_FREE(b) (((meta_block *)(b)->anchor)[0])
+#define PREV_FREE(b) (((meta_block *)(b)->anchor)[1])
+#define MIN_BIN_SIZE (2 * sizeof(meta_block))
+// Status bits stored in the low bits of the size word
+#define BLOCK_FREE 1
+#define BLOCK_PREV_FREE 2
+#define BLOCK_MMAPPED 4
+#define BLOCK_FLAGS 7
+// the owner of a claimed block reads its size word without the lock while a neighbour flips its BLOCK_PREV_FREE
+// bit under the lock, so the word is always written atomically. The writers are serialized by the lock, a
+// relaxed store is enough and costs a plain store
+#define SET_SIZE(b, value) __atomic_store_n(&(b)->size, (value), __ATOMIC_RELAXED)
+#define LARGE_HEADER offsetof(struct large_block, meta)
+#define PAGE_SIZE 4096
+// alignment of every payload, the metadata block is 16 bytes so blocks stay aligned back to back
+#define ALIGNMENT 16
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1))
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024)
+#define DEFAULT_TOP_PAD (64 * 1024)
+#define LARGE_CACHE_SLOTS 8
+#define LARGE_CACHE_MAX (32 * 1024 * 1024)
+// blocks sorted and freed together by my_free_batch
+#define FREE_BATCH 256
+// freed heap blocks up to DEFAULT_MXFAST bytes wait in a fast bin of their exact size without being merged
+// smaller sizes go to the slabs by default, so the limit covers the smallest sizes the heap serves
+#define DEFAULT_MXFAST 1024
+#define FASTBIN_MAX_SIZE 1024
+#define FAST_BINS (FASTBIN_MAX_SIZE / ALIGNMENT)
+#define FAST_INDEX(size) ((size) / ALIGNMENT - 1)
+// freeing a block at least this large merges the fast bins, so that the top chunk can be trimmed
+#define FAST_CONSOLIDATE (64 * 1024)
+
+// Where the memory of a heap comes from
+#define HEAP_SBRK 0
+#define HEAP_BUFFER 1
+#define HEAP_MAPPED 2
+// growable heap of a CPU, its pages are recorded in the page map with the heap as owner
+#define HEAP_CPU 3
+// address range reserved by a growable heap, its pages are only backed once they are used
+#define MAPPED_HEAP_RESERVE (1UL << 30)
+// bytes the top chunk of the default heap always keeps for the header of a fencepost
+#define TOP_RESERVE BLOCK_SIZE
 
 typedef struct block *meta_block;
+struct heap_dump;
+struct my_heap;
+
+static size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+static size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+static size_t top_pad = DEFAULT_TOP_PAD;
+static size_t max_fast = DEFAULT_MXFAST;
+// live mmapped blocks
+static struct large_block *large_blocks = NULL;
+// recently unmapped regions kept to skip the mmap/munmap syscalls
+static struct {
+    void *addr;
+    size_t len;
+} large_cache[LARGE_CACHE_SLOTS];
+static size_t large_cache_bytes = 0;
+
+#ifdef MY_ALLOC_THREADS
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_CLASSES (TCACHE_MAX_SIZE / ALIGNMENT + 1)
+#define TCACHE_COUNT 32
+#define TCACHE_FILL 16
+// heaps of my_mallopt(MY_M_PERCPU), CPUs past the last one share the heaps modulo the count
+#define MAX_CPU_HEAPS 64
+#define LOCK_HEAP(h) pthread_mutex_lock(&(h)->lock)
+#define TRYLOCK_HEAP(h) pthread_mutex_trylock(&(h)->lock)
+#define UNLOCK_HEAP(h) pthread_mutex_unlock(&(h)->lock)
+#define LOCK_LARGE() pthread_mutex_lock(&large_lock)
+#define UNLOCK_LARGE() pthread_mutex_unlock(&large_lock)
+
+/*
+Per-thread cache of blocks that are claimed in the heap but free for the user
+@param entries Singly-linked lists of cached payloads per 16-byte size class, linked through their first word
+@param count Number of cached blocks per size class
+@param registered 1 if the thread exit destructor is armed for this thread
+@param owned 1 once the thread asked for a slab owner, the table of owners may have had none left
+@param owner Owner of the slabs the slots of the cache come from, NULL if they come from the shared slabs
+*/
+struct tcache {
+    void *entries[TCACHE_CLASSES];
+    unsigned int count[TCACHE_CLASSES];
+    int registered;
+    int owned;
+    struct slab_owner *owner;
+};
+
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static __thread struct tcache tcache;
+// number of per-CPU heaps, 0 while the mode is off
+static unsigned int cpu_heap_count = 0;
+static struct my_heap *cpu_heaps[MAX_CPU_HEAPS];
+
+void tcache_init_key(void);
+void tcache_arm(void);
+struct tcache *get_tcache(void);
+void *tcache_get(size_t size);
+int tcache_put(void *p, size_t size);
+void tcache_collect(struct tcache *tc);
+void tcache_flush(struct tcache *tc, size_t i, unsigned int keep);
+void tcache_destroy(void *arg);
+void heap_remote_free(struct my_heap *h, meta_block first, meta_block last);
+void collect_remote(struct my_heap *h);
+void fork_prepare(void);
+void fork_parent(void);
+void fork_child(void);
+void unlock_heaps(void);
+struct my_heap *cpu_heap(void);
+// the mode is switched by my_mallopt while other threads allocate
+#define PERCPU_ON() __atomic_load_n(&cpu_heap_count, __ATOMIC_RELAXED)
+// heap that serves the allocations of the calling thread
+#define ALLOC_HEAP() (PERCPU_ON() ? cpu_heap() : &main_heap)
+#else
+#define ALLOC_HEAP() (&main_heap)
+#define LOCK_HEAP(h)
+#define UNLOCK_HEAP(h)
+#define LOCK_LARGE()
+#define UNLOCK_LARGE()
+#endif
+
+#ifndef MY_ALLOC_NO_STATS
+// events counted by a thread before they are added to the shared counters
+#define STATS_BATCH 64
+#define STAT_ALLOC(request, size) stats_alloc(request, size)
+#define STAT_FREE(size) stats_free(size)
+#define STAT_REALLOC(old_size, new_size) stats_realloc(old_size, new_size)
+#define STAT_HEAP(h, counter) ((h)->counters.counter++)
+#define STAT_HEAP_ADD(h, counter, n) ((h)->counters.counter += (n))
+
+/*
+Counters of the entry points, kept per thread and added to stats_total in batches in thread-safe builds
+@param live Change of the usable bytes held by the user
+@param mallocs Number of allocations
+@param frees Number of frees
+@param reallocs Number of resizes
+@param histogram Requested sizes per power of two
+@param pending Events counted since the last flush
+*/
+struct stats_counters {
+    ptrdiff_t live;
+    size_t mallocs;
+    size_t frees;
+    size_t reallocs;
+    size_t histogram[MY_STATS_BUCKETS];
+    unsigned int pending;
+};
+
+/*
+Counters of a heap, only updated under its lock
+@param blocks Number of blocks between the base and the top chunk, each one has a header
+@param free_bytes Payload bytes of the binned blocks and of the blocks of the fast bins
+*/
+struct heap_counters {
+    size_t blocks;
+    size_t free_bytes;
+    size_t extend_heap;
+    size_t split_block;
+    size_t fusion;
+    size_t searches;
+    size_t search_steps;
+    size_t search_misses;
+};
+
+static struct stats_counters stats_total;
+#ifdef MY_ALLOC_THREADS
+static __thread struct stats_counters stats_local;
+#define STATS_LOCAL (&stats_local)
+#else
+#define STATS_LOCAL (&stats_total)
+#endif
+
+void stats_alloc(size_t request, size_t size);
+void stats_free(size_t size);
+void stats_realloc(size_t old_size, size_t new_size);
+void stats_flush(struct stats_counters *c);
+void stats_heap(struct my_heap *h, struct my_malloc_stats *s);
+size_t allocated_size(void *p);
+#else
+#define STAT_ALLOC(request, size)
+#define STAT_FREE(size)
+// the old size is still evaluated, a variable that only feeds the counters is not reported as unused
+#define STAT_REALLOC(old_size, new_size) ((void)(old_size))
+#define STAT_HEAP(h, counter)
+#define STAT_HEAP_ADD(h, counter, n)
+#endif
 
-meta_block base = NULL;
+// bytes the thread allocates before its next sampled allocation, the first allocation draws the first interval
+#ifdef MY_ALLOC_THREADS
+static __thread ptrdiff_t prof_countdown;
+#else
+static ptrdiff_t prof_countdown;
+#endif
+// calls are only recorded while a trace is started, one load and branch otherwise
+#define TRACE(op, p, old, size) do { \
+        if(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) \
+            trace_record(op, p, old, size); \
+    } while(0)
+#define PROF_ALLOC(p, size) do { \
+        if((prof_countdown -= (ptrdiff_t)(size)) < 0) \
+            prof_countdown = prof_sample(p, size); \
+    } while(0)
 
 size_t align_64b(ssize_t x);
-meta_block find_block(meta_block *last, size_t size);
-meta_block extend_heap(meta_block last, size_t new_size);
-void split_block(meta_block b, size_t new_size);
+size_t block_size(meta_block b);
+int block_free(meta_block b);
+meta_block next_block(struct my_heap *h, meta_block b);
+meta_block prev_block(struct my_heap *h, meta_block b);
+void mark_block(struct my_heap *h, meta_block b, int free);
+size_t get_bin_index(size_t size);
+size_t get_bin_size(size_t index);
+void insert_free_block(struct my_heap *h, meta_block b);
+void remove_free_block(struct my_heap *h, meta_block b);
+void reset_bins(struct my_heap *h);
+meta_block find_block(struct my_heap *h, meta_block *last, size_t size);
+meta_block extend_heap(struct my_heap *h, meta_block last, size_t new_size);
+char *take_top(struct my_heap *h, size_t size);
+void publish_top(struct my_heap *h, char *top);
+int new_segment(struct my_heap *h);
+void reset_top(struct my_heap *h);
+void trim_top(struct my_heap *h);
+void split_block(struct my_heap *h, meta_block b, size_t new_size);
+void *heap_malloc(struct my_heap *h, size_t new_size, size_t *dirty);
+void heap_free(struct my_heap *h, meta_block b);
+void heap_free_fast(struct my_heap *h, meta_block b);
+void free_heap_block(struct my_heap *h, meta_block b);
+void consolidate_fast(struct my_heap *h);
+size_t heap_malloc_batch(struct my_heap *h, size_t size, size_t n, void **ptrs);
+size_t carve_blocks(struct my_heap *h, meta_block b, size_t size, size_t n, void **ptrs);
+void heap_free_batch(struct my_heap *h, meta_block *blocks, size_t n);
+void sort_blocks(meta_block *blocks, size_t n);
+void *heap_realloc(struct my_heap *h, void *p, size_t new_size);
+void absorb_next_block(struct my_heap *h, meta_block b, meta_block next);
+int heap_expand(struct my_heap *h, meta_block b, size_t size);
+void shrink_block(struct my_heap *h, meta_block b, size_t size);
+size_t large_resize_in_place(meta_block meta, size_t size);
+size_t my_try_expand(void *p, size_t min_size, size_t preferred_size);
+size_t my_shrink_in_place(void *p, size_t size);
 void *my_malloc(size_t new_size);
+void *alloc_memory(size_t new_size, size_t *dirty);
+size_t page_size(void);
 void *my_calloc(size_t num, size_t size);
-meta_block fusion(meta_block block, int ok);
+meta_block fusion(struct my_heap *h, meta_block block, int ok);
 meta_block get_pointer_to_meta_block(void *ptr);
 int valid_addr(void *p);
+int heap_valid_addr(struct my_heap *h, void *p);
+int find_owner(void *p, meta_block *meta);
+int find_heap_owner(void *p, meta_block *meta, struct my_heap **heap);
 void my_free(void *p);
+void my_free_sized(void *p, size_t size);
+void free_memory(void *p);
+size_t my_malloc_batch(size_t size, size_t n, void **ptrs);
+void my_free_batch(void **ptrs, size_t n);
 void copy_block(meta_block original, meta_block copy);
-meta_block find_last_block(void);
+meta_block find_last_block(struct my_heap *h);
 void *my_realloc(void *p, size_t new_size);
+void *realloc_memory(void *p, size_t new_size);
+int my_mallopt(int param, size_t value);
+struct my_heap *my_heap_create(void *buffer, size_t len);
+struct my_heap *my_heap_create_growable(void);
+void init_heap(struct my_heap *h, int source, char *limit);
+void my_heap_destroy(struct my_heap *h);
+void *my_heap_malloc(struct my_heap *h, size_t size);
+void my_heap_free(struct my_heap *h, void *p);
+void *my_heap_realloc(struct my_heap *h, void *p, size_t size);
+void *large_malloc(size_t new_size, size_t *dirty);
+meta_block find_large_block(void *p);
+void large_free(meta_block meta);
+void *large_realloc(void *p, size_t new_size);
+void *large_memalign(size_t alignment, size_t size);
+void *heap_memalign(struct my_heap *h, size_t alignment, size_t size);
+void *my_aligned_alloc(size_t alignment, size_t size);
+int my_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *my_memalign(size_t alignment, size_t size);
+size_t my_usable_size(void *p);
+struct my_malloc_stats my_malloc_stats(void);
+struct my_heap_summary my_heap_walk(my_heap_walker walker, void *arg);
+int my_heap_dump(int fd, int format);
+int my_heap_profile(int fd, int format);
+int my_trace_start(const char *path);
+void my_trace_stop(void);
+void dump_block(const struct my_heap_block *block, void *arg);
+int dump_printf(struct heap_dump *d, const char *format, ...);
 /*
 Metadata block
-@param size Size that the user allocates
-@param next Pointer to the next block in the double-linked list
-@param prev Pointer to the previous block in the double-linked list
-@param free Int(otherwise padding) if the chunk is free 1->free | 0->claimed 
+Neighbours are found through the sizes: the next block starts right after the payload
+and the previous one ends right before the metadata block
+@param prev_size Boundary tag with the payload size of the previous block (0 for the first block)
+@param size Payload size with the status bits in the 3 low bits (BLOCK_FREE, BLOCK_PREV_FREE, BLOCK_MMAPPED)
 @param anchor Pointer to the first byte after the metadata block
 */
 struct block {
-    size_t  size;
-    meta_block next;
-    meta_block prev;
-    int free;
-    int padding;
+    size_t prev_size;
+    size_t size;
     char anchor[1];
 };
 
+/*
+State of my_heap_dump, the output is buffered on the stack since the heap can not be used while it is walked
+@param fd File descriptor written to
+@param format MY_HEAP_DUMP_JSON or MY_HEAP_DUMP_CSV
+@param blocks Number of blocks written so far
+@param len Number of buffered bytes
+@param error 1 if a write failed
+@param buf Output buffer
+*/
+struct heap_dump {
+    int fd;
+    int format;
+    size_t blocks;
+    size_t len;
+    int error;
+    char buf[4096];
+};
+
+/*
+Header of an mmapped block
+@param next Pointer to the next live mmapped block
+@param prev Pointer to the previous live mmapped block
+@param meta Metadata block of the payload, flagged with BLOCK_MMAPPED, its prev_size is the offset
+of the header in the mapping (0 unless the block was allocated with a large alignment)
+*/
+struct large_block {
+    struct large_block *next;
+    struct large_block *prev;
+    struct block meta;
+};
+
+/*
+State of a heap, the default heap grows with the program break and every other heap in its own memory
+The white-box tests reach the first block of the default heap through its address, base has to stay first
+@param base Pointer to the first block, NULL for an empty heap
+@param tail Pointer to the last block
+@param top Start of the top chunk, the space between the last block and top_end
+@param top_end End of the memory of the heap handed out so far (the program break of the default heap)
+@param heap_clean Memory of the heap from this address on has never been handed out since the kernel zeroed it
+@param limit End of the memory the heap can grow into, unused by the default heap
+@param source HEAP_SBRK, HEAP_BUFFER, HEAP_MAPPED or HEAP_CPU
+@param bins Free blocks per size class
+@param bin_map Bitmap of the non-empty bins
+@param fastbins Freed blocks that are not merged yet, per payload size (FAST_INDEX), linked through NEXT_FREE
+@param fast_map Bitmap of the non-empty fast bins
+@param lock Lock of the heap
+@param remote Blocks freed while another thread held the lock, linked through NEXT_FREE and still claimed
+@param next Pointer to the next heap of the list of heaps that fork_prepare locks
+@param prev Pointer to the previous heap of that list
+@param counters Work of the heap reported by my_malloc_stats
+*/
+struct my_heap {
+    meta_block base;
+    meta_block tail;
+    char *top;
+    char *top_end;
+    char *heap_clean;
+    char *limit;
+    int source;
+    meta_block bins[NUM_BINS];
+    uint64_t bin_map[BIN_MAP_WORDS];
+    meta_block fastbins[FAST_BINS];
+    uint64_t fast_map;
+#ifdef MY_ALLOC_THREADS
+    pthread_mutex_t lock;
+    meta_block remote;
+    struct my_heap *next;
+    struct my_heap *prev;
+#endif
+#ifndef MY_ALLOC_NO_STATS
+    struct heap_counters counters;
+#endif
+};
+
+// the heap of my_malloc and the other my_* functions
+#ifdef MY_ALLOC_THREADS
+struct my_heap main_heap = {.source = HEAP_SBRK, .lock = PTHREAD_MUTEX_INITIALIZER};
+// heaps created with my_heap_create and my_heap_create_growable
+static struct my_heap *heaps = NULL;
+static pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+struct my_heap main_heap = {.source = HEAP_SBRK};
+#endif
+
 
 /*
 Custom malloc function
+Small sizes are served from the thread cache in thread-safe builds, then from the slabs
+Sizes above the mmap threshold get their own mapping and everything else locks the heap
+In the per-CPU mode every size below the mmap threshold comes from the heap of the CPU
 @param new_size The bytes allocated by the user
 @return Pointer to the begining of the new allocated heap memory
 */
 void *my_malloc(size_t new_size) {
+    void *p = alloc_memory(new_size, NULL);
+    TRACE(TRACE_MALLOC, p, NULL, new_size);
+    return p;
+}
+
+/*
+Allocate memory from the tier that serves the size and tell how much of it may not be zero
+@param new_size The bytes allocated by the user
+@param dirty Set to the number of leading bytes of the payload that may not be zero, can be NULL
+@return Pointer to the begining of the new allocated memory
+*/
+void *alloc_memory(size_t new_size, size_t *dirty) {
+    struct my_heap *h = ALLOC_HEAP();
+    void *p = NULL;
+    if(dirty)
+        *dirty = new_size;
+#ifdef MY_ALLOC_THREADS
+    // a per-CPU heap replaces the thread cache and the slabs, its fast bins are the cache of the CPU
+    if(h == &main_heap)
+        p = tcache_get(new_size);
+    if(p) {
+        STAT_ALLOC(new_size, allocated_size(p));
+        PROF_ALLOC(p, new_size);
+        return p;
+    }
+#endif
+    if(h == &main_heap)
+        p = slab_malloc(new_size);
+    if(!p) {
+        if(new_size >= mmap_threshold)
+            p = large_malloc(new_size, dirty);
+        else {
+            LOCK_HEAP(h);
+            p = heap_malloc(h, new_size, dirty);
+            UNLOCK_HEAP(h);
+            // a full per-CPU heap falls back to the default heap
+            if(!p && h != &main_heap) {
+                LOCK_HEAP(&main_heap);
+                p = heap_malloc(&main_heap, new_size, dirty);
+                UNLOCK_HEAP(&main_heap);
+            }
+        }
+    }
+    if(p) {
+        STAT_ALLOC(new_size, allocated_size(p));
+        PROF_ALLOC(p, new_size);
+    }
+    return p;
+}
+
+/*
+Allocate a block from the heap, the caller holds the heap lock
+A block carved from the top chunk above heap_clean lies on pages the kernel has just zeroed
+@param h Pointer to the heap
+@param new_size The bytes allocated by the user
+@param dirty Set to the number of leading bytes of the payload that may not be zero, can be NULL
+@return Pointer to the begining of the new allocated heap memory
+*/
+void *heap_malloc(struct my_heap *h, size_t new_size, size_t *dirty) {
     meta_block block = NULL;
     meta_block last = NULL;
-    new_size = align_64b(new_size);          // 8-byte aligned input for sbrk()  
+    char *clean;
+    new_size = align_64b(new_size);          // 16-byte aligned input for sbrk()  
     if(!new_size)
         return NULL;
-    if (base == NULL) {
-    // First block allocation
-        base = extend_heap(NULL, new_size);
-        if(!base)
-            return NULL;
-        block = base;
-    } else {
-        block = find_block(&last, new_size);
-        if(block) {
-            if(block->size - new_size >= BLOCK_SIZE + 8)
-                split_block(block, new_size);
-            block->free = 0;
-        } else {
-            block = extend_heap(last, new_size);
-            if(!block)
-                return NULL; 
-        }
+    // a free block has to hold its bin links
+    if(new_size < MIN_BIN_SIZE)
+        new_size = MIN_BIN_SIZE;
+#ifdef MY_ALLOC_THREADS
+    if(__atomic_load_n(&h->remote, __ATOMIC_RELAXED))
+        collect_remote(h);
+#endif
+    // the blocks of a fast bin have exactly the requested size and are still marked as claimed
+    if(new_size <= max_fast && (block = h->fastbins[FAST_INDEX(new_size)])) {
+        if(!(h->fastbins[FAST_INDEX(new_size)] = NEXT_FREE(block)))
+            h->fast_map &= ~(1ULL << FAST_INDEX(new_size));
+        STAT_HEAP_ADD(h, free_bytes, -new_size);
+        if(dirty)
+            *dirty = new_size;
+        return (void*) block->anchor;
+    }
+    block = find_block(h, &last, new_size);
+    // the fast bins are merged once no bin can serve the request, before the heap grows
+    if(!block && h->fast_map) {
+        consolidate_fast(h);
+        last = NULL;
+        block = find_block(h, &last, new_size);
+    }
+    if(block) {
+        remove_free_block(h, block);
+        if(block_size(block) - new_size >= BLOCK_SIZE + MIN_BIN_SIZE)
+            split_block(h, block, new_size);
+        else
+            mark_block(h, block, 0);
+        if(dirty)
+            *dirty = block_size(block);
+        return (void*) block->anchor;
+    }
+    if(!h->base)
+        reset_top(h);
+    clean = h->heap_clean;
+    // a heap without blocks starts over, its first block becomes the base
+    block = extend_heap(h, last, new_size);
+    if(!block)
+        return NULL;
+    if(!h->base)
+        __atomic_store_n(&h->base, block, __ATOMIC_RELAXED);
+    if(dirty) {
+        *dirty = clean > block->anchor ? (size_t)(clean - block->anchor) : 0;
+        if(*dirty > new_size)
+            *dirty = new_size;
     }
     return (void*) block->anchor;  
 }
@@ -77,22 +541,155 @@ void *my_malloc(size_t new_size) {
  Allocates memory for an array and initializes all bytes in the allocated block to zero
  @param num Number of elements to allocate
  @param size Size of each element
- @return Pointer to the begining of the new allocated heap memory
+ @return Pointer to the begining of the new allocated heap memory, or NULL if num * size overflows
 */
 void *my_calloc(size_t num, size_t size) {
-    size_t *new;
-    size_t size_8, i;
-    new = my_malloc(num * size);
-    if(new) {
-        size_8 = align_64b(num*size)>>3; 
-        for(i=0; i<size_8; i++)
-            new[i]=0;
-    }
+    void *new;
+    size_t dirty, total;
+    // a wrapped product would hand out a small block the caller takes for a huge one
+    if(__builtin_mul_overflow(num, size, &total))
+        return NULL;
+    new = alloc_memory(total, &dirty);
+    // fresh pages from the kernel are already zero
+    if(new && dirty)
+        mem_zero(new, dirty < total ? dirty : total);
+    TRACE(TRACE_CALLOC, new, NULL, total);
     return new;
 }
 
 /*
-Takes the value of the chunk size and aligns it to 8 bytes
+Size of a page of the system, which may be larger than PAGE_SIZE
+@return Page size in bytes
+*/
+size_t page_size(void) {
+    static size_t size;
+    if(!size)
+        size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/*
+Allocate memory whose address is a multiple of the given alignment
+@param alignment Power of two the address has to be a multiple of
+@param size The bytes allocated by the user
+@return Pointer to the aligned memory or NULL if the alignment is not a power of two or the allocation failed
+*/
+void *my_aligned_alloc(size_t alignment, size_t size) {
+    struct my_heap *h;
+    void *p;
+    if(!alignment || (alignment & (alignment - 1)))
+        return NULL;
+    if(alignment <= ALIGNMENT)
+        return my_malloc(size);
+    size = align_64b(size);
+    if(!size || alignment > PTRDIFF_MAX / 4 || size > PTRDIFF_MAX / 2 - alignment)
+        return NULL;
+    if(size + alignment >= mmap_threshold)
+        p = large_memalign(alignment, size);
+    else {
+        h = ALLOC_HEAP();
+        LOCK_HEAP(h);
+        p = heap_memalign(h, alignment, size);
+        UNLOCK_HEAP(h);
+    }
+    if(p) {
+        STAT_ALLOC(size, block_size(get_pointer_to_meta_block(p)));
+        PROF_ALLOC(p, size);
+    }
+    TRACE(TRACE_MEMALIGN, p, (void *)alignment, size);
+    return p;
+}
+
+/*
+Allocate aligned memory with the POSIX interface
+@param memptr Set to the aligned memory on success, left untouched otherwise
+@param alignment Power of two multiple of sizeof(void *)
+@param size The bytes allocated by the user
+@return 0 on success, EINVAL for an invalid alignment or ENOMEM if the allocation failed
+*/
+int my_posix_memalign(void **memptr, size_t alignment, size_t size) {
+    void *p;
+    if(!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void *))
+        return EINVAL;
+    p = my_aligned_alloc(alignment, size);
+    if(!p)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+/*
+Allocate aligned memory with the legacy interface, same as my_aligned_alloc
+@param alignment Power of two the address has to be a multiple of
+@param size The bytes allocated by the user
+@return Pointer to the aligned memory or NULL
+*/
+void *my_memalign(size_t alignment, size_t size) {
+    return my_aligned_alloc(alignment, size);
+}
+
+/*
+Number of bytes that can be used in an allocated block, at least the size that was requested
+@param p Pointer to the payload of an allocated block
+@return Usable size of the block or 0 if p is NULL or was not allocated by this allocator
+*/
+size_t my_usable_size(void *p) {
+    meta_block meta;
+    switch(find_owner(p, &meta)) {
+    case PAGEMAP_SLAB:
+        return slab_slot_size(p);
+    case PAGEMAP_HEAP:
+    case PAGEMAP_LARGE:
+        return block_size(meta);
+    }
+    return 0;
+}
+
+/*
+Allocate an aligned block from the heap, the caller holds the heap lock
+A block large enough for the size and the alignment is allocated, the slack before the aligned
+address becomes a free block of its own and so does the excess after the payload
+@param h Pointer to the heap
+@param alignment Power of two larger than ALIGNMENT
+@param size The bytes allocated by the user, aligned to ALIGNMENT
+@return Pointer to the aligned payload or NULL if the heap is full
+*/
+void *heap_memalign(struct my_heap *h, size_t alignment, size_t size) {
+    meta_block block, aligned, rest;
+    uintptr_t start;
+    size_t lead;
+    // the leading slack is either empty or large enough to hold a free block
+    char *p = heap_malloc(h, size + alignment + BLOCK_SIZE + MIN_BIN_SIZE, NULL);
+    if(!p)
+        return NULL;
+    block = get_pointer_to_meta_block(p);
+    start = (uintptr_t)p;
+    if(start % alignment)
+        start = (start + BLOCK_SIZE + MIN_BIN_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    lead = start - (uintptr_t)p;
+    if(lead) {
+        aligned = get_pointer_to_meta_block((void *)start);
+        SET_SIZE(aligned, block_size(block) - lead);
+        if(block == h->tail)
+            h->tail = aligned;
+        SET_SIZE(block, (lead - BLOCK_SIZE) | (block->size & BLOCK_PREV_FREE));
+        STAT_HEAP_ADD(h, blocks, 1);
+        mark_block(h, aligned, 0);
+        // merges the slack with a free previous neighbour
+        heap_free(h, block);
+        block = aligned;
+    }
+    if(block_size(block) >= size + BLOCK_SIZE + MIN_BIN_SIZE) {
+        split_block(h, block, size);
+        rest = next_block(h, block);
+        remove_free_block(h, rest);
+        heap_free(h, rest);
+    }
+    return block->anchor;
+}
+
+/*
+Takes the value of the chunk size and aligns it to ALIGNMENT (16 bytes, the max_align_t of x86-64)
 @param x The number of bytes as ssize_t
 @return size_t of the aligned value or 0 if the provided value is negative
 */
@@ -101,90 +698,440 @@ size_t align_64b(ssize_t x) {
         fprintf(stderr, "Error: Negative byte amount allocation is not permited!\n");
         return 0;
     }
-    return (((x-1)>>3)<<3)+8;
+    return (((x-1)>>4)<<4)+ALIGNMENT;
+}
+
+/*
+Payload size of a block without the status bits
+@param b Pointer to the meta block
+@return Size of the payload in bytes
+*/
+size_t block_size(meta_block b) {
+    return __atomic_load_n(&b->size, __ATOMIC_RELAXED) & ~(size_t)BLOCK_FLAGS;
+}
+
+/*
+Checks the free bit of a block
+@param b Pointer to the meta block
+@return 1 if the block is free or 0 if it is claimed
+*/
+int block_free(meta_block b) {
+    return (__atomic_load_n(&b->size, __ATOMIC_RELAXED) & BLOCK_FREE) != 0;
+}
+
+/*
+Finds the block that follows in memory
+@param h Pointer to the heap
+@param b Pointer to the meta block
+@return Pointer to the next meta block or NULL if b is the last block of the heap
+*/
+meta_block next_block(struct my_heap *h, meta_block b) {
+    if(b == h->tail)
+        return NULL;
+    return (meta_block)(b->anchor + block_size(b));
+}
+
+/*
+Finds the block that precedes in memory through the boundary tag
+@param h Pointer to the heap
+@param b Pointer to the meta block
+@return Pointer to the previous meta block or NULL if b is the first block of the heap
+*/
+meta_block prev_block(struct my_heap *h, meta_block b) {
+    if(b == h->base)
+        return NULL;
+    return (meta_block)((char*)b - b->prev_size - BLOCK_SIZE);
+}
+
+/*
+Set the free bit of a block and update the boundary tag and the BLOCK_PREV_FREE bit of the next block
+@param h Pointer to the heap
+@param b Pointer to the meta block
+@param free 1 to mark the block as free or 0 to mark it as claimed
+*/
+void mark_block(struct my_heap *h, meta_block b, int free) {
+    meta_block next = next_block(h, b);
+    if(free)
+        SET_SIZE(b, b->size | BLOCK_FREE);
+    else
+        SET_SIZE(b, b->size & ~(size_t)BLOCK_FREE);
+    if(next) {
+        next->prev_size = block_size(b);
+        if(free)
+            SET_SIZE(next, next->size | BLOCK_PREV_FREE);
+        else
+            SET_SIZE(next, next->size & ~(size_t)BLOCK_PREV_FREE);
+    }
+}
+
+/*
+Maps a payload size to its size class (bin)
+Sizes under SMALL_BIN_LIMIT get one bin every 8 bytes, larger sizes get 4 geometric bins per power of two
+@param size Payload size in bytes
+@return Index of the bin that holds blocks of this size
+*/
+size_t get_bin_index(size_t size) {
+    size_t log;
+    if(size < SMALL_BIN_LIMIT)
+        return size >> 3;
+    log = 63 - __builtin_clzll(size);
+    return SMALL_BIN_LIMIT / 8 + (log - 8) * 4 + ((size >> (log - 2)) & 3);
+}
+
+/*
+Smallest payload size that can be stored in a bin (inverse of get_bin_index)
+@param index Bin index
+@return Lower bound of the size class
+*/
+size_t get_bin_size(size_t index) {
+    size_t log;
+    if(index < SMALL_BIN_LIMIT / 8)
+        return index << 3;
+    index -= SMALL_BIN_LIMIT / 8;
+    log = 8 + (index >> 2);
+    return (4 + (index & 3)) << (log - 2);
 }
 
 /*
-Find the first free block that matches the size 
-Modifies content of the caller param to the block prior to the first valid block
+Push a free block at the head of the bin of its size class and mark the bin as non-empty
+Blocks smaller than MIN_BIN_SIZE cannot hold the links, they are only reclaimed through fusion
+@param h Pointer to the heap
+@param b Pointer to the free block
+*/
+void insert_free_block(struct my_heap *h, meta_block b) {
+    size_t i;
+    if(block_size(b) < MIN_BIN_SIZE)
+        return;
+    i = get_bin_index(block_size(b));
+    NEXT_FREE(b) = h->bins[i];
+    PREV_FREE(b) = NULL;
+    if(h->bins[i])
+        PREV_FREE(h->bins[i]) = b;
+    h->bins[i] = b;
+    h->bin_map[i >> 6] |= 1ULL << (i & 63);
+    STAT_HEAP_ADD(h, free_bytes, block_size(b));
+}
+
+/*
+Unlink a free block from its bin and clear the bin bit if the bin becomes empty
+@param h Pointer to the heap
+@param b Pointer to the free block
+*/
+void remove_free_block(struct my_heap *h, meta_block b) {
+    size_t i;
+    if(block_size(b) < MIN_BIN_SIZE)
+        return;
+    i = get_bin_index(block_size(b));
+    if(PREV_FREE(b))
+        NEXT_FREE(PREV_FREE(b)) = NEXT_FREE(b);
+    else
+        h->bins[i] = NEXT_FREE(b);
+    if(NEXT_FREE(b))
+        PREV_FREE(NEXT_FREE(b)) = PREV_FREE(b);
+    if(!h->bins[i])
+        h->bin_map[i >> 6] &= ~(1ULL << (i & 63));
+    STAT_HEAP_ADD(h, free_bytes, -block_size(b));
+}
+
+/*
+Forget every binned block and every block of the fast bins, used when a new heap is started
+@param h Pointer to the heap
+*/
+void reset_bins(struct my_heap *h) {
+    size_t i;
+    for(i = 0; i < NUM_BINS; i++)
+        h->bins[i] = NULL;
+    for(i = 0; i < BIN_MAP_WORDS; i++)
+        h->bin_map[i] = 0;
+    for(i = 0; i < FAST_BINS; i++)
+        h->fastbins[i] = NULL;
+    h->fast_map = 0;
+    h->tail = NULL;
+    STAT_HEAP_ADD(h, blocks, -h->counters.blocks);
+    STAT_HEAP_ADD(h, free_bytes, -h->counters.free_bytes);
+}
+
+/*
+Find a free block that matches the size in O(1) through the bin bitmap
+The search starts at the first bin whose every block is large enough for the request
+Modifies content of the caller param to the last block of the heap if no block fits
+@param h Pointer to the heap
 @param last Pointer to a meta_block pointer
 @param size Bytes allocated by the user
-@return Pointer to the first block with necessary size
+@return Pointer to a free block with necessary size or NULL
 */
-meta_block find_block(meta_block *last, size_t size) {
-    meta_block b = base;
-    while(b && !(b->free && b->size >= size)) {
-         *last = b;
-        b = b->next;
-    }  
-    return b;
+meta_block find_block(struct my_heap *h, meta_block *last, size_t size) {
+    size_t i, word;
+    uint64_t bits;
+    if(!h->base)
+        return NULL;
+    STAT_HEAP(h, searches);
+    i = get_bin_index(size);
+    if(get_bin_size(i) < size)
+        i++;
+    for(word = i >> 6; word < BIN_MAP_WORDS; word++) {
+        STAT_HEAP(h, search_steps);
+        bits = h->bin_map[word];
+        if(word == i >> 6)
+            bits &= ~0ULL << (i & 63);
+        if(bits)
+            return h->bins[(word << 6) + __builtin_ctzll(bits)];
+    }
+    STAT_HEAP(h, search_misses);
+    *last = h->tail;
+    return NULL;
 }
 /*
 Extends the heap if the OS allows it
-@param last Last created block
+The new block is linked to the tail of the heap, which is the block right before the top chunk
+@param h Pointer to the heap
+@param last Last created block, NULL to start a new heap
 @param size Bytes allocated by the user
 @return Pointer to the newly added block
 */
-meta_block extend_heap(meta_block last, size_t new_size) {
-    meta_block new_b = sbrk(0);
-    if(sbrk(new_size + BLOCK_SIZE) == (void*)-1) 
+meta_block extend_heap(struct my_heap *h, meta_block last, size_t new_size) {
+    meta_block new_b;
+    // a heap without a last block is a new heap, older bins are stale
+    if(!last) {
+        reset_bins(h);
+        reset_top(h);
+    }
+    new_b = (meta_block)take_top(h, new_size + BLOCK_SIZE);
+    // something else moved the program break, the heap goes on past its memory
+    if(!new_b && last && h->source == HEAP_SBRK && !new_segment(h))
+        new_b = (meta_block)take_top(h, new_size + BLOCK_SIZE);
+    if(!new_b)
         return NULL;
-    new_b->size = new_size;
-    new_b->next = NULL;
-    new_b->free = 0;
-    new_b->prev = last;
+    // the boundary tag describes the block that really ends where the top chunk started
     if(last)
-        last->next = new_b;
+        last = h->tail;
+    __atomic_store_n(&new_b->prev_size, last ? block_size(last) : 0, __ATOMIC_RELAXED);
+    SET_SIZE(new_b, new_size);
+    if(last && block_free(last))
+        SET_SIZE(new_b, new_b->size | BLOCK_PREV_FREE);
+    h->tail = new_b;
+    publish_top(h, new_b->anchor + new_size);
+    STAT_HEAP(h, extend_heap);
+    STAT_HEAP_ADD(h, blocks, 1);
     return new_b;
 }
 
+/*
+Carve bytes from the start of the top chunk, growing the heap when it is too small
+The heap grows by whole pages plus the top pad, so the next misses are served without a syscall
+The default heap grows with sbrk(), a growable or per-CPU heap inside its reservation and a buffer heap not at all
+The top chunk of the default heap always keeps TOP_RESERVE bytes, the room of a fencepost for new_segment
+@param h Pointer to the heap
+@param size Number of bytes needed
+@return Pointer to the carved bytes, adjacent to the tail, or NULL if the heap can not grow in place
+The top chunk still starts at the bytes until the caller calls publish_top
+*/
+char *take_top(struct my_heap *h, size_t size) {
+    size_t reserve = h->source == HEAP_SBRK ? TOP_RESERVE : 0;
+    size_t grow;
+    char *p;
+    if((size_t)(h->top_end - h->top) < size + reserve) {
+        if(h->source == HEAP_BUFFER)
+            return NULL;
+        // the new bytes must follow the tail, extend_heap goes past a break moved by something else
+        if(h->source == HEAP_SBRK && sbrk(0) != h->top_end)
+            return NULL;
+        grow = size + reserve - (h->top_end - h->top);
+        if(top_pad) {
+            grow += top_pad;
+            grow = (((uintptr_t)h->top_end + grow + page_size() - 1) & ~(uintptr_t)(page_size() - 1)) - (uintptr_t)h->top_end;
+        }
+        if(h->source == HEAP_MAPPED || h->source == HEAP_CPU) {
+            // the reservation is already mapped, growing only moves the end
+            if(size > (size_t)(h->limit - h->top))
+                return NULL;
+            if(grow > (size_t)(h->limit - h->top_end))
+                grow = h->limit - h->top_end;
+            // the blocks of a per-CPU heap are freed through the page map like those of the default heap
+            if(h->source == HEAP_CPU && pagemap_set(h->top_end, grow, (uintptr_t)h | PAGEMAP_HEAP))
+                return NULL;
+        } else {
+            if(grow > PTRDIFF_MAX || sbrk(grow) == (void*)-1)
+                return NULL;
+            // the page map has to know the new pages before a block on them can be freed
+            if(pagemap_set(h->top_end, grow, PAGEMAP_HEAP)) {
+                sbrk(-(ptrdiff_t)grow);
+                return NULL;
+            }
+        }
+        h->top_end += grow;
+    }
+    p = h->top;
+    if(p + size > h->heap_clean)
+        h->heap_clean = p + size;
+    return p;
+}
+
+/*
+Move the start of the top chunk of a heap, past bytes taken with take_top once the header of their block is written
+heap_valid_addr loads the top without the heap lock and then reads the header of the block after the one it checks
+@param h Pointer to the heap
+@param top New start of the top chunk
+*/
+void publish_top(struct my_heap *h, char *top) {
+    __atomic_store_n(&h->top, top, __ATOMIC_RELEASE);
+}
+
+/*
+Go on with the default heap at the program break after something else has moved it
+The start of the top chunk becomes a fencepost, a block that stays claimed and spans the memory up to
+the new break, so no block is ever merged with memory the heap does not own
+@param h Pointer to the default heap, with a tail
+@return 0 on success or -1 if the break has not moved up
+*/
+int new_segment(struct my_heap *h) {
+    char *brk_end = sbrk(0);
+    meta_block fence;
+    if(brk_end == (void*)-1 || brk_end <= h->top_end)
+        return -1;
+    // the new segment has to start on ALIGNMENT so that every payload is aligned
+    if((uintptr_t)brk_end % ALIGNMENT) {
+        if(sbrk(ALIGNMENT - (uintptr_t)brk_end % ALIGNMENT) == (void*)-1)
+            return -1;
+        brk_end += ALIGNMENT - (uintptr_t)brk_end % ALIGNMENT;
+    }
+    fence = (meta_block)h->top;
+    __atomic_store_n(&fence->prev_size, block_size(h->tail), __ATOMIC_RELAXED);
+    SET_SIZE(fence, (brk_end - fence->anchor) | (block_free(h->tail) ? BLOCK_PREV_FREE : 0));
+    h->tail = fence;
+    STAT_HEAP_ADD(h, blocks, 1);
+    publish_top(h, brk_end);
+    h->top_end = brk_end;
+    // the page of the break may hold data of the code that moved it
+    h->heap_clean = (char *)(((uintptr_t)brk_end + page_size() - 1) & ~(uintptr_t)(page_size() - 1));
+    return 0;
+}
+
+/*
+Start an empty default heap at the current program break if something else has moved it
+@param h Pointer to the heap, other heaps start where they were created
+*/
+void reset_top(struct my_heap *h) {
+    char *brk_end;
+    if(h->source != HEAP_SBRK)
+        return;
+    brk_end = sbrk(0);
+    if(h->base || brk_end == h->top_end)
+        return;
+    // the first block has to start on ALIGNMENT so that every payload is aligned
+    if((uintptr_t)brk_end % ALIGNMENT && sbrk(ALIGNMENT - (uintptr_t)brk_end % ALIGNMENT) != (void*)-1)
+        brk_end += ALIGNMENT - (uintptr_t)brk_end % ALIGNMENT;
+    publish_top(h, brk_end);
+    h->top_end = brk_end;
+    h->heap_clean = (char *)(((uintptr_t)brk_end + page_size() - 1) & ~(uintptr_t)(page_size() - 1));
+}
+
+/*
+Give the end of the top chunk back to the system once it is larger than the trim threshold
+The top pad is kept, so a heap that shrinks and grows again around the same size makes no syscall
+A growable heap keeps its reservation and drops the pages, a buffer heap belongs to its caller
+@param h Pointer to the heap
+*/
+void trim_top(struct my_heap *h) {
+    char *new_end, *page_end;
+    if(h->source == HEAP_BUFFER || (size_t)(h->top_end - h->top) <= trim_threshold)
+        return;
+    if(h->source == HEAP_SBRK && sbrk(0) != h->top_end)
+        return;
+    new_end = h->top + (h->source == HEAP_SBRK ? TOP_RESERVE : 0) + top_pad;
+    if(top_pad)
+        new_end = (char *)(((uintptr_t)new_end + page_size() - 1) & ~(uintptr_t)(page_size() - 1));
+    if(new_end >= h->top_end)
+        return;
+    page_end = (char *)(((uintptr_t)new_end + page_size() - 1) & ~(uintptr_t)(page_size() - 1));
+    if(h->source == HEAP_MAPPED || h->source == HEAP_CPU) {
+        // the page map entries of a per-CPU heap stay, the reservation is still its own
+        if(page_end < h->top_end)
+            madvise(page_end, h->top_end - page_end, MADV_DONTNEED);
+        h->top_end = new_end;
+        if(h->heap_clean > page_end)
+            h->heap_clean = page_end;
+        return;
+    }
+    // the released pages are forgotten before the kernel can map them again, the page of the new break stays
+    page_end = (char *)(((uintptr_t)new_end + PAGEMAP_PAGE - 1) & ~(uintptr_t)(PAGEMAP_PAGE - 1));
+    if(page_end < h->top_end)
+        pagemap_clear(page_end, h->top_end - page_end);
+    if(brk(new_end)) {
+        if(page_end < h->top_end)
+            pagemap_set(page_end, h->top_end - page_end, PAGEMAP_HEAP);
+        return;
+    }
+    h->top_end = new_end;
+    // the partial page at the new break keeps its data, the pages above it are zero when they come back
+    new_end = (char *)(((uintptr_t)new_end + page_size() - 1) & ~(uintptr_t)(page_size() - 1));
+    if(h->heap_clean > new_end)
+        h->heap_clean = new_end;
+}
+
 /*
 Split a block in 2 to maximize space usage and the first block is used
+The remainder is put in its bin
+@param h Pointer to the heap
 @param b Pointer to the block to split
 @param new_size Bytes allocated by the user
 */
-void split_block(meta_block b, size_t new_size) {
+void split_block(struct my_heap *h, meta_block b, size_t new_size) {
     meta_block new_b = (meta_block)((char*)b->anchor + new_size);
+    STAT_HEAP(h, split_block);
+    STAT_HEAP_ADD(h, blocks, 1);
 // set the metadata of the new block
-    new_b->size = b->size - new_size - BLOCK_SIZE;
-    new_b->prev = b;
-    new_b->next = b->next;
-    new_b->free = 1;
-// set metadata of the next block if it exists
-    if (new_b->next)
-        new_b->next->prev = new_b;
-// set metadata of partial block
-    b->size = new_size;
-    b->next = new_b;
-    b->free = 0;
+    new_b->prev_size = new_size;
+    SET_SIZE(new_b, block_size(b) - new_size - BLOCK_SIZE);
+    if(b == h->tail)
+        h->tail = new_b;
+// set metadata of partial block, it keeps its BLOCK_PREV_FREE bit
+    SET_SIZE(b, new_size | (b->size & BLOCK_PREV_FREE));
+// the new block is free, this also updates the boundary tag of the next block if it exists
+    mark_block(h, new_b, 1);
+    insert_free_block(h, new_b);
 }
 
 /*
 After freeing a block, fuse(merge) all adjacent free blocks into a single block
+The merged neighbours are taken out of their bins, the returned block is not binned
+The merge is a loop, so long runs of free blocks do not deepen the stack
+@param h Pointer to the heap
 @param block The block that was freed
-@param ok Flag for recursive call that has the value 1 for the first call
+@param ok 1 to merge the neighbours of the block, 0 to return it as is
 @return Pointer to the merged block
 */
-meta_block fusion(meta_block block, int ok) {
-    if(ok){
-        ok=0;
-        if(block->next && block->next->free){
-            block->size += block->next->size + BLOCK_SIZE;
-            block->next = block->next->next;
-            if(block->next)
-                block->next->prev = block;
+meta_block fusion(struct my_heap *h, meta_block block, int ok) {
+    meta_block next, prev;
+    while(ok) {
+        ok = 0;
+        next = next_block(h, block);
+        if(next && block_free(next)){
+            remove_free_block(h, next);
+            if(next == h->tail)
+                h->tail = block;
+            SET_SIZE(block, block->size + block_size(next) + BLOCK_SIZE);
+            STAT_HEAP(h, fusion);
+            STAT_HEAP_ADD(h, blocks, -1);
+            ok = 1;
+        }
+        if(block != h->base && (block->size & BLOCK_PREV_FREE)) {
+            prev = prev_block(h, block);
+            remove_free_block(h, prev);
+            if(block == h->tail)
+                h->tail = prev;
+            SET_SIZE(prev, prev->size + block_size(block) + BLOCK_SIZE);
+            block = prev;
+            STAT_HEAP(h, fusion);
+            STAT_HEAP_ADD(h, blocks, -1);
             ok = 1;
         }
-        if(block->prev && block->prev->free) {
-            block->prev->size += block->size + BLOCK_SIZE;
-            if(block->next)
-                block->next->prev = block->prev;
-            block->prev->next = block->next;
-            block = block->prev;
-            ok=1;
+        if(ok) {
+            // the block after the merged one gets the new boundary tag
+            next = next_block(h, block);
+            if(next)
+                next->prev_size = block_size(block);
         }
-        if(ok) 
-            return fusion(block, ok);
     }
     return block;
 }
@@ -200,114 +1147,1786 @@ meta_block get_pointer_to_meta_block(void *ptr) {
 
 /*
 Checks if a pointer points to an address from the heap and that points to an allocated memory
+The page map tells that the page belongs to the heap, the first and the last page of the heap
+may also hold memory of the program and the top chunk, so the pointer is also checked against the bounds
 @param p Pointer to check if it's valid
 @return 0 if the pointer is not valid or 1 if the pointer is valid 
  */
 int valid_addr(void *p) {
-    if(base) {
-        if(p > (void*)base && p < sbrk(0) && ((uintptr_t)p % 8 == 0)) {
-            return (p == (void*)(get_pointer_to_meta_block(p))->anchor);
-        }    
+    meta_block meta;
+    return find_owner(p, &meta) == PAGEMAP_HEAP;
+}
+
+/*
+Checks if a pointer is the payload of a claimed block of a heap, without the heap lock
+The bounds are loaded atomically since the heap grows and shrinks under its lock, a block below the loaded top
+has its header written already. A pointer inside a block
+reads user data as its header, it has to describe a claimed block that fits before the top chunk and whose
+size matches the boundary tag and the BLOCK_PREV_FREE bit of the next block
+@param h Pointer to the heap
+@param p Pointer to check
+@return 0 if the pointer is not valid or 1 if the pointer is valid
+*/
+int heap_valid_addr(struct my_heap *h, void *p) {
+    meta_block base = __atomic_load_n(&h->base, __ATOMIC_RELAXED), b, next;
+    char *top = __atomic_load_n(&h->top, __ATOMIC_ACQUIRE);
+    size_t size;
+    if(!base || p <= (void*)base || p >= (void*)top || (uintptr_t)p % ALIGNMENT)
+        return 0;
+    b = get_pointer_to_meta_block(p);
+    size = block_size(b);
+    if(block_free(b) || size < MIN_BIN_SIZE || size % ALIGNMENT || size > (size_t)(top - (char *)p))
+        return 0;
+    // the last block ends where the top chunk starts
+    if((char *)p + size == top)
+        return 1;
+    next = (meta_block)((char *)p + size);
+    return __atomic_load_n(&next->prev_size, __ATOMIC_RELAXED) == size && !(__atomic_load_n(&next->size, __ATOMIC_RELAXED) & BLOCK_PREV_FREE);
+}
+
+/*
+Find the tier that owns a pointer with a single lookup in the page map, no memory is read at the pointer
+@param p Pointer to check
+@param meta Set to the meta block of p if it is the payload of a heap or mmapped block, NULL otherwise
+@return PAGEMAP_SLAB, PAGEMAP_HEAP or PAGEMAP_LARGE, or 0 if p does not belong to the allocator
+*/
+int find_owner(void *p, meta_block *meta) {
+    struct my_heap *h;
+    return find_heap_owner(p, meta, &h);
+}
+
+/*
+Find the tier that owns a pointer like find_owner and the heap of a heap block
+@param p Pointer to check
+@param meta Set to the meta block of p if it is the payload of a heap or mmapped block, NULL otherwise
+@param heap Set to the heap of p if it is the payload of a heap block, the default heap or a per-CPU heap
+@return PAGEMAP_SLAB, PAGEMAP_HEAP or PAGEMAP_LARGE, or 0 if p does not belong to the allocator
+*/
+int find_heap_owner(void *p, meta_block *meta, struct my_heap **heap) {
+    uintptr_t entry = pagemap_get(p);
+    struct large_block *b;
+    *meta = NULL;
+    switch(PAGEMAP_KIND(entry)) {
+    case PAGEMAP_SLAB:
+        return PAGEMAP_SLAB;
+    case PAGEMAP_HEAP:
+        // the pages of the default heap have no owner, those of a per-CPU heap point to it
+        *heap = PAGEMAP_OWNER(entry) ? PAGEMAP_OWNER(entry) : &main_heap;
+        if(!heap_valid_addr(*heap, p))
+            return 0;
+        *meta = get_pointer_to_meta_block(p);
+        return PAGEMAP_HEAP;
+    case PAGEMAP_LARGE:
+        // only the page of the payload is recorded, the owner tells if p is the payload
+        b = PAGEMAP_OWNER(entry);
+        if((void*)b->meta.anchor != p)
+            return 0;
+        *meta = &b->meta;
+        return PAGEMAP_LARGE;
     }
     return 0;
 }
 
 /*
-Mark the block as free, merges adjacent blocks and shrinks the heap if the block is at the end
+Free a block of memory
 @param p Pointer to the block that is being freed
 */
 void my_free(void *p) {
+    TRACE(TRACE_FREE, p, NULL, 0);
+    free_memory(p);
+}
+
+/*
+Free a block whose size is known, like the sized operator delete of C++
+The tier and the size are still read from the page map and the metadata, the size given by the caller is
+only checked. Builds with MY_ALLOC_DEBUG abort when it is larger than the block
+@param p Pointer to the block that is being freed
+@param size Size requested for the block, or any size up to my_usable_size(p), 0 if it is unknown
+*/
+void my_free_sized(void *p, size_t size) {
+#ifdef MY_ALLOC_DEBUG
+    size_t usable = my_usable_size(p);
+    // unknown pointers are ignored like in my_free
+    if(usable && size > usable) {
+        fprintf(stderr, "Error: Block %p of %zu bytes freed with a size of %zu bytes!\n", p, usable, size);
+        abort();
+    }
+#else
+    (void)size;
+#endif
+    TRACE(TRACE_FREE, p, NULL, 0);
+    free_memory(p);
+}
+
+/*
+Free a block in the tier that owns it, slots are kept in the thread cache of their owner in thread-safe builds
+The tier is found with one lookup in the page map, unknown pointers are ignored
+@param p Pointer to the block that is being freed
+*/
+void free_memory(void *p) {
+    struct my_heap *h = NULL;
     meta_block b;
-    if(valid_addr(p)) {
-        b = get_pointer_to_meta_block(p);
-        b->free = 1;
-        b = fusion(b, 1);
-        // free the end of the heap
-        if(b->next == NULL) {
-            if(b->prev)
-                b->prev->next = NULL;
-            else    
-                base = NULL;
-
-            brk(b);
+    int owner;
+#ifdef MY_ALLOC_THREADS
+    struct tcache *tc;
+    struct slab_owner *o;
+    size_t size;
+    // the exit destructor also flushes the counters and the trace of a thread that only frees
+    tcache_arm();
+#endif
+    prof_free(p);
+    owner = find_heap_owner(p, &b, &h);
+#ifdef MY_ALLOC_THREADS
+    // a slot goes back to the thread that owns its slab, the cache of another thread would keep it from its owner.
+    // The heaps have no owning thread, their blocks go back to the heap. The per-CPU mode does not read the
+    // thread caches, so its slots go back to their slab
+    // a pointer inside a slot reads as a size of 0 and is ignored by slab_free
+    if(owner == PAGEMAP_SLAB && !PERCPU_ON() && (size = slab_slot_size(p)) && (o = slab_owner_of(p))) {
+        tc = get_tcache();
+        if(o == tc->owner ? tcache_put(p, size) : slab_remote_push(o, p)) {
+            STAT_FREE(size);
+            return;
         }
     }
+#endif
+    switch(owner) {
+    case PAGEMAP_SLAB:
+        // the size is read before the slab of the slot may be released
+        STAT_FREE(slab_slot_size(p));
+        slab_free(p);
+        break;
+    case PAGEMAP_HEAP:
+        STAT_FREE(block_size(b));
+        free_heap_block(h, b);
+        break;
+    case PAGEMAP_LARGE:
+        STAT_FREE(block_size(b));
+        large_free(b);
+        break;
+    }
 }
 
 /*
-Copy the data from a block to another
-@param original The original block containing the data
-@param copy The copy of the original block
+Free a block of the default heap or of a per-CPU heap, taking the lock of the heap
+@param h Pointer to the heap of the block
+@param b Pointer to the meta block that is being freed
 */
-void copy_block(meta_block original, meta_block copy) {
-    if(!original || !copy || original->size > copy->size) 
+void free_heap_block(struct my_heap *h, meta_block b) {
+#ifdef MY_ALLOC_THREADS
+    // the thread that holds the lock is not waited for, the block is left to its next allocation
+    if(TRYLOCK_HEAP(h)) {
+        heap_remote_free(h, b, b);
         return;
-    char *original_p = original->anchor;
-    char *copy_p = copy->anchor;
-    while(original_p < ((char*)original->anchor + original->size)) {
-        *copy_p = *original_p;
-        copy_p++;
-        original_p++;
     }
+#else
+    LOCK_HEAP(h);
+#endif
+    heap_free_fast(h, b);
+    UNLOCK_HEAP(h);
 }
+
 /*
-Finds the last allocated memory block
-@return Pointer to the last meta_block
+Allocate blocks of the same size in one call, the tier of the size carves all of them under a single lock
+Sizes of the mmapped tier, and the blocks a tier could not carve, are allocated one by one
+@param size The bytes allocated by the user for each block
+@param n Number of blocks
+@param ptrs Set to the blocks
+@return Number of blocks allocated, the first ones of ptrs, less than n if the memory is exhausted
 */
-meta_block find_last_block(void) {
-    meta_block b = base;
-    meta_block last;
-    while(b) {
-        last = b;
-        b = b->next;
-    }  
-    return last;
+size_t my_malloc_batch(size_t size, size_t n, void **ptrs) {
+    struct my_heap *h = ALLOC_HEAP();
+    size_t count = 0, i;
+    if(h == &main_heap)
+        count = slab_malloc_batch(size, n, ptrs);
+    if(!count && size && size < mmap_threshold) {
+        LOCK_HEAP(h);
+        count = heap_malloc_batch(h, size, n, ptrs);
+        UNLOCK_HEAP(h);
+    }
+    for(i = 0; i < count; i++) {
+        STAT_ALLOC(size, allocated_size(ptrs[i]));
+        PROF_ALLOC(ptrs[i], size);
+    }
+    for(; count < n && (ptrs[count] = alloc_memory(size, NULL)); count++)
+        ;
+    for(i = 0; i < count; i++)
+        TRACE(TRACE_MALLOC, ptrs[i], NULL, size);
+    return count;
 }
 
 /*
-Reallocate the memory for the new given size and pointer to previously allocated memory
-The data from the previously allocated memory is coppied or truncated in the new allocated block 
-@param new_size Size provided by the user
-@param p Pointer to the memory that has to be reallocated
-@return Pointer to the new allocated memory
+Free blocks in one call, the slots and the heap blocks are gathered and freed under a single lock of their tier
+The heap blocks are sorted by address so that neighbours freed together are merged at once,
+the blocks of the per-CPU heaps are freed one by one
+@param ptrs Pointers to the blocks, NULL and unknown pointers are ignored
+@param n Number of pointers
 */
-void *my_realloc(void *p, size_t new_size) {
-    meta_block block, new_block;
-    void *new_p;
-    if(!p)
-        return my_malloc(new_size); 
-    if(valid_addr(p)) {
-        new_size = align_64b(new_size);
-         block = get_pointer_to_meta_block(p);
-        if(block->size >= new_size){
-            if(block->size >= new_size + BLOCK_SIZE + 8)
-                split_block(block, new_size);
-        }  
-        else {
-            meta_block copy = extend_heap(find_last_block(), block->size);
-            copy_block(block, copy);
-            block = fusion(block, 1);
-            if(block->size >= new_size){
-                if(block->size >= new_size + BLOCK_SIZE + 8)
-                    split_block(block, new_size);
-                p = block->anchor;
-                copy_block(copy, block);
-                my_free(copy->anchor);
-            }
-            else {
-                my_free(copy->anchor);
-                new_p = my_malloc(new_size);
-                if(!new_p)
-                    return NULL;
-                new_block = get_pointer_to_meta_block(new_p);
-                copy_block(block, new_block);
-                my_free(p);
-                return new_p;
-            }
+void my_free_batch(void **ptrs, size_t n) {
+    meta_block blocks[FREE_BATCH], b;
+    struct my_heap *h = NULL;
+    void *slots[FREE_BATCH];
+    size_t i, nblocks = 0, nslots = 0;
+    for(i = 0; i < n; i++) {
+        TRACE(TRACE_FREE, ptrs[i], NULL, 0);
+        prof_free(ptrs[i]);
+        switch(find_heap_owner(ptrs[i], &b, &h)) {
+        case PAGEMAP_SLAB:
+            STAT_FREE(slab_slot_size(ptrs[i]));
+            slots[nslots++] = ptrs[i];
+            break;
+        case PAGEMAP_HEAP:
+            STAT_FREE(block_size(b));
+            if(h == &main_heap)
+                blocks[nblocks++] = b;
+            else
+                free_heap_block(h, b);
+            break;
+        case PAGEMAP_LARGE:
+            STAT_FREE(block_size(b));
+            large_free(b);
+            break;
         }
-        return p;
+        if(nslots == FREE_BATCH || (nslots && i == n - 1)) {
+            slab_free_batch(slots, nslots);
+            nslots = 0;
+        }
+        if(nblocks == FREE_BATCH || (nblocks && i == n - 1)) {
+            LOCK_HEAP(&main_heap);
+            heap_free_batch(&main_heap, blocks, nblocks);
+            UNLOCK_HEAP(&main_heap);
+            nblocks = 0;
+        }
+    }
+}
+
+/*
+Mark the block as free, merges adjacent blocks and shrinks the heap if the block is at the end
+Otherwise the merged block is put in its bin. The caller holds the heap lock
+@param h Pointer to the heap
+@param b Pointer to the meta block that is being freed
+*/
+void heap_free(struct my_heap *h, meta_block b) {
+    SET_SIZE(b, b->size | BLOCK_FREE);
+    b = fusion(h, b, 1);
+    // the end of the heap goes back to the top chunk
+    if(b == h->tail) {
+        h->tail = prev_block(h, b);
+        STAT_HEAP_ADD(h, blocks, -1);
+        if(b == h->base)
+            __atomic_store_n(&h->base, NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->top, (char *)b, __ATOMIC_RELAXED);
+        trim_top(h);
+    }
+    else {
+        mark_block(h, b, 1);
+        insert_free_block(h, b);
+    }
+}
+
+/*
+Free a block of the user, a small block goes to the fast bin of its size without being merged,
+so that freeing and allocating the same size again skips the merge and the split. The caller holds the heap lock
+@param h Pointer to the heap
+@param b Pointer to the meta block that is being freed
+*/
+void heap_free_fast(struct my_heap *h, meta_block b) {
+    size_t size = block_size(b);
+    // the last block still goes back to the top chunk
+    if(size > max_fast || b == h->tail) {
+        heap_free(h, b);
+        if(size >= FAST_CONSOLIDATE && h->fast_map)
+            consolidate_fast(h);
+        return;
     }
-    return NULL;   
+    // a block freed twice in a row is ignored
+    if(h->fastbins[FAST_INDEX(size)] == b)
+        return;
+    NEXT_FREE(b) = h->fastbins[FAST_INDEX(size)];
+    h->fastbins[FAST_INDEX(size)] = b;
+    h->fast_map |= 1ULL << FAST_INDEX(size);
+    STAT_HEAP_ADD(h, free_bytes, size);
 }
 
+/*
+Empty the fast bins, each block is merged with its free neighbours and binned or given back to the top chunk
+The caller holds the heap lock
+@param h Pointer to the heap
+*/
+void consolidate_fast(struct my_heap *h) {
+    meta_block b;
+    size_t i;
+    while(h->fast_map) {
+        i = __builtin_ctzll(h->fast_map);
+        h->fast_map &= h->fast_map - 1;
+        while((b = h->fastbins[i])) {
+            h->fastbins[i] = NEXT_FREE(b);
+            STAT_HEAP_ADD(h, free_bytes, -block_size(b));
+            heap_free(h, b);
+        }
+    }
+}
 
+/*
+Allocate blocks of the same size from the heap, the caller holds the heap lock
+A free block or an extension of the heap large enough for all the blocks is cut in a single pass,
+instead of one search and one split per block
+@param h Pointer to the heap
+@param size The bytes allocated by the user for each block
+@param n Number of blocks
+@param ptrs Set to the payloads
+@return Number of blocks allocated, less than n if the heap is full
+*/
+size_t heap_malloc_batch(struct my_heap *h, size_t size, size_t n, void **ptrs) {
+    meta_block region, last = NULL;
+    size_t count = 0, left, max;
+    size = align_64b(size);
+    if(!size)
+        return 0;
+    if(size < MIN_BIN_SIZE)
+        size = MIN_BIN_SIZE;
+    max = (PTRDIFF_MAX / 2) / (size + BLOCK_SIZE);
+    if(!h->base)
+        reset_top(h);
+    while(count < n) {
+        left = n - count < max ? n - count : max;
+        region = NULL;
+        if(h->base) {
+            // a region for every block left, or else for at least one of them
+            region = find_block(h, &last, left * (size + BLOCK_SIZE) - BLOCK_SIZE);
+            if(!region)
+                region = find_block(h, &last, size);
+            if(region)
+                remove_free_block(h, region);
+        }
+        if(!region) {
+            region = extend_heap(h, last, left * (size + BLOCK_SIZE) - BLOCK_SIZE);
+            if(!region)
+                region = extend_heap(h, last, size);
+            if(!region)
+                break;
+            if(!h->base)
+                __atomic_store_n(&h->base, region, __ATOMIC_RELAXED);
+        }
+        count += carve_blocks(h, region, size, left, ptrs + count);
+        last = h->tail;
+    }
+    return count;
+}
+
+/*
+Cut a free block or a new last block into claimed blocks of the same size, the caller holds the heap lock
+The rest is split off as a free block when it can hold one, otherwise it stays in the last claimed block
+@param h Pointer to the heap
+@param b Block to cut, out of its bin
+@param size Payload size of each block, aligned
+@param n Largest number of blocks
+@param ptrs Set to the payloads
+@return Number of blocks, at least 1
+*/
+size_t carve_blocks(struct my_heap *h, meta_block b, size_t size, size_t n, void **ptrs) {
+    size_t rest = block_size(b) - size, count = 1;
+    int tail = b == h->tail;
+    meta_block next;
+    SET_SIZE(b, size | (b->size & BLOCK_PREV_FREE));
+    ptrs[0] = b->anchor;
+    for(; count < n && rest >= size + BLOCK_SIZE; count++) {
+        next = (meta_block)(b->anchor + size);
+        next->prev_size = size;
+        SET_SIZE(next, size);
+        rest -= size + BLOCK_SIZE;
+        b = next;
+        ptrs[count] = b->anchor;
+        STAT_HEAP_ADD(h, blocks, 1);
+    }
+    if(rest >= BLOCK_SIZE + MIN_BIN_SIZE) {
+        next = (meta_block)(b->anchor + size);
+        next->prev_size = size;
+        SET_SIZE(next, rest - BLOCK_SIZE);
+        if(tail)
+            h->tail = next;
+        // the boundary tag of the block after the region is updated as well
+        mark_block(h, next, 1);
+        insert_free_block(h, next);
+        STAT_HEAP(h, split_block);
+        STAT_HEAP_ADD(h, blocks, 1);
+    }
+    else {
+        SET_SIZE(b, b->size + rest);
+        if(tail)
+            h->tail = b;
+        mark_block(h, b, 0);
+    }
+    return count;
+}
+
+/*
+Free blocks of the heap in address order, the caller holds the heap lock
+Each run of neighbours is merged into one block before it is freed, so a run costs one fusion and one bin insertion
+@param h Pointer to the heap
+@param blocks Claimed blocks to free, sorted in place
+@param n Number of blocks
+*/
+void heap_free_batch(struct my_heap *h, meta_block *blocks, size_t n) {
+    meta_block b;
+    size_t i = 0;
+    sort_blocks(blocks, n);
+    while(i < n) {
+        b = blocks[i++];
+        for(; i < n && b != h->tail && blocks[i] == (meta_block)(b->anchor + block_size(b)); i++) {
+            if(blocks[i] == h->tail)
+                h->tail = b;
+            SET_SIZE(b, b->size + block_size(blocks[i]) + BLOCK_SIZE);
+            STAT_HEAP(h, fusion);
+            STAT_HEAP_ADD(h, blocks, -1);
+        }
+        heap_free(h, b);
+    }
+}
+
+/*
+Sort blocks by address, a quicksort on the pointers that leaves short ranges to an insertion sort
+Blocks freed in the order they were allocated are usually sorted already, that case is a single pass
+@param blocks Blocks to sort
+@param n Number of blocks
+*/
+void sort_blocks(meta_block *blocks, size_t n) {
+    meta_block pivot, t;
+    size_t i, j;
+    while(n > 16) {
+        for(i = 1; i < n && blocks[i - 1] < blocks[i]; i++)
+            ;
+        if(i == n)
+            return;
+        pivot = blocks[(n - 1) / 2];
+        for(i = 0, j = n - 1;; i++, j--) {
+            while(blocks[i] < pivot)
+                i++;
+            while(blocks[j] > pivot)
+                j--;
+            if(i >= j)
+                break;
+            t = blocks[i];
+            blocks[i] = blocks[j];
+            blocks[j] = t;
+        }
+        // the smaller side is sorted by recursion, so the stack stays logarithmic
+        if(j + 1 < n - j - 1) {
+            sort_blocks(blocks, j + 1);
+            blocks += j + 1;
+            n -= j + 1;
+        }
+        else {
+            sort_blocks(blocks + j + 1, n - j - 1);
+            n = j + 1;
+        }
+    }
+    for(i = 1; i < n; i++) {
+        t = blocks[i];
+        for(j = i; j > 0 && blocks[j - 1] > t; j--)
+            blocks[j] = blocks[j - 1];
+        blocks[j] = t;
+    }
+}
+
+/*
+Copy the data from a block to another
+@param original The original block containing the data
+@param copy The copy of the original block
+*/
+void copy_block(meta_block original, meta_block copy) {
+    if(!original || !copy || block_size(original) > block_size(copy)) 
+        return;
+    mem_copy(copy->anchor, original->anchor, block_size(original));
+}
+/*
+Finds the last allocated memory block
+@param h Pointer to the heap
+@return Pointer to the last meta_block or NULL if the heap is empty
+*/
+meta_block find_last_block(struct my_heap *h) {
+    return h->base ? h->tail : NULL;
+}
+
+/*
+Reallocate the memory for the new given size and pointer to previously allocated memory
+The data from the previously allocated memory is coppied or truncated in the new allocated block 
+A size of 0 frees the block, whatever its tier
+@param new_size Size provided by the user
+@param p Pointer to the memory that has to be reallocated
+@return Pointer to the new allocated memory, or NULL if the size is 0
+*/
+void *my_realloc(void *p, size_t new_size) {
+    void *new_p = realloc_memory(p, new_size);
+    TRACE(TRACE_REALLOC, new_p, p, new_size);
+    return new_p;
+}
+
+/*
+Reallocate a block in the tier that owns it
+@param p Pointer to the memory that has to be reallocated
+@param new_size Size provided by the user
+@return Pointer to the new allocated memory
+*/
+void *realloc_memory(void *p, size_t new_size) {
+    size_t slot_size, old_size;
+    struct my_heap *h = NULL;
+    meta_block meta;
+    void *new_p;
+    int owner;
+    if(!p)
+        return alloc_memory(new_size, NULL);
+    // a slot, a heap block and an mmapped block all end the same way
+    if(!new_size) {
+        free_memory(p);
+        return NULL;
+    }
+    owner = find_heap_owner(p, &meta, &h);
+    // a slot can only grow up to its size class
+    if(owner == PAGEMAP_SLAB) {
+        if(!(slot_size = slab_slot_size(p)))
+            return NULL;
+        if(new_size <= slot_size)
+            return p;
+        new_p = alloc_memory(new_size, NULL);
+        if(!new_p)
+            return NULL;
+        memcpy(new_p, p, new_size < slot_size ? new_size : slot_size);
+        free_memory(p);
+        return new_p;
+    }
+    if(!owner)
+        return NULL;
+    // a resized block is sampled again as a new allocation, a failed resize loses its sample
+    prof_free(p);
+    if(owner == PAGEMAP_LARGE)
+        p = large_realloc(p, new_size);
+    else {
+        old_size = block_size(meta);
+        LOCK_HEAP(h);
+        p = heap_realloc(h, p, new_size);
+        UNLOCK_HEAP(h);
+        if(p)
+            STAT_REALLOC(old_size, block_size(get_pointer_to_meta_block(p)));
+    }
+    if(p)
+        PROF_ALLOC(p, new_size);
+    return p;
+}
+
+/*
+Grow a block without ever moving it, to the preferred size if possible or else to the minimum size
+Containers can ask for room where their data already is before they pay for a copy
+@param p Pointer to the payload
+@param min_size Size the caller needs
+@param preferred_size Size the caller would like, the minimum size if smaller
+@return Usable size of the block afterwards, less than min_size if it could not grow enough (the block is then
+unchanged), or 0 if p does not belong to the allocator
+*/
+size_t my_try_expand(void *p, size_t min_size, size_t preferred_size) {
+    struct my_heap *h = NULL;
+    meta_block meta;
+    size_t old_size, size, target;
+    int owner = find_heap_owner(p, &meta, &h);
+    if(owner == PAGEMAP_SLAB)
+        return slab_slot_size(p);
+    if(!owner)
+        return 0;
+    old_size = block_size(meta);
+    if(preferred_size < min_size || preferred_size > PTRDIFF_MAX / 2)
+        preferred_size = min_size;
+    if(old_size >= preferred_size || min_size > PTRDIFF_MAX / 2)
+        return old_size;
+    target = align_64b(preferred_size);
+    if(owner == PAGEMAP_LARGE) {
+        size = large_resize_in_place(meta, target);
+        if(size < min_size)
+            size = large_resize_in_place(meta, align_64b(min_size));
+    }
+    else {
+        LOCK_HEAP(h);
+        if(!heap_expand(h, meta, target)) {
+            target = old_size;
+            if(old_size < min_size && heap_expand(h, meta, align_64b(min_size)))
+                target = align_64b(min_size);
+        }
+        // a neighbour absorbed on the way is given back past the target
+        if(block_size(meta) >= target + BLOCK_SIZE + MIN_BIN_SIZE)
+            shrink_block(h, meta, target);
+        size = block_size(meta);
+        UNLOCK_HEAP(h);
+    }
+    if(size != old_size) {
+        STAT_REALLOC(old_size, size);
+        TRACE(TRACE_REALLOC, p, p, size);
+    }
+    return size;
+}
+
+/*
+Give the end of a block back without moving it, the rest of a heap block is freed and the pages past the size
+of an mmapped block are unmapped. Slots keep their size class
+@param p Pointer to the payload
+@param size Size the caller still needs
+@return Usable size of the block afterwards, at least size, or 0 if p does not belong to the allocator
+*/
+size_t my_shrink_in_place(void *p, size_t size) {
+    struct my_heap *h = NULL;
+    meta_block meta;
+    size_t old_size, new_size;
+    int owner = find_heap_owner(p, &meta, &h);
+    if(owner == PAGEMAP_SLAB)
+        return slab_slot_size(p);
+    if(!owner)
+        return 0;
+    old_size = block_size(meta);
+    if(size >= old_size)
+        return old_size;
+    size = size < MIN_BIN_SIZE ? MIN_BIN_SIZE : align_64b(size);
+    if(owner == PAGEMAP_LARGE)
+        new_size = large_resize_in_place(meta, size);
+    else {
+        LOCK_HEAP(h);
+        if(old_size >= size + BLOCK_SIZE + MIN_BIN_SIZE)
+            shrink_block(h, meta, size);
+        new_size = block_size(meta);
+        UNLOCK_HEAP(h);
+    }
+    if(new_size != old_size) {
+        STAT_REALLOC(old_size, new_size);
+        TRACE(TRACE_REALLOC, p, p, new_size);
+    }
+    return new_size;
+}
+
+/*
+Grow a block in use over its free next neighbour
+@param h Pointer to the heap
+@param b The block in use
+@param next The free block right after it
+*/
+void absorb_next_block(struct my_heap *h, meta_block b, meta_block next) {
+    remove_free_block(h, next);
+    if(next == h->tail)
+        h->tail = b;
+    SET_SIZE(b, b->size + block_size(next) + BLOCK_SIZE);
+    mark_block(h, b, 0);
+    STAT_HEAP_ADD(h, blocks, -1);
+}
+
+/*
+Grow a block in use without moving it, over its free next neighbour or with the top chunk when it is the last block
+The caller holds the heap lock. A free last neighbour is absorbed even if the top chunk can not make up the rest
+@param h Pointer to the heap
+@param b The block in use
+@param size Payload size needed, aligned
+@return 1 if the block now holds size bytes or 0 otherwise
+*/
+int heap_expand(struct my_heap *h, meta_block b, size_t size) {
+    meta_block next = next_block(h, b);
+    // the free neighbour is taken when it is enough or when it ends the heap
+    if(next && block_free(next) && (block_size(b) + block_size(next) + BLOCK_SIZE >= size || next == h->tail))
+        absorb_next_block(h, b, next);
+    if(block_size(b) < size && b == h->tail && take_top(h, size - block_size(b))) {
+        SET_SIZE(b, b->size + size - block_size(b));
+        publish_top(h, b->anchor + size);
+    }
+    return block_size(b) >= size;
+}
+
+/*
+Give the end of a block in use back to the heap, where it merges with a free next neighbour or the top chunk
+The caller holds the heap lock
+@param h Pointer to the heap
+@param b The block in use
+@param size New payload size, aligned, with room left for a free block after it
+*/
+void shrink_block(struct my_heap *h, meta_block b, size_t size) {
+    meta_block rest = (meta_block)(b->anchor + size);
+    rest->prev_size = size;
+    SET_SIZE(rest, block_size(b) - size - BLOCK_SIZE);
+    if(b == h->tail)
+        h->tail = rest;
+    SET_SIZE(b, size | (b->size & BLOCK_PREV_FREE));
+    STAT_HEAP_ADD(h, blocks, 1);
+    heap_free(h, rest);
+}
+
+/*
+Reallocate a block of the heap, the caller holds the heap lock
+The block grows in place whenever it can, over its free next neighbour or by moving the
+program break when it is the last block; otherwise the data is copied exactly once
+@param h Pointer to the heap that owns the block
+@param new_size Size provided by the user
+@param p Pointer to the memory that has to be reallocated
+@return Pointer to the new allocated memory
+*/
+void *heap_realloc(struct my_heap *h, void *p, size_t new_size) {
+    meta_block block, next, prev, new_block;
+    size_t size, next_size = 0;
+    void *new_p;
+    if(!heap_valid_addr(h, p))
+        return NULL;
+    new_size = align_64b(new_size);
+    if(new_size < MIN_BIN_SIZE)
+        new_size = MIN_BIN_SIZE;
+    block = get_pointer_to_meta_block(p);
+    size = block_size(block);
+    if(size < new_size && !heap_expand(h, block, new_size)) {
+        next = next_block(h, block);
+        if(next && block_free(next))
+            next_size = block_size(next) + BLOCK_SIZE;
+        // the data slides down once into the free previous neighbour
+        if((block->size & BLOCK_PREV_FREE) &&
+           block->prev_size + BLOCK_SIZE + block_size(block) + next_size >= new_size) {
+            if(next_size)
+                absorb_next_block(h, block, next);
+            prev = prev_block(h, block);
+            remove_free_block(h, prev);
+            SET_SIZE(prev, prev->size + block_size(block) + BLOCK_SIZE);
+            STAT_HEAP_ADD(h, blocks, -1);
+            if(block == h->tail)
+                h->tail = prev;
+            memmove(prev->anchor, p, size);
+            mark_block(h, prev, 0);
+            block = prev;
+            p = block->anchor;
+        }
+        else {
+            // only the default and the per-CPU heaps hand big blocks to the mmap tier, the blocks of another heap stay in it
+            if((h == &main_heap || h->source == HEAP_CPU) && new_size >= mmap_threshold)
+                new_p = large_malloc(new_size, NULL);
+            else
+                new_p = heap_malloc(h, new_size, NULL);
+            // a full per-CPU heap falls back to the default heap like alloc_memory, the per-CPU heaps are locked first
+            if(!new_p && h->source == HEAP_CPU) {
+                LOCK_HEAP(&main_heap);
+                new_p = heap_malloc(&main_heap, new_size, NULL);
+                UNLOCK_HEAP(&main_heap);
+            }
+            if(!new_p)
+                return NULL;
+            new_block = get_pointer_to_meta_block(new_p);
+            copy_block(block, new_block);
+            heap_free(h, block);
+            return new_p;
+        }
+    }
+    if(block_size(block) >= new_size + BLOCK_SIZE + MIN_BIN_SIZE)
+        split_block(h, block, new_size);
+    return p;
+}
+
+/*
+Start an empty heap in a buffer of the caller, the state of the heap is kept at the start of the buffer
+The heap never grows past the buffer and gives no memory back, the buffer is the caller's again after my_heap_destroy
+@param buffer Memory of the heap
+@param len Size of the buffer in bytes
+@return Pointer to the heap or NULL if the buffer can not hold the state of the heap and one block
+*/
+struct my_heap *my_heap_create(void *buffer, size_t len) {
+    uintptr_t start = ((uintptr_t)buffer + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1);
+    uintptr_t end = ((uintptr_t)buffer + len) & ~(uintptr_t)(ALIGNMENT - 1);
+    struct my_heap *h = (struct my_heap *)start;
+    if(!buffer || (uintptr_t)buffer + len < (uintptr_t)buffer ||
+       end < start + align_64b(sizeof(struct my_heap)) + BLOCK_SIZE + MIN_BIN_SIZE)
+        return NULL;
+    init_heap(h, HEAP_BUFFER, (char *)end);
+    // the whole buffer is there from the start and may hold anything
+    h->top_end = h->heap_clean = h->limit;
+    return h;
+}
+
+/*
+Start an empty heap in a mapping of its own, MAPPED_HEAP_RESERVE bytes of address space are reserved
+The heap grows inside the reservation without a syscall and the pages above the top pad are dropped when it shrinks
+@return Pointer to the heap or NULL if the address space can not be reserved
+*/
+struct my_heap *my_heap_create_growable(void) {
+    struct my_heap *h = mmap(NULL, MAPPED_HEAP_RESERVE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(h == MAP_FAILED)
+        return NULL;
+    init_heap(h, HEAP_MAPPED, (char *)h + MAPPED_HEAP_RESERVE);
+    return h;
+}
+
+/*
+Set up the state of a new heap that starts right after it and add it to the heaps locked around a fork
+@param h Pointer to the state of the heap, zeroed or not
+@param source HEAP_BUFFER or HEAP_MAPPED
+@param limit End of the memory of the heap
+*/
+void init_heap(struct my_heap *h, int source, char *limit) {
+    mem_zero(h, sizeof(struct my_heap));
+    h->source = source;
+    h->limit = limit;
+    h->top = h->top_end = h->heap_clean = (char *)h + align_64b(sizeof(struct my_heap));
+#ifdef MY_ALLOC_THREADS
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_mutex_lock(&heaps_lock);
+    h->next = heaps;
+    if(heaps)
+        heaps->prev = h;
+    heaps = h;
+    pthread_mutex_unlock(&heaps_lock);
+#endif
+}
+
+/*
+Release a heap created with my_heap_create or my_heap_create_growable, with every block still in it
+The mapping of a growable heap is unmapped, the default heap can not be destroyed
+@param h Pointer to the heap
+*/
+void my_heap_destroy(struct my_heap *h) {
+    if(!h || h == &main_heap)
+        return;
+#ifdef MY_ALLOC_THREADS
+    pthread_mutex_lock(&heaps_lock);
+    if(h->prev)
+        h->prev->next = h->next;
+    else
+        heaps = h->next;
+    if(h->next)
+        h->next->prev = h->prev;
+    pthread_mutex_unlock(&heaps_lock);
+    pthread_mutex_destroy(&h->lock);
+#endif
+    if(h->source == HEAP_MAPPED)
+        munmap(h, h->limit - (char *)h);
+}
+
+/*
+Allocate a block from a heap, the blocks of a heap created by the caller never come from another tier
+@param h Pointer to the heap, NULL for the default heap of my_malloc
+@param size The bytes allocated by the user
+@return Pointer to the payload or NULL if the heap is full
+*/
+void *my_heap_malloc(struct my_heap *h, size_t size) {
+    void *p;
+    if(!h)
+        return my_malloc(size);
+    LOCK_HEAP(h);
+    p = heap_malloc(h, size, NULL);
+    UNLOCK_HEAP(h);
+    return p;
+}
+
+/*
+Free a block of a heap, pointers that are not blocks of the heap are ignored
+@param h Pointer to the heap that allocated the block, NULL for the default heap of my_malloc
+@param p Pointer to the payload
+*/
+void my_heap_free(struct my_heap *h, void *p) {
+    meta_block b;
+    if(!h) {
+        my_free(p);
+        return;
+    }
+    LOCK_HEAP(h);
+    if(heap_valid_addr(h, p)) {
+        b = get_pointer_to_meta_block(p);
+        if(!block_free(b))
+            heap_free_fast(h, b);
+    }
+    UNLOCK_HEAP(h);
+}
+
+/*
+Reallocate a block of a heap, the block stays in the heap
+@param h Pointer to the heap that allocated the block, NULL for the default heap of my_malloc
+@param p Pointer to the payload, NULL to allocate a new block
+@param size New size provided by the user, 0 frees the block
+@return Pointer to the resized block, NULL if the size is 0 or if the heap is full, the block is then left as it was
+*/
+void *my_heap_realloc(struct my_heap *h, void *p, size_t size) {
+    if(!h)
+        return my_realloc(p, size);
+    if(!p)
+        return my_heap_malloc(h, size);
+    if(!size) {
+        my_heap_free(h, p);
+        return NULL;
+    }
+    LOCK_HEAP(h);
+    p = heap_realloc(h, p, size);
+    UNLOCK_HEAP(h);
+    return p;
+}
+
+/*
+Set a tunable parameter of the allocator
+@param param Parameter to change (MY_M_MMAP_THRESHOLD, MY_M_SLAB_MAX, MY_M_TRIM_THRESHOLD, MY_M_TOP_PAD, MY_M_PROF_SAMPLE,
+MY_M_MXFAST, MY_M_PERCPU)
+@param value New value of the parameter
+@return 1 on success or 0 if the parameter is unknown or not supported by the build
+*/
+int my_mallopt(int param, size_t value) {
+#ifdef MY_ALLOC_THREADS
+    unsigned int i;
+    int cpus;
+#endif
+    switch(param) {
+    case MY_M_MMAP_THRESHOLD:
+        mmap_threshold = value;
+        return 1;
+    case MY_M_TRIM_THRESHOLD:
+        LOCK_HEAP(&main_heap);
+        trim_threshold = value;
+        UNLOCK_HEAP(&main_heap);
+        return 1;
+    case MY_M_TOP_PAD:
+        LOCK_HEAP(&main_heap);
+        top_pad = value;
+        UNLOCK_HEAP(&main_heap);
+        return 1;
+    case MY_M_SLAB_MAX:
+        slab_set_max(value);
+        return 1;
+    case MY_M_MXFAST:
+        // the blocks already in the fast bins are merged, a smaller limit would strand them
+        LOCK_HEAP(&main_heap);
+        consolidate_fast(&main_heap);
+        max_fast = value > FASTBIN_MAX_SIZE ? FASTBIN_MAX_SIZE : value;
+        UNLOCK_HEAP(&main_heap);
+#ifdef MY_ALLOC_THREADS
+        for(i = 0; i < MAX_CPU_HEAPS; i++)
+            if(cpu_heaps[i]) {
+                LOCK_HEAP(cpu_heaps[i]);
+                consolidate_fast(cpu_heaps[i]);
+                UNLOCK_HEAP(cpu_heaps[i]);
+            }
+#endif
+        return 1;
+    case MY_M_PERCPU:
+#ifdef MY_ALLOC_THREADS
+        // the heaps already created keep their blocks until they are freed, they are reused if the mode comes back
+        cpus = get_nprocs_conf();
+        if(cpus < 1)
+            cpus = 1;
+        __atomic_store_n(&cpu_heap_count, !value ? 0 : cpus > MAX_CPU_HEAPS ? MAX_CPU_HEAPS : cpus, __ATOMIC_RELAXED);
+        return 1;
+#else
+        return 0;
+#endif
+    case MY_M_PROF_SAMPLE:
+        prof_set_rate(value);
+        // the calling thread uses the new rate right away, the others within PROF_RECHECK bytes
+        prof_countdown = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Allocate a block in its own anonymous mapping, reusing a cached region when one is large enough
+A cached region is only reused if it is at most twice the needed length
+@param new_size The bytes allocated by the user
+@return Pointer to the payload or NULL if the size is invalid or the mapping failed
+*/
+void *large_malloc(size_t new_size, size_t *dirty) {
+    struct large_block *b = NULL;
+    size_t len;
+    int i, best = -1;
+    new_size = align_64b(new_size);
+    if(!new_size || new_size > PTRDIFF_MAX - PAGE_SIZE)
+        return NULL;
+    len = PAGE_ALIGN(new_size + LARGE_HEADER + BLOCK_SIZE);
+    LOCK_LARGE();
+    for(i = 0; i < LARGE_CACHE_SLOTS; i++)
+        if(large_cache[i].addr && large_cache[i].len >= len && large_cache[i].len / 2 <= len
+            && (best < 0 || large_cache[i].len < large_cache[best].len))
+            best = i;
+    if(best >= 0) {
+        b = large_cache[best].addr;
+        len = large_cache[best].len;
+        large_cache[best].addr = NULL;
+        large_cache_bytes -= len;
+        if(dirty)
+            *dirty = new_size;
+    }
+    UNLOCK_LARGE();
+    if(!b) {
+        b = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(b == MAP_FAILED)
+            return NULL;
+        // a new anonymous mapping is zero-filled, a cached region holds old data
+        if(dirty)
+            *dirty = 0;
+    }
+    b->meta.prev_size = 0;
+    SET_SIZE(&b->meta, (len - LARGE_HEADER - BLOCK_SIZE) | BLOCK_MMAPPED);
+    b->prev = NULL;
+    if(pagemap_set(b->meta.anchor, 1, (uintptr_t)b | PAGEMAP_LARGE)) {
+        munmap(b, len);
+        return NULL;
+    }
+    LOCK_LARGE();
+    b->next = large_blocks;
+    if(large_blocks)
+        large_blocks->prev = b;
+    large_blocks = b;
+    UNLOCK_LARGE();
+    return b->meta.anchor;
+}
+
+/*
+Finds the mmapped block that owns a payload pointer in the page map
+@param p Pointer to check
+@return Pointer to the meta block or NULL if p is not the payload of a live mmapped block
+*/
+meta_block find_large_block(void *p) {
+    meta_block meta;
+    return find_owner(p, &meta) == PAGEMAP_LARGE ? meta : NULL;
+}
+
+/*
+Unlink an mmapped block and keep its region in the cache, or unmap it if the cache is full
+@param meta Pointer to the mmapped meta block
+*/
+void large_free(meta_block meta) {
+    struct large_block *b = (struct large_block *)((char*)meta - LARGE_HEADER);
+    size_t len = meta->prev_size + block_size(meta) + LARGE_HEADER + BLOCK_SIZE;
+    char *map = (char*)b - meta->prev_size;
+    int i;
+    pagemap_clear(meta->anchor, 1);
+    LOCK_LARGE();
+    if(b->prev)
+        b->prev->next = b->next;
+    else
+        large_blocks = b->next;
+    if(b->next)
+        b->next->prev = b->prev;
+    if(large_cache_bytes + len <= LARGE_CACHE_MAX) {
+        for(i = 0; i < LARGE_CACHE_SLOTS; i++)
+            if(!large_cache[i].addr) {
+                large_cache[i].addr = map;
+                large_cache[i].len = len;
+                large_cache_bytes += len;
+                UNLOCK_LARGE();
+                return;
+            }
+    }
+    UNLOCK_LARGE();
+    munmap(map, len);
+}
+
+/*
+Resize an mmapped block with mremap so that the kernel moves the pages instead of copying them
+A block that shrinks under the mmap threshold is moved back in the heap
+@param p Pointer to the payload of the mmapped block
+@param new_size Size provided by the user
+@return Pointer to the new payload or NULL if p is not an mmapped block or the resize failed
+*/
+void *large_realloc(void *p, size_t new_size) {
+    meta_block meta = find_large_block(p);
+    struct large_block *b, *next, *prev;
+    struct my_heap *h;
+    void *new_p;
+    char *map;
+    size_t len, offset, old_size;
+    if(!meta)
+        return NULL;
+    old_size = block_size(meta);
+    b = (struct large_block *)((char*)meta - LARGE_HEADER);
+    new_size = align_64b(new_size);
+    if(!new_size || new_size > PTRDIFF_MAX - PAGE_SIZE)
+        return NULL;
+    if(new_size < mmap_threshold) {
+        h = ALLOC_HEAP();
+        LOCK_HEAP(h);
+        new_p = heap_malloc(h, new_size, NULL);
+        UNLOCK_HEAP(h);
+        if(!new_p)
+            return NULL;
+        // a block shrunk in place may be smaller than the new size
+        memcpy(new_p, p, new_size < old_size ? new_size : old_size);
+        large_free(meta);
+        STAT_REALLOC(old_size, block_size(get_pointer_to_meta_block(new_p)));
+        return new_p;
+    }
+    // an aligned block starts past the beginning of its mapping
+    offset = meta->prev_size;
+    len = PAGE_ALIGN(offset + new_size + LARGE_HEADER + BLOCK_SIZE);
+    if(len == offset + old_size + LARGE_HEADER + BLOCK_SIZE)
+        return p;
+    LOCK_LARGE();
+    next = b->next;
+    prev = b->prev;
+    // the old address is forgotten before the kernel can hand it to another mapping
+    pagemap_clear(p, 1);
+    map = mremap((char*)b - offset, offset + old_size + LARGE_HEADER + BLOCK_SIZE, len, MREMAP_MAYMOVE);
+    if(map == MAP_FAILED) {
+        pagemap_set(p, 1, (uintptr_t)b | PAGEMAP_LARGE);
+        UNLOCK_LARGE();
+        return NULL;
+    }
+    b = (struct large_block *)(map + offset);
+    // the nodes of the page map are only missing when the system is out of memory,
+    // the block is then leaked by the next free instead of being freed at a wrong address
+    pagemap_set(b->meta.anchor, 1, (uintptr_t)b | PAGEMAP_LARGE);
+    SET_SIZE(&b->meta, (len - offset - LARGE_HEADER - BLOCK_SIZE) | BLOCK_MMAPPED);
+    if(prev)
+        prev->next = b;
+    else
+        large_blocks = b;
+    if(next)
+        next->prev = b;
+    UNLOCK_LARGE();
+    STAT_REALLOC(old_size, block_size(&b->meta));
+    return b->meta.anchor;
+}
+
+/*
+Grow or shrink an mmapped block without moving it, the mapping only grows when the pages after it are free
+@param meta Metadata block of the mmapped block
+@param size New payload size, aligned
+@return Usable size of the block afterwards
+*/
+size_t large_resize_in_place(meta_block meta, size_t size) {
+    struct large_block *b = (struct large_block *)((char*)meta - LARGE_HEADER);
+    size_t offset = meta->prev_size;
+    size_t old_len = offset + block_size(meta) + LARGE_HEADER + BLOCK_SIZE;
+    size_t len = PAGE_ALIGN(offset + size + LARGE_HEADER + BLOCK_SIZE);
+    if(len == old_len)
+        return block_size(meta);
+    // without MREMAP_MAYMOVE the mapping stays where it is, so the page map entry stays valid
+    LOCK_LARGE();
+    if(mremap((char*)b - offset, old_len, len, 0) != MAP_FAILED)
+        SET_SIZE(meta, (len - offset - LARGE_HEADER - BLOCK_SIZE) | BLOCK_MMAPPED);
+    UNLOCK_LARGE();
+    return block_size(meta);
+}
+
+/*
+Allocate an aligned block in its own anonymous mapping
+The whole pages before the header and after the payload are unmapped right away,
+the offset of the header in what is left of the mapping is kept in the prev_size of the block
+@param alignment Power of two larger than ALIGNMENT
+@param size The bytes allocated by the user, aligned to ALIGNMENT
+@return Pointer to the aligned payload or NULL if the mapping failed
+*/
+void *large_memalign(size_t alignment, size_t size) {
+    size_t page = page_size();
+    size_t len = (size + alignment + LARGE_HEADER + BLOCK_SIZE + page - 1) & ~(page - 1);
+    char *map, *end, *used_end;
+    struct large_block *b;
+    uintptr_t start;
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED)
+        return NULL;
+    end = map + len;
+    start = ((uintptr_t)map + LARGE_HEADER + BLOCK_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    b = (struct large_block *)(start - LARGE_HEADER - BLOCK_SIZE);
+    if((char *)b - map >= (ptrdiff_t)page) {
+        munmap(map, ((char *)b - map) & ~(page - 1));
+        map += ((char *)b - map) & ~(page - 1);
+    }
+    used_end = (char *)(((uintptr_t)start + size + page - 1) & ~(uintptr_t)(page - 1));
+    if(used_end < end)
+        munmap(used_end, end - used_end);
+    b->meta.prev_size = (char *)b - map;
+    SET_SIZE(&b->meta, (used_end - (char *)start) | BLOCK_MMAPPED);
+    b->prev = NULL;
+    if(pagemap_set(b->meta.anchor, 1, (uintptr_t)b | PAGEMAP_LARGE)) {
+        munmap(map, used_end - map);
+        return NULL;
+    }
+    LOCK_LARGE();
+    b->next = large_blocks;
+    if(large_blocks)
+        large_blocks->prev = b;
+    large_blocks = b;
+    UNLOCK_LARGE();
+    return b->meta.anchor;
+}
+
+#ifdef MY_ALLOC_THREADS
+/*
+Create the key whose destructor drains the thread cache when a thread exits
+*/
+void tcache_init_key(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/*
+Take every lock before a fork, in the order they nest, so that no lock is copied held by another thread
+*/
+void fork_prepare(void) {
+    struct my_heap *h;
+    pthread_mutex_lock(&heaps_lock);
+    for(h = heaps; h; h = h->next)
+        LOCK_HEAP(h);
+    LOCK_HEAP(&main_heap);
+    slab_lock_all();
+    LOCK_LARGE();
+    pagemap_lock_all();
+}
+
+/*
+Release the locks of the heaps created by the program and of their list
+*/
+void unlock_heaps(void) {
+    struct my_heap *h;
+    for(h = heaps; h; h = h->next)
+        UNLOCK_HEAP(h);
+    pthread_mutex_unlock(&heaps_lock);
+}
+
+/*
+Release the locks taken by fork_prepare in the parent
+*/
+void fork_parent(void) {
+    pagemap_unlock_all();
+    UNLOCK_LARGE();
+    slab_unlock_all();
+    UNLOCK_HEAP(&main_heap);
+    unlock_heaps();
+}
+
+/*
+Release the locks taken by fork_prepare in the child, which is the only thread left
+*/
+void fork_child(void) {
+    trace_fork_child();
+    pagemap_unlock_all();
+    UNLOCK_LARGE();
+    slab_unlock_all();
+    slab_owner_fork_child(tcache.owner);
+    UNLOCK_HEAP(&main_heap);
+    unlock_heaps();
+}
+
+/*
+Arms the exit destructor of the calling thread, which flushes its cache, its counters and its trace buffer
+*/
+void tcache_arm(void) {
+    if(!tcache.registered) {
+        // pthread_setspecific may allocate, the nested call must not register again
+        tcache.registered = 1;
+        pthread_once(&tcache_once, tcache_init_key);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+}
+
+/*
+Returns the cache of the calling thread, arms its exit destructor and takes a slab owner on first use
+Only the threads that use the cache take one of the SLAB_OWNERS owners, the per-CPU mode only arms the destructor
+@return Pointer to the thread cache
+*/
+struct tcache *get_tcache(void) {
+    tcache_arm();
+    if(!tcache.owned) {
+        tcache.owned = 1;
+        tcache.owner = slab_owner_register();
+    }
+    return &tcache;
+}
+
+/*
+Pop a block of the size class from the thread cache without locking
+The slots freed for the thread by other threads are collected first. An empty class is refilled with
+TCACHE_FILL blocks under a single lock of the slabs or of the heap
+@param size Bytes allocated by the user
+@return Pointer to the payload or NULL if the size is not cached or the heap is full
+*/
+void *tcache_get(size_t size) {
+    struct tcache *tc;
+    void *slots[TCACHE_FILL];
+    size_t i;
+    void *p;
+    int n;
+    if(size == 0 || size > TCACHE_MAX_SIZE)
+        return NULL;
+    tc = get_tcache();
+    if(tc->owner && __atomic_load_n(&tc->owner->remote, __ATOMIC_RELAXED))
+        tcache_collect(tc);
+    i = align_64b(size) / ALIGNMENT;
+    if(!tc->entries[i]) {
+        n = tc->owner ? slab_malloc_owned(i * ALIGNMENT, TCACHE_FILL, slots, tc->owner)
+                      : slab_malloc_batch(i * ALIGNMENT, TCACHE_FILL, slots);
+        while(n--) {
+            *(void**)slots[n] = tc->entries[i];
+            tc->entries[i] = slots[n];
+            tc->count[i]++;
+        }
+        // sizes that are not served by slabs are refilled from the heap
+        if(!tc->entries[i]) {
+            LOCK_HEAP(&main_heap);
+            for(n = 0; n < TCACHE_FILL && (p = heap_malloc(&main_heap, i * ALIGNMENT, NULL)); n++) {
+                *(void**)p = tc->entries[i];
+                tc->entries[i] = p;
+                tc->count[i]++;
+            }
+            UNLOCK_HEAP(&main_heap);
+        }
+        if(!tc->entries[i])
+            return NULL;
+    }
+    p = tc->entries[i];
+    tc->entries[i] = *(void**)p;
+    tc->count[i]--;
+    return p;
+}
+
+/*
+Push a freed slot of the thread in its cache without locking, half of a full class is given back to the slabs
+@param p Pointer to the slot that is being freed
+@param size Usable size of the slot, 0 for an invalid slot
+@return 1 if the slot was cached or 0 if it has to be freed in its slab
+*/
+int tcache_put(void *p, size_t size) {
+    struct tcache *tc;
+    size_t i = size / ALIGNMENT;
+    if(i == 0 || i >= TCACHE_CLASSES)
+        return 0;
+    tc = get_tcache();
+    if(tc->count[i] >= TCACHE_COUNT)
+        tcache_flush(tc, i, TCACHE_COUNT - TCACHE_FILL);
+    *(void**)p = tc->entries[i];
+    tc->entries[i] = p;
+    tc->count[i]++;
+    return 1;
+}
+
+/*
+Collect the slots of the thread freed by other threads, the whole remote list is taken with one exchange
+They go in the cache of their size class, the slots of a full class go back to their slabs
+@param tc Pointer to the thread cache
+*/
+void tcache_collect(struct tcache *tc) {
+    void *slots[TCACHE_COUNT], *p, *next;
+    size_t i, nslots = 0;
+    for(p = slab_remote_take(tc->owner); p; p = next) {
+        next = *(void**)p;
+        i = slab_slot_size(p) / ALIGNMENT;
+        if(tc->count[i] < TCACHE_COUNT) {
+            *(void**)p = tc->entries[i];
+            tc->entries[i] = p;
+            tc->count[i]++;
+            continue;
+        }
+        slots[nslots++] = p;
+        if(nslots == TCACHE_COUNT) {
+            slab_free_batch(slots, nslots);
+            nslots = 0;
+        }
+    }
+    if(nslots)
+        slab_free_batch(slots, nslots);
+}
+
+/*
+Give cached blocks of a size class back to the slabs and to the heap, with a single lock of each
+A tier whose lock is held by another thread gets the blocks on its remote list instead of being waited for
+@param tc Pointer to the thread cache
+@param i Size class to flush
+@param keep Number of blocks to leave in the cache
+*/
+void tcache_flush(struct tcache *tc, size_t i, unsigned int keep) {
+    void *slots[TCACHE_COUNT], *p;
+    meta_block first = NULL, last = NULL, b;
+    size_t nslots = 0;
+    while(tc->count[i] > keep) {
+        p = tc->entries[i];
+        tc->entries[i] = *(void**)p;
+        tc->count[i]--;
+        if(slab_owns(p)) {
+            slots[nslots++] = p;
+            continue;
+        }
+        b = get_pointer_to_meta_block(p);
+        NEXT_FREE(b) = first;
+        if(!first)
+            last = b;
+        first = b;
+    }
+    if(nslots)
+        slab_free_batch(slots, nslots);
+    if(!first)
+        return;
+    if(TRYLOCK_HEAP(&main_heap)) {
+        heap_remote_free(&main_heap, first, last);
+        return;
+    }
+    for(b = first; b; b = first) {
+        first = NEXT_FREE(b);
+        heap_free_fast(&main_heap, b);
+    }
+    UNLOCK_HEAP(&main_heap);
+}
+
+/*
+Push a chain of freed blocks on the remote list of a heap without locking
+The blocks stay claimed until the thread that next allocates from the heap collects them
+@param h Pointer to the heap
+@param first First block of the chain, linked through NEXT_FREE
+@param last Last block of the chain
+*/
+void heap_remote_free(struct my_heap *h, meta_block first, meta_block last) {
+    meta_block head = __atomic_load_n(&h->remote, __ATOMIC_RELAXED);
+    do
+        NEXT_FREE(last) = head;
+    while(!__atomic_compare_exchange_n(&h->remote, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+Free every block of the remote list of a heap, the list is taken whole with one exchange
+The caller holds the heap lock
+@param h Pointer to the heap
+*/
+void collect_remote(struct my_heap *h) {
+    meta_block b, next;
+    for(b = __atomic_exchange_n(&h->remote, NULL, __ATOMIC_ACQUIRE); b; b = next) {
+        next = NEXT_FREE(b);
+        heap_free_fast(h, b);
+    }
+}
+
+/*
+Heap of the CPU the calling thread runs on, reserved on first use like a growable heap
+Threads that run on the same CPU share its heap, so the memory kept by the fast bins grows with
+the number of CPUs and not of threads. A thread that moves to another CPU meanwhile only costs a lock
+that is contended more often, its blocks are freed in their own heap wherever it runs
+@return Pointer to the heap, the default heap if the address space can not be reserved
+*/
+struct my_heap *cpu_heap(void) {
+    unsigned int count = PERCPU_ON();
+    int cpu = sched_getcpu();
+    struct my_heap **slot, *h, *expected = NULL;
+    // the thread cache is not used, but its exit destructor flushes the counters and the trace of the thread
+    tcache_arm();
+    // the mode may have been turned off since the caller checked it
+    if(!count)
+        return &main_heap;
+    slot = &cpu_heaps[(cpu < 0 ? 0 : (unsigned int)cpu) % count];
+    if((h = __atomic_load_n(slot, __ATOMIC_ACQUIRE)))
+        return h;
+    if(!(h = my_heap_create_growable()))
+        return &main_heap;
+    h->source = HEAP_CPU;
+    // 2 threads may reserve a heap for the same CPU, the one that loses the race gives its heap back
+    if(!__atomic_compare_exchange_n(slot, &expected, h, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        h->source = HEAP_MAPPED;
+        my_heap_destroy(h);
+        h = expected;
+    }
+    return h;
+}
+
+/*
+Thread exit destructor, drains every size class of the thread cache
+@param arg Pointer to the thread cache
+*/
+void tcache_destroy(void *arg) {
+    struct tcache *tc = arg;
+    size_t i;
+    for(i = 0; i < TCACHE_CLASSES; i++)
+        if(tc->count[i])
+            tcache_flush(tc, i, 0);
+    // the slots freed for the thread meanwhile are freed in their slab by the release
+    slab_owner_release(tc->owner);
+    tc->owner = NULL;
+    tc->owned = 0;
+    tc->registered = 0;
+    trace_thread_exit();
+#ifndef MY_ALLOC_NO_STATS
+    stats_flush(&stats_local);
+#endif
+}
+#endif
+
+/*
+Visit every block of the heap in address order and summarize the fragmentation
+The heap lock is held during the whole walk, so the walker must not call the allocator
+The fast bins are consolidated first, their blocks are free but still marked as claimed
+@param walker Function called for every block, can be NULL to only get the summary
+@param arg Argument passed to the walker
+@return Summary of the heap
+*/
+struct my_heap_summary my_heap_walk(my_heap_walker walker, void *arg) {
+    struct my_heap_summary sum;
+    struct my_heap_block info;
+    char *end = NULL;
+    meta_block b;
+    memset(&sum, 0, sizeof(sum));
+    LOCK_HEAP(&main_heap);
+    consolidate_fast(&main_heap);
+    for(b = main_heap.base; b; b = next_block(&main_heap, b)) {
+        info.address = b->anchor;
+        info.size = block_size(b);
+        info.free = block_free(b);
+        info.gap = end ? (size_t)(b->anchor - end) : BLOCK_SIZE;
+        end = b->anchor + info.size;
+        sum.blocks++;
+        sum.header_bytes += BLOCK_SIZE;
+        if(info.free) {
+            sum.free_blocks++;
+            sum.free_bytes += info.size;
+            if(info.size > sum.largest_free)
+                sum.largest_free = info.size;
+        }
+        else {
+            sum.used_bytes += info.size;
+            // every free byte seen so far lies below a claimed block
+            sum.trapped_bytes = sum.free_bytes;
+        }
+        if(walker)
+            walker(&info, arg);
+    }
+    sum.top_bytes = main_heap.top_end - main_heap.top;
+    UNLOCK_HEAP(&main_heap);
+    if(sum.free_bytes)
+        sum.fragmentation = 1.0 - (double)sum.largest_free / sum.free_bytes;
+    return sum;
+}
+
+/*
+Append formatted text to the dump buffer, writing the buffer out when it fills up
+snprintf does not allocate for the integer and pointer conversions used here
+@param d Pointer to the dump state
+@param format printf format
+@return 0 on success or -1 if a write failed
+*/
+int dump_printf(struct heap_dump *d, const char *format, ...) {
+    va_list ap;
+    char line[256];
+    int n;
+    va_start(ap, format);
+    n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if(n < 0 || (size_t)n >= sizeof(line))
+        return -1;
+    if(d->len + n > sizeof(d->buf)) {
+        if(write(d->fd, d->buf, d->len) != (ssize_t)d->len)
+            d->error = 1;
+        d->len = 0;
+    }
+    memcpy(d->buf + d->len, line, n);
+    d->len += n;
+    return d->error ? -1 : 0;
+}
+
+/*
+Walker of my_heap_dump, writes one record per block
+@param block Block reported by the walk
+@param arg Pointer to the dump state
+*/
+void dump_block(const struct my_heap_block *block, void *arg) {
+    struct heap_dump *d = arg;
+    if(d->format == MY_HEAP_DUMP_CSV)
+        dump_printf(d, "%p,%zu,%d,%zu\n", block->address, block->size, block->free, block->gap);
+    else
+        dump_printf(d, "%s\n    {\"address\": \"%p\", \"size\": %zu, \"free\": %s, \"gap\": %zu}",
+                    d->blocks ? "," : "", block->address, block->size, block->free ? "true" : "false", block->gap);
+    d->blocks++;
+}
+
+/*
+Write every block of the heap and the summary of the walk as JSON or CSV
+CSV has one line per block (address,size,free,gap) and the summary on lines starting with #
+@param fd File descriptor to write to
+@param format MY_HEAP_DUMP_JSON or MY_HEAP_DUMP_CSV
+@return 0 on success or -1 if the format is unknown or a write failed
+*/
+int my_heap_dump(int fd, int format) {
+    struct heap_dump d;
+    struct my_heap_summary sum;
+    if(format != MY_HEAP_DUMP_JSON && format != MY_HEAP_DUMP_CSV)
+        return -1;
+    d.fd = fd;
+    d.format = format;
+    d.blocks = d.len = 0;
+    d.error = 0;
+    dump_printf(&d, format == MY_HEAP_DUMP_CSV ? "address,size,free,gap\n" : "{\n  \"blocks\": [");
+    sum = my_heap_walk(dump_block, &d);
+    if(format == MY_HEAP_DUMP_CSV)
+        dump_printf(&d, "# blocks=%zu free_blocks=%zu used_bytes=%zu free_bytes=%zu header_bytes=%zu top_bytes=%zu\n"
+                    "# largest_free=%zu trapped_bytes=%zu fragmentation=%.4f\n",
+                    sum.blocks, sum.free_blocks, sum.used_bytes, sum.free_bytes, sum.header_bytes, sum.top_bytes,
+                    sum.largest_free, sum.trapped_bytes, sum.fragmentation);
+    else
+        dump_printf(&d, "\n  ],\n  \"summary\": {\"blocks\": %zu, \"free_blocks\": %zu, \"used_bytes\": %zu, "
+                    "\"free_bytes\": %zu, \"header_bytes\": %zu, \"top_bytes\": %zu, \"largest_free\": %zu, "
+                    "\"trapped_bytes\": %zu, \"fragmentation\": %.4f}\n}\n",
+                    sum.blocks, sum.free_blocks, sum.used_bytes, sum.free_bytes, sum.header_bytes, sum.top_bytes,
+                    sum.largest_free, sum.trapped_bytes, sum.fragmentation);
+    if(d.len && write(fd, d.buf, d.len) != (ssize_t)d.len)
+        d.error = 1;
+    return d.error ? -1 : 0;
+}
+
+/*
+Write the profile of the sampled allocations, enabled with my_mallopt(MY_M_PROF_SAMPLE, bytes)
+@param fd File descriptor to write to
+@param format MY_PROF_PPROF (gperftools heap profile read by pprof), MY_PROF_COLLAPSED_LIVE or
+MY_PROF_COLLAPSED_TOTAL (collapsed stacks for flame graphs, live or cumulative bytes)
+@return 0 on success or -1 if the format is unknown, the profiler never ran or a write failed
+*/
+int my_heap_profile(int fd, int format) {
+    return prof_dump(fd, format);
+}
+
+/*
+Record every call of my_malloc, my_calloc, my_realloc, my_free and the aligned interfaces in a trace file
+that bench/trace_replay can run again against this allocator or another one
+@param path Path of the trace file, truncated if it exists
+@return 0 on success or -1 if a trace is already recorded or the file can not be written
+*/
+int my_trace_start(const char *path) {
+    return trace_start(path);
+}
+
+/*
+Stop recording and write the buffered records, the other threads should not allocate meanwhile
+*/
+void my_trace_stop(void) {
+    trace_stop();
+}
+
+#ifndef MY_ALLOC_NO_STATS
+/*
+Usable size of a block that was just allocated, slabs first then the metadata block of the heap or of the mapping
+@param p Pointer to the payload
+@return Usable size of the block
+*/
+size_t allocated_size(void *p) {
+    size_t size = slab_slot_size(p);
+    return size ? size : block_size(get_pointer_to_meta_block(p));
+}
+
+/*
+Count an allocation in the counters of the calling thread
+@param request The bytes allocated by the user
+@param size Usable size of the allocated block
+*/
+void stats_alloc(size_t request, size_t size) {
+    struct stats_counters *c = STATS_LOCAL;
+    size_t bucket = request <= 16 ? 0 : 60 - __builtin_clzll(request - 1);
+    c->live += size;
+    c->mallocs++;
+    c->histogram[bucket < MY_STATS_BUCKETS ? bucket : MY_STATS_BUCKETS - 1]++;
+#ifdef MY_ALLOC_THREADS
+    if(++c->pending >= STATS_BATCH)
+        stats_flush(c);
+#endif
+}
+
+/*
+Count a free in the counters of the calling thread
+@param size Usable size of the freed block
+*/
+void stats_free(size_t size) {
+    struct stats_counters *c = STATS_LOCAL;
+    c->live -= size;
+    c->frees++;
+#ifdef MY_ALLOC_THREADS
+    if(++c->pending >= STATS_BATCH)
+        stats_flush(c);
+#endif
+}
+
+/*
+Count a resize in the counters of the calling thread
+@param old_size Usable size of the block before the resize
+@param new_size Usable size of the block after the resize
+*/
+void stats_realloc(size_t old_size, size_t new_size) {
+    struct stats_counters *c = STATS_LOCAL;
+    c->live += new_size - old_size;
+    c->reallocs++;
+#ifdef MY_ALLOC_THREADS
+    if(++c->pending >= STATS_BATCH)
+        stats_flush(c);
+#endif
+}
+
+/*
+Add the counters of a thread to the shared counters and clear them
+@param c Pointer to the counters of the thread
+*/
+void stats_flush(struct stats_counters *c) {
+    size_t i;
+    if(c == &stats_total)
+        return;
+    __atomic_fetch_add(&stats_total.live, c->live, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_total.mallocs, c->mallocs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_total.frees, c->frees, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_total.reallocs, c->reallocs, __ATOMIC_RELAXED);
+    for(i = 0; i < MY_STATS_BUCKETS; i++)
+        if(c->histogram[i])
+            __atomic_fetch_add(&stats_total.histogram[i], c->histogram[i], __ATOMIC_RELAXED);
+    memset(c, 0, sizeof(*c));
+}
+
+/*
+Add the counters and the byte counts of a heap to a snapshot, they are kept up to date under its lock
+@param h Pointer to the heap
+@param s Pointer to the snapshot
+*/
+void stats_heap(struct my_heap *h, struct my_malloc_stats *s) {
+    LOCK_HEAP(h);
+    s->extend_heap += h->counters.extend_heap;
+    s->split_block += h->counters.split_block;
+    s->fusion += h->counters.fusion;
+    s->searches += h->counters.searches;
+    s->search_steps += h->counters.search_steps;
+    s->search_misses += h->counters.search_misses;
+    s->header_bytes += h->counters.blocks * BLOCK_SIZE;
+    s->heap_free_bytes += h->counters.free_bytes;
+    s->top_bytes += h->top_end - h->top;
+    s->heap_bytes += h->top_end - (h->base ? (char *)h->base : h->top);
+    UNLOCK_HEAP(h);
+}
+
+/*
+Take a snapshot of the allocator
+The call counters of other threads lag by less than STATS_BATCH events each. The heap figures add up the
+default heap and the per-CPU heaps from counters kept by each heap, only the mmapped blocks are walked
+@return The counters and the byte counts
+*/
+struct my_malloc_stats my_malloc_stats(void) {
+    struct my_malloc_stats s;
+    struct large_block *l;
+    ptrdiff_t live;
+    size_t i;
+#ifdef MY_ALLOC_THREADS
+    struct my_heap *h;
+#endif
+    memset(&s, 0, sizeof(s));
+    stats_flush(STATS_LOCAL);
+    live = __atomic_load_n(&stats_total.live, __ATOMIC_RELAXED);
+    s.live_bytes = live > 0 ? live : 0;
+    s.mallocs = __atomic_load_n(&stats_total.mallocs, __ATOMIC_RELAXED);
+    s.frees = __atomic_load_n(&stats_total.frees, __ATOMIC_RELAXED);
+    s.reallocs = __atomic_load_n(&stats_total.reallocs, __ATOMIC_RELAXED);
+    for(i = 0; i < MY_STATS_BUCKETS; i++)
+        s.size_histogram[i] = __atomic_load_n(&stats_total.histogram[i], __ATOMIC_RELAXED);
+    stats_heap(&main_heap, &s);
+#ifdef MY_ALLOC_THREADS
+    // the heaps stay once created, also while the mode is off
+    for(i = 0; i < MAX_CPU_HEAPS; i++)
+        if((h = __atomic_load_n(&cpu_heaps[i], __ATOMIC_ACQUIRE)))
+            stats_heap(h, &s);
+#endif
+    slab_stats(&s.slab_bytes, &s.slab_used_bytes);
+    LOCK_LARGE();
+    for(l = large_blocks; l; l = l->next) {
+        s.header_bytes += LARGE_HEADER + BLOCK_SIZE;
+        s.large_bytes += l->meta.prev_size + block_size(&l->meta) + LARGE_HEADER + BLOCK_SIZE;
+    }
+    s.large_cached_bytes = large_cache_bytes;
+    UNLOCK_LARGE();
+    return s;
+}
+#else
+/*
+Statistics are compiled out, the snapshot is empty
+@return Zeroed counters
+*/
+struct my_malloc_stats my_malloc_stats(void) {
+    struct my_malloc_stats s;
+    memset(&s, 0, sizeof(s));
+    return s;
+}
+#endif
@@ -3,9 +3,160 @@
 
 #include <stddef.h>
 
+// Parameters of my_mallopt
+#define MY_M_MMAP_THRESHOLD 1
+#define MY_M_SLAB_MAX 2
+#define MY_M_TRIM_THRESHOLD 3
+#define MY_M_TOP_PAD 4
+#define MY_M_PROF_SAMPLE 5
+#define MY_M_MXFAST 6
+#define MY_M_PERCPU 7
+// Buckets of the request size histogram of my_malloc_stats
+#define MY_STATS_BUCKETS 16
+
+/*
+Snapshot of the allocator returned by my_malloc_stats, every field is 0 in a build with MY_ALLOC_NO_STATS
+@param live_bytes Usable bytes of the blocks held by the user
+@param heap_bytes Bytes between the start of the heap and the program break
+@param heap_free_bytes Bytes of the free blocks of the heap
+@param top_bytes Bytes of the top chunk, between the last block and the program break
+@param header_bytes Bytes taken by the metadata of the heap blocks and of the mmapped blocks
+@param slab_bytes Bytes of the slabs carved so far
+@param slab_used_bytes Bytes of the claimed slots
+@param large_bytes Bytes mapped by live mmapped blocks
+@param large_cached_bytes Bytes of unmapped regions kept for reuse
+@param mallocs Number of allocations, calloc and the aligned interfaces included
+@param frees Number of frees
+@param reallocs Number of resizes of a block of the heap or of an mmapped block
+@param extend_heap Number of blocks appended at the end of the heap
+@param split_block Number of blocks split in two
+@param fusion Number of free neighbours merged into a block
+@param searches Number of free list searches
+@param search_steps Bitmap words read by the searches, search_steps / searches is the average search length
+@param search_misses Searches that found no free block
+@param size_histogram Requested sizes, bucket 0 counts sizes up to 16 bytes, bucket i sizes up to 16 << i
+and the last bucket every larger size
+*/
+struct my_malloc_stats {
+    size_t live_bytes;
+    size_t heap_bytes;
+    size_t heap_free_bytes;
+    size_t top_bytes;
+    size_t header_bytes;
+    size_t slab_bytes;
+    size_t slab_used_bytes;
+    size_t large_bytes;
+    size_t large_cached_bytes;
+    size_t mallocs;
+    size_t frees;
+    size_t reallocs;
+    size_t extend_heap;
+    size_t split_block;
+    size_t fusion;
+    size_t searches;
+    size_t search_steps;
+    size_t search_misses;
+    size_t size_histogram[MY_STATS_BUCKETS];
+};
+
+// Formats of my_heap_dump
+#define MY_HEAP_DUMP_JSON 0
+#define MY_HEAP_DUMP_CSV 1
+// Formats of my_heap_profile
+#define MY_PROF_PPROF 0
+#define MY_PROF_COLLAPSED_LIVE 1
+#define MY_PROF_COLLAPSED_TOTAL 2
+
+/*
+Block of the heap reported by my_heap_walk
+@param address Pointer to the payload
+@param size Usable size of the payload
+@param free 1 if the block is free or 0 if it is claimed (blocks held by a thread cache, a fast bin or a remote list are claimed)
+@param gap Bytes between the end of the previous payload and this payload, the metadata block included
+*/
+struct my_heap_block {
+    void *address;
+    size_t size;
+    int free;
+    size_t gap;
+};
+
+/*
+Summary of a walk of the heap
+@param blocks Number of blocks
+@param free_blocks Number of free blocks
+@param used_bytes Bytes of the claimed payloads
+@param free_bytes Bytes of the free payloads
+@param header_bytes Bytes of the metadata blocks
+@param top_bytes Bytes of the top chunk, between the last block and the program break
+@param largest_free Size of the largest free block
+@param trapped_bytes Free bytes below the last claimed block, brk() can not give them back
+@param fragmentation External fragmentation index, 1 - largest_free / free_bytes (0 without free blocks)
+*/
+struct my_heap_summary {
+    size_t blocks;
+    size_t free_blocks;
+    size_t used_bytes;
+    size_t free_bytes;
+    size_t header_bytes;
+    size_t top_bytes;
+    size_t largest_free;
+    size_t trapped_bytes;
+    double fragmentation;
+};
+
+// Heap with its own memory and lock, created with my_heap_create or my_heap_create_growable
+struct my_heap;
+
+// Arena of bump-allocated blocks that are freed all at once, created with my_arena_create
+struct my_arena;
+
+/*
+Position of an arena returned by my_arena_mark
+@param chunk Chunk of the arena at the mark
+@param ptr Next free byte of that chunk
+*/
+struct my_arena_mark {
+    void *chunk;
+    char *ptr;
+};
+
+// Called for every block in address order, with the heap locked: it must not call the allocator
+typedef void (*my_heap_walker)(const struct my_heap_block *block, void *arg);
+
 void *my_malloc(size_t size);
 void *my_calloc(size_t n, size_t size);
 void  my_free(void *ptr);
+void  my_free_sized(void *ptr, size_t size);
+// A size of 0 frees the block and returns NULL, for a slot, a heap block and an mmapped block alike
 void *my_realloc(void *p, size_t new_size);
+size_t my_malloc_batch(size_t size, size_t n, void **ptrs);
+void  my_free_batch(void **ptrs, size_t n);
+size_t my_try_expand(void *p, size_t min_size, size_t preferred_size);
+size_t my_shrink_in_place(void *p, size_t size);
+int   my_mallopt(int param, size_t value);
+void *my_aligned_alloc(size_t alignment, size_t size);
+int   my_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *my_memalign(size_t alignment, size_t size);
+size_t my_usable_size(void *p);
+struct my_malloc_stats my_malloc_stats(void);
+struct my_heap_summary my_heap_walk(my_heap_walker walker, void *arg);
+int   my_heap_dump(int fd, int format);
+int   my_heap_profile(int fd, int format);
+int   my_trace_start(const char *path);
+void  my_trace_stop(void);
+struct my_heap *my_heap_create(void *buffer, size_t len);
+struct my_heap *my_heap_create_growable(void);
+void  my_heap_destroy(struct my_heap *heap);
+void *my_heap_malloc(struct my_heap *heap, size_t size);
+void  my_heap_free(struct my_heap *heap, void *p);
+// Like my_realloc, a size of 0 frees the block and returns NULL
+void *my_heap_realloc(struct my_heap *heap, void *p, size_t size);
+struct my_arena *my_arena_create(size_t chunk_size);
+void *my_arena_alloc(struct my_arena *arena, size_t size);
+struct my_arena_mark my_arena_mark(struct my_arena *arena);
+void  my_arena_restore(struct my_arena *arena, struct my_arena_mark mark);
+void  my_arena_reset(struct my_arena *arena);
+void  my_arena_destroy(struct my_arena *arena);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "alloc.h"
+#include <stdint.h>
+
+// Arenas: blocks are carved by moving a pointer through chunks taken from my_malloc and are never freed
+// one by one, a reset or a restore to a mark gives back every block carved after it at once
+
+// first chunk when my_arena_create gets 0, each new chunk doubles the previous one up to ARENA_MAX_CHUNK
+#define ARENA_CHUNK (16 * 1024)
+#define ARENA_MAX_CHUNK (1024 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/*
+Chunk of an arena, the blocks are carved from the bytes after the header
+@param prev Pointer to the chunk carved from before this one
+@param end End of the chunk
+*/
+struct arena_chunk {
+    struct arena_chunk *prev;
+    char *end;
+};
+
+/*
+State of an arena
+@param chunk Pointer to the chunk blocks are carved from, the newest one
+@param ptr Next free byte of the chunk
+@param next_size Size of the next chunk
+*/
+struct my_arena {
+    struct arena_chunk *chunk;
+    char *ptr;
+    size_t next_size;
+};
+
+static size_t chunk_header(void) {
+    return ARENA_ROUND(sizeof(struct arena_chunk));
+}
+
+/*
+Take a new chunk from the allocator and carve from it from now on
+@param a Pointer to the arena
+@param size Bytes the chunk must hold after its header
+@return 0 on success or -1 if the allocator is out of memory
+*/
+static int new_chunk(struct my_arena *a, size_t size) {
+    struct arena_chunk *c;
+    size_t len = a->next_size;
+    if(size > len - chunk_header())
+        len = size + chunk_header();
+    if(!(c = my_malloc(len)))
+        return -1;
+    c->prev = a->chunk;
+    c->end = (char *)c + len;
+    a->chunk = c;
+    a->ptr = (char *)c + chunk_header();
+    if(a->next_size < ARENA_MAX_CHUNK)
+        a->next_size *= 2;
+    return 0;
+}
+
+/*
+Create an empty arena, its first chunk is allocated right away
+@param chunk_size Size of the first chunk, 0 for 16 KiB
+@return Pointer to the arena or NULL if the allocator is out of memory
+*/
+struct my_arena *my_arena_create(size_t chunk_size) {
+    struct my_arena *a = my_malloc(sizeof(struct my_arena));
+    if(!a)
+        return NULL;
+    a->chunk = NULL;
+    a->next_size = chunk_size > chunk_header() ? ARENA_ROUND(chunk_size) : ARENA_CHUNK;
+    if(new_chunk(a, 0)) {
+        my_free(a);
+        return NULL;
+    }
+    return a;
+}
+
+/*
+Allocate a block from an arena by moving the pointer of its current chunk
+The block lives until the arena is reset, restored to a mark taken before it or destroyed
+@param a Pointer to the arena
+@param size The bytes allocated by the user
+@return Pointer to a 16-byte aligned block or NULL if the size is 0 or the allocator is out of memory
+*/
+void *my_arena_alloc(struct my_arena *a, size_t size) {
+    void *p;
+    if(!size || size > PTRDIFF_MAX - ARENA_MAX_CHUNK)
+        return NULL;
+    size = ARENA_ROUND(size);
+    if(size > (size_t)(a->chunk->end - a->ptr) && new_chunk(a, size))
+        return NULL;
+    p = a->ptr;
+    a->ptr += size;
+    return p;
+}
+
+/*
+Save the position of an arena, the blocks allocated after it are freed by my_arena_restore
+Marks nest: restoring a mark also drops the marks taken after it
+@param a Pointer to the arena
+@return The position of the arena
+*/
+struct my_arena_mark my_arena_mark(struct my_arena *a) {
+    struct my_arena_mark mark = {a->chunk, a->ptr};
+    return mark;
+}
+
+/*
+Free every block allocated after a mark, the chunks taken after it go back to the allocator
+@param a Pointer to the arena
+@param mark Position returned by my_arena_mark since the last reset of the arena
+*/
+void my_arena_restore(struct my_arena *a, struct my_arena_mark mark) {
+    struct arena_chunk *c;
+    while(a->chunk != mark.chunk) {
+        c = a->chunk;
+        a->chunk = c->prev;
+        my_free(c);
+    }
+    a->ptr = mark.ptr;
+}
+
+/*
+Free every block of an arena in one step
+The newest chunk is kept, chunks grow, so an arena reset after each request soon carves
+every request from that one chunk without calling the allocator
+@param a Pointer to the arena
+*/
+void my_arena_reset(struct my_arena *a) {
+    struct arena_chunk *c, *prev;
+    for(c = a->chunk->prev; c; c = prev) {
+        prev = c->prev;
+        my_free(c);
+    }
+    a->chunk->prev = NULL;
+    a->ptr = (char *)a->chunk + chunk_header();
+}
+
+/*
+Free an arena with all of its blocks
+@param a Pointer to the arena, can be NULL
+*/
+void my_arena_destroy(struct my_arena *a) {
+    struct arena_chunk *c, *prev;
+    if(!a)
+        return;
+    for(c = a->chunk; c; c = prev) {
+        prev = c->prev;
+        my_free(c);
+    }
+    my_free(a);
+}
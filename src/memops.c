@@ -0,0 +1,238 @@
+#include "memops.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEMOPS_X86 1
+#endif
+
+static void copy_init(void *dst, const void *src, size_t n);
+static void zero_init(void *dst, size_t n);
+
+// kernels picked on the first call, every thread selects the same ones so the race is harmless
+static void (*copy_kernel)(void *, const void *, size_t) = copy_init;
+static void (*zero_kernel)(void *, size_t) = zero_init;
+
+/*
+Copy memory between two buffers that do not overlap with the fastest kernel of the CPU
+@param dst Pointer to the destination
+@param src Pointer to the source
+@param n Number of bytes to copy
+*/
+void mem_copy(void *dst, const void *src, size_t n) {
+    __atomic_load_n(&copy_kernel, __ATOMIC_RELAXED)(dst, src, n);
+}
+
+/*
+Zero a buffer with the fastest kernel of the CPU
+@param dst Pointer to the buffer
+@param n Number of bytes to zero
+*/
+void mem_zero(void *dst, size_t n) {
+    __atomic_load_n(&zero_kernel, __ATOMIC_RELAXED)(dst, n);
+}
+
+/*
+Check if the CPU supports AVX2
+@return 1 if the AVX2 kernels can be used, 0 otherwise
+*/
+int memops_has_avx2(void) {
+#ifdef MEMOPS_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+static void copy_init(void *dst, const void *src, size_t n) {
+    void (*kernel)(void *, const void *, size_t) = memops_has_avx2() ? copy_avx2 : copy_sse2;
+    __atomic_store_n(&copy_kernel, kernel, __ATOMIC_RELAXED);
+    kernel(dst, src, n);
+}
+
+static void zero_init(void *dst, size_t n) {
+    void (*kernel)(void *, size_t) = memops_has_avx2() ? zero_avx2 : zero_sse2;
+    __atomic_store_n(&zero_kernel, kernel, __ATOMIC_RELAXED);
+    kernel(dst, n);
+}
+
+/*
+Reference kernel copying one byte per iteration
+@param dst Pointer to the destination
+@param src Pointer to the source
+@param n Number of bytes to copy
+*/
+void copy_bytes(void *dst, const void *src, size_t n) {
+    char *d = dst;
+    const char *s = src;
+    while(n--)
+        *d++ = *s++;
+}
+
+/*
+Reference kernel zeroing one size_t per iteration, the tail is zeroed byte by byte
+@param dst Pointer to the buffer
+@param n Number of bytes to zero
+*/
+void zero_words(void *dst, size_t n) {
+    size_t *d = dst;
+    for(; n >= sizeof(size_t); n -= sizeof(size_t))
+        *d++ = 0;
+    memset(d, 0, n);
+}
+
+#ifdef MEMOPS_X86
+
+/*
+Copy with 16-byte SSE2 vectors
+The first and the last vectors are unaligned, the ones in between are stored aligned,
+bypassing the cache for copies of at least MEMOPS_NT_THRESHOLD bytes
+@param dst Pointer to the destination
+@param src Pointer to the source
+@param n Number of bytes to copy
+*/
+__attribute__((target("sse2")))
+void copy_sse2(void *dst, const void *src, size_t n) {
+    char *d = dst;
+    const char *s = src;
+    __m128i head, tail;
+    size_t skew;
+    if(n < 32) {
+        memcpy(d, s, n);
+        return;
+    }
+    head = _mm_loadu_si128((const __m128i *)s);
+    tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+    _mm_storeu_si128((__m128i *)(d + n - 16), tail);
+    skew = 16 - ((uintptr_t)d & 15);
+    _mm_storeu_si128((__m128i *)d, head);
+    d += skew;
+    s += skew;
+    n -= skew;
+    if(n >= MEMOPS_NT_THRESHOLD) {
+        for(; n >= 16; n -= 16, d += 16, s += 16)
+            _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+        _mm_sfence();
+    }
+    else
+        for(; n >= 16; n -= 16, d += 16, s += 16)
+            _mm_store_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+}
+
+/*
+Copy with 32-byte AVX2 vectors, same layout as copy_sse2
+@param dst Pointer to the destination
+@param src Pointer to the source
+@param n Number of bytes to copy
+*/
+__attribute__((target("avx2")))
+void copy_avx2(void *dst, const void *src, size_t n) {
+    char *d = dst;
+    const char *s = src;
+    __m256i head, tail;
+    size_t skew;
+    if(n < 64) {
+        memcpy(d, s, n);
+        return;
+    }
+    head = _mm256_loadu_si256((const __m256i *)s);
+    tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+    _mm256_storeu_si256((__m256i *)(d + n - 32), tail);
+    skew = 32 - ((uintptr_t)d & 31);
+    _mm256_storeu_si256((__m256i *)d, head);
+    d += skew;
+    s += skew;
+    n -= skew;
+    if(n >= MEMOPS_NT_THRESHOLD) {
+        for(; n >= 32; n -= 32, d += 32, s += 32)
+            _mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+        _mm_sfence();
+    }
+    else
+        for(; n >= 32; n -= 32, d += 32, s += 32)
+            _mm256_store_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+    _mm256_zeroupper();
+}
+
+/*
+Zero with 16-byte SSE2 vectors, bypassing the cache for at least MEMOPS_NT_THRESHOLD bytes
+@param dst Pointer to the buffer
+@param n Number of bytes to zero
+*/
+__attribute__((target("sse2")))
+void zero_sse2(void *dst, size_t n) {
+    char *d = dst;
+    __m128i zero = _mm_setzero_si128();
+    size_t skew;
+    if(n < 32) {
+        memset(d, 0, n);
+        return;
+    }
+    _mm_storeu_si128((__m128i *)(d + n - 16), zero);
+    _mm_storeu_si128((__m128i *)d, zero);
+    skew = 16 - ((uintptr_t)d & 15);
+    d += skew;
+    n -= skew;
+    if(n >= MEMOPS_NT_THRESHOLD) {
+        for(; n >= 16; n -= 16, d += 16)
+            _mm_stream_si128((__m128i *)d, zero);
+        _mm_sfence();
+    }
+    else
+        for(; n >= 16; n -= 16, d += 16)
+            _mm_store_si128((__m128i *)d, zero);
+}
+
+/*
+Zero with 32-byte AVX2 vectors, same layout as zero_sse2
+@param dst Pointer to the buffer
+@param n Number of bytes to zero
+*/
+__attribute__((target("avx2")))
+void zero_avx2(void *dst, size_t n) {
+    char *d = dst;
+    __m256i zero = _mm256_setzero_si256();
+    size_t skew;
+    if(n < 64) {
+        memset(d, 0, n);
+        return;
+    }
+    _mm256_storeu_si256((__m256i *)(d + n - 32), zero);
+    _mm256_storeu_si256((__m256i *)d, zero);
+    skew = 32 - ((uintptr_t)d & 31);
+    d += skew;
+    n -= skew;
+    if(n >= MEMOPS_NT_THRESHOLD) {
+        for(; n >= 32; n -= 32, d += 32)
+            _mm256_stream_si256((__m256i *)d, zero);
+        _mm_sfence();
+    }
+    else
+        for(; n >= 32; n -= 32, d += 32)
+            _mm256_store_si256((__m256i *)d, zero);
+    _mm256_zeroupper();
+}
+
+#else
+
+// other architectures fall back to the C library, which is vectorized for them
+
+void copy_sse2(void *dst, const void *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+void copy_avx2(void *dst, const void *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+void zero_sse2(void *dst, size_t n) {
+    memset(dst, 0, n);
+}
+
+void zero_avx2(void *dst, size_t n) {
+    memset(dst, 0, n);
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef MEMOPS_H
+#define MEMOPS_H
+
+#include <stddef.h>
+
+// copies and fills of at least this many bytes bypass the cache with non-temporal stores
+#define MEMOPS_NT_THRESHOLD (1024 * 1024)
+
+void mem_copy(void *dst, const void *src, size_t n);
+void mem_zero(void *dst, size_t n);
+
+void copy_bytes(void *dst, const void *src, size_t n);
+void copy_sse2(void *dst, const void *src, size_t n);
+void copy_avx2(void *dst, const void *src, size_t n);
+void zero_words(void *dst, size_t n);
+void zero_sse2(void *dst, size_t n);
+void zero_avx2(void *dst, size_t n);
+int  memops_has_avx2(void);
+
+#endif
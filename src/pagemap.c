@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include "pagemap.h"
+#include <sys/mman.h>
+#ifdef MY_ALLOC_THREADS
+#include <pthread.h>
+#endif
+
+// Radix tree from the page number of an address to the tier that owns the page, like the page map of tcmalloc
+// 3 levels of 12 bits cover the 36 bits of page numbers of 48-bit addresses, a lookup is 3 dependent loads
+#define PAGEMAP_BITS 12
+#define PAGEMAP_FANOUT (1 << PAGEMAP_BITS)
+#define PAGEMAP_MASK (PAGEMAP_FANOUT - 1)
+#define PAGEMAP_LEVELS 3
+#define PAGEMAP_NODE_SIZE (PAGEMAP_FANOUT * sizeof(void *))
+
+#ifdef MY_ALLOC_THREADS
+#define LOCK_PAGEMAP() pthread_mutex_lock(&pagemap_lock)
+#define UNLOCK_PAGEMAP() pthread_mutex_unlock(&pagemap_lock)
+static pthread_mutex_t pagemap_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+#define LOCK_PAGEMAP()
+#define UNLOCK_PAGEMAP()
+#endif
+
+// the nodes are mapped on first use and never released, readers follow them without the lock
+static uintptr_t **root[PAGEMAP_FANOUT];
+
+/*
+Map a zeroed node of the tree
+@return Pointer to the node or NULL if the mapping failed
+*/
+static void *new_node(void) {
+    void *node = mmap(NULL, PAGEMAP_NODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return node == MAP_FAILED ? NULL : node;
+}
+
+/*
+Find the entry of a page, creating the nodes on its path, the caller holds the page map lock
+@param page Page number
+@return Pointer to the entry or NULL if the page is out of range or a node can not be mapped
+*/
+static uintptr_t *entry_of(uintptr_t page) {
+    uintptr_t **mid, *leaf;
+    if(page >> (PAGEMAP_LEVELS * PAGEMAP_BITS))
+        return NULL;
+    mid = root[page >> (2 * PAGEMAP_BITS)];
+    if(!mid) {
+        if(!(mid = new_node()))
+            return NULL;
+        __atomic_store_n(&root[page >> (2 * PAGEMAP_BITS)], mid, __ATOMIC_RELEASE);
+    }
+    leaf = mid[(page >> PAGEMAP_BITS) & PAGEMAP_MASK];
+    if(!leaf) {
+        if(!(leaf = new_node()))
+            return NULL;
+        __atomic_store_n(&mid[(page >> PAGEMAP_BITS) & PAGEMAP_MASK], leaf, __ATOMIC_RELEASE);
+    }
+    return &leaf[page & PAGEMAP_MASK];
+}
+
+/*
+Find the owner of an address without locking and without reading the memory at the address
+@param p Any address
+@return Entry of the page of p (owner and PAGEMAP_HEAP, PAGEMAP_SLAB or PAGEMAP_LARGE) or 0 if no tier owns it
+*/
+uintptr_t pagemap_get(void *p) {
+    uintptr_t page = (uintptr_t)p >> PAGEMAP_SHIFT;
+    uintptr_t **mid, *leaf;
+    if(page >> (PAGEMAP_LEVELS * PAGEMAP_BITS))
+        return 0;
+    mid = __atomic_load_n(&root[page >> (2 * PAGEMAP_BITS)], __ATOMIC_ACQUIRE);
+    if(!mid)
+        return 0;
+    leaf = __atomic_load_n(&mid[(page >> PAGEMAP_BITS) & PAGEMAP_MASK], __ATOMIC_ACQUIRE);
+    if(!leaf)
+        return 0;
+    return __atomic_load_n(&leaf[page & PAGEMAP_MASK], __ATOMIC_ACQUIRE);
+}
+
+/*
+Record the owner of every page that overlaps a range
+The nodes of the whole range are created before any entry is written, so a failure changes nothing
+@param start First address of the range
+@param len Length of the range in bytes, at least 1
+@param entry Owner of the pages with its tier in the 2 low bits
+@return 0 on success or -1 if the range is out of the map or a node can not be mapped
+*/
+int pagemap_set(void *start, size_t len, uintptr_t entry) {
+    uintptr_t first = (uintptr_t)start >> PAGEMAP_SHIFT;
+    uintptr_t last = ((uintptr_t)start + len - 1) >> PAGEMAP_SHIFT;
+    uintptr_t page;
+    LOCK_PAGEMAP();
+    for(page = first; page <= last; page = (page | PAGEMAP_MASK) + 1)
+        if(!entry_of(page)) {
+            UNLOCK_PAGEMAP();
+            return -1;
+        }
+    for(page = first; page <= last; page++)
+        __atomic_store_n(entry_of(page), entry, __ATOMIC_RELEASE);
+    UNLOCK_PAGEMAP();
+    return 0;
+}
+
+/*
+Forget the owner of every page that overlaps a range, the nodes are kept
+@param start First address of the range
+@param len Length of the range in bytes
+*/
+void pagemap_clear(void *start, size_t len) {
+    uintptr_t page = (uintptr_t)start >> PAGEMAP_SHIFT;
+    uintptr_t last = ((uintptr_t)start + len - 1) >> PAGEMAP_SHIFT;
+    uintptr_t **mid, *leaf;
+    if(!len)
+        return;
+    LOCK_PAGEMAP();
+    for(; page <= last && !(page >> (PAGEMAP_LEVELS * PAGEMAP_BITS)); page++) {
+        mid = root[page >> (2 * PAGEMAP_BITS)];
+        leaf = mid ? mid[(page >> PAGEMAP_BITS) & PAGEMAP_MASK] : NULL;
+        if(leaf)
+            __atomic_store_n(&leaf[page & PAGEMAP_MASK], 0, __ATOMIC_RELEASE);
+    }
+    UNLOCK_PAGEMAP();
+}
+
+/*
+Take the page map lock before a fork so that the child does not inherit it held by another thread
+*/
+void pagemap_lock_all(void) {
+    LOCK_PAGEMAP();
+}
+
+/*
+Release the page map lock after a fork, in the parent and in the child
+*/
+void pagemap_unlock_all(void) {
+    UNLOCK_PAGEMAP();
+}
@@ -0,0 +1,23 @@
+#ifndef PAGEMAP_H
+#define PAGEMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pages of the map, independent of the page size of the system
+#define PAGEMAP_SHIFT 12
+#define PAGEMAP_PAGE ((size_t)1 << PAGEMAP_SHIFT)
+// Tier that owns a page, stored in the 2 low bits of an entry, the other bits point to the owner
+#define PAGEMAP_HEAP 1
+#define PAGEMAP_SLAB 2
+#define PAGEMAP_LARGE 3
+#define PAGEMAP_KIND(e) ((int)((e) & 3))
+#define PAGEMAP_OWNER(e) ((void *)((e) & ~(uintptr_t)3))
+
+uintptr_t pagemap_get(void *p);
+int       pagemap_set(void *start, size_t len, uintptr_t entry);
+void      pagemap_clear(void *start, size_t len);
+void      pagemap_lock_all(void);
+void      pagemap_unlock_all(void);
+
+#endif
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include "prof.h"
+#include "alloc.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#ifdef MY_ALLOC_THREADS
+#include <pthread.h>
+#endif
+
+// Sampling heap profiler: roughly one allocation every `rate` bytes records its call stack
+// Live samples are kept in an open addressing table indexed by pointer, call stacks in a table of sites
+
+#define PROF_SAMPLES (1 << 16)
+#define PROF_SITES 4096
+// frames of prof_sample itself
+#define PROF_SKIP 1
+#define LN2 0.6931471805599453
+
+#ifdef MY_ALLOC_THREADS
+#define LOCK_PROF() pthread_mutex_lock(&prof_lock)
+#define UNLOCK_PROF() pthread_mutex_unlock(&prof_lock)
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint64_t prof_seed;
+static __thread int prof_busy;
+#else
+#define LOCK_PROF()
+#define UNLOCK_PROF()
+static uint64_t prof_seed;
+static int prof_busy;
+#endif
+
+/*
+Call site of sampled allocations
+@param hash Hash of the stack, 0 for an unused entry
+@param depth Number of frames of the stack
+@param stack Return addresses, innermost first
+@param live_count Sampled blocks of the site that are not freed yet
+@param live_bytes Bytes of these blocks
+@param total_count Sampled blocks of the site since the profiler started
+@param total_bytes Bytes of these blocks
+*/
+struct prof_site {
+    uint64_t hash;
+    unsigned int depth;
+    void *stack[PROF_DEPTH];
+    size_t live_count;
+    size_t live_bytes;
+    size_t total_count;
+    size_t total_bytes;
+};
+
+/*
+Live sampled block
+@param p Pointer to the block, NULL for an unused entry
+@param size Requested size
+@param site Index of the call site
+*/
+struct prof_entry {
+    void *p;
+    size_t size;
+    unsigned int site;
+};
+
+/*
+Output of a dump, buffered on the stack
+@param fd File descriptor written to
+@param len Number of buffered bytes
+@param error 1 if a write failed
+@param buf Output buffer
+*/
+struct prof_out {
+    int fd;
+    size_t len;
+    int error;
+    char buf[4096];
+};
+
+static size_t rate = 0;
+// sampled blocks not freed yet, read without the lock by prof_free
+static size_t live = 0;
+static struct prof_site *sites = NULL;
+static struct prof_entry *samples = NULL;
+// live samples per home slot of the sample table, lets prof_free skip the lock for unsampled blocks
+static unsigned char filter[PROF_SAMPLES];
+
+/*
+Home slot of a pointer in the sample table
+@param p Pointer to the block
+@return Index of the slot
+*/
+static size_t hash_ptr(void *p) {
+    return (size_t)((((uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ULL) >> (64 - 16));
+}
+
+/*
+Natural logarithm without libm, the exponent is read from the double and the mantissa goes through a short series
+@param x Positive number
+@return ln(x) with about 6 significant digits
+*/
+static double prof_log(double x) {
+    union { double d; uint64_t u; } v = {x};
+    int e = (int)((v.u >> 52) & 0x7ff) - 1023;
+    double t, t2;
+    v.u = (v.u & ((1ULL << 52) - 1)) | (1023ULL << 52);
+    t = (v.d - 1) / (v.d + 1);
+    t2 = t * t;
+    return e * LN2 + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 / 7)));
+}
+
+/*
+Exponential without libm, the argument is halved until the series converges and the result squared back
+@param x Number less or equal to 0
+@return exp(x)
+*/
+static double prof_exp(double x) {
+    int k = 0;
+    double r;
+    while(x < -0.5 && k < 64) {
+        x /= 2;
+        k++;
+    }
+    r = 1 + x * (1 + x / 2 * (1 + x / 3 * (1 + x / 4 * (1 + x / 5))));
+    while(k--)
+        r *= r;
+    return r;
+}
+
+/*
+Draw the number of bytes before the next sample, exponentially distributed with the sampling rate as mean
+The allocations are thus sampled as if every byte had the same chance 1/rate of being picked
+@param r Sampling rate in bytes
+@return Bytes to allocate before the next sample
+*/
+static size_t next_interval(size_t r) {
+    double u, interval;
+    if(!prof_seed)
+        prof_seed = (uintptr_t)&prof_seed ^ 0x9E3779B97F4A7C15ULL;
+    prof_seed ^= prof_seed << 13;
+    prof_seed ^= prof_seed >> 7;
+    prof_seed ^= prof_seed << 17;
+    u = ((prof_seed >> 11) + 1) * (1.0 / 9007199254740992.0);
+    interval = -prof_log(u) * r;
+    return interval < 1 ? 1 : interval > PTRDIFF_MAX / 2 ? PTRDIFF_MAX / 2 : (size_t)interval;
+}
+
+/*
+Find the site of a stack or create it, the caller holds the profiler lock
+@param stack Return addresses, innermost first
+@param depth Number of frames
+@return Index of the site or -1 if the site table is full
+*/
+static long find_site(void **stack, int depth) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i, n;
+    int k;
+    for(k = 0; k < depth; k++)
+        h = (h ^ (uintptr_t)stack[k]) * 1099511628211ULL;
+    h |= 1;
+    for(i = h % PROF_SITES, n = 0; n < PROF_SITES; i = (i + 1) % PROF_SITES, n++) {
+        if(!sites[i].hash) {
+            sites[i].hash = h;
+            sites[i].depth = depth;
+            memcpy(sites[i].stack, stack, depth * sizeof(void *));
+            return i;
+        }
+        if(sites[i].hash == h && sites[i].depth == (unsigned int)depth
+            && !memcmp(sites[i].stack, stack, depth * sizeof(void *)))
+            return i;
+    }
+    return -1;
+}
+
+/*
+Record a sampled allocation and draw the next sampling interval
+Called by the allocator once the countdown of the thread runs out
+@param p Pointer to the allocated block
+@param size Requested size
+@return Bytes to allocate before the next sample
+*/
+size_t prof_sample(void *p, size_t size) {
+    void *stack[PROF_DEPTH + PROF_SKIP];
+    size_t r = __atomic_load_n(&rate, __ATOMIC_RELAXED), i;
+    int depth;
+    long site;
+    if(!r)
+        return PROF_RECHECK;
+    // the first interval of a thread is drawn without sampling, and allocations made by backtrace are skipped
+    if(!prof_seed || prof_busy)
+        return next_interval(r);
+    prof_busy = 1;
+    depth = backtrace(stack, PROF_DEPTH + PROF_SKIP) - PROF_SKIP;
+    prof_busy = 0;
+    if(depth < 0)
+        depth = 0;
+    LOCK_PROF();
+    if(samples && live < PROF_SAMPLES / 2 && (site = find_site(stack + PROF_SKIP, depth)) >= 0) {
+        for(i = hash_ptr(p); samples[i].p; i = (i + 1) % PROF_SAMPLES)
+            ;
+        samples[i] = (struct prof_entry){p, size, (unsigned int)site};
+        i = hash_ptr(p);
+        if(filter[i] < UINT8_MAX)
+            __atomic_store_n(&filter[i], filter[i] + 1, __ATOMIC_RELAXED);
+        sites[site].live_count++;
+        sites[site].live_bytes += size;
+        sites[site].total_count++;
+        sites[site].total_bytes += size;
+        __atomic_store_n(&live, live + 1, __ATOMIC_RELAXED);
+    }
+    UNLOCK_PROF();
+    return next_interval(r);
+}
+
+/*
+Forget a block if it was sampled, the table is only locked when the filter says it may hold the block
+The hole left in the probe sequence is filled by moving the following entries back
+@param p Pointer to the block that is being freed
+*/
+void prof_free(void *p) {
+    size_t home, i, j, k;
+    if(!p || !__atomic_load_n(&live, __ATOMIC_RELAXED))
+        return;
+    home = hash_ptr(p);
+    if(!__atomic_load_n(&filter[home], __ATOMIC_RELAXED))
+        return;
+    LOCK_PROF();
+    for(i = home; samples[i].p && samples[i].p != p; i = (i + 1) % PROF_SAMPLES)
+        ;
+    if(samples[i].p) {
+        sites[samples[i].site].live_count--;
+        sites[samples[i].site].live_bytes -= samples[i].size;
+        // a saturated counter stays, it only costs a lookup
+        if(filter[home] < UINT8_MAX)
+            __atomic_store_n(&filter[home], filter[home] - 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&live, live - 1, __ATOMIC_RELAXED);
+        for(j = i;;) {
+            j = (j + 1) % PROF_SAMPLES;
+            if(!samples[j].p)
+                break;
+            k = hash_ptr(samples[j].p);
+            // an entry whose home lies between the hole and itself stays
+            if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            samples[i] = samples[j];
+            i = j;
+        }
+        samples[i].p = NULL;
+    }
+    UNLOCK_PROF();
+}
+
+/*
+Change the mean number of bytes between two samples, the tables are mapped the first time the profiler starts
+@param r Sampling rate in bytes, 0 stops sampling (blocks sampled before keep being tracked until freed)
+*/
+void prof_set_rate(size_t r) {
+    void *frame;
+    LOCK_PROF();
+    if(r && !samples) {
+        sites = mmap(NULL, PROF_SITES * sizeof(struct prof_site), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        samples = mmap(NULL, PROF_SAMPLES * sizeof(struct prof_entry), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(sites == MAP_FAILED || samples == MAP_FAILED) {
+            if(sites != MAP_FAILED)
+                munmap(sites, PROF_SITES * sizeof(struct prof_site));
+            if(samples != MAP_FAILED)
+                munmap(samples, PROF_SAMPLES * sizeof(struct prof_entry));
+            sites = NULL;
+            samples = NULL;
+            r = 0;
+        }
+    }
+    __atomic_store_n(&rate, r, __ATOMIC_RELAXED);
+    UNLOCK_PROF();
+    // the first backtrace loads the unwinder, which allocates, so it is done now and not while sampling
+    if(r) {
+        prof_busy = 1;
+        backtrace(&frame, 1);
+        prof_busy = 0;
+    }
+}
+
+/*
+Append formatted text to the output buffer, writing the buffer out when it fills up
+Lines longer than the line buffer are truncated
+@param out Pointer to the output
+@param format printf format
+*/
+static void prof_printf(struct prof_out *out, const char *format, ...) {
+    va_list ap;
+    char line[512];
+    int n;
+    va_start(ap, format);
+    n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if(n < 0)
+        return;
+    if((size_t)n >= sizeof(line))
+        n = sizeof(line) - 1;
+    if(out->len + n > sizeof(out->buf)) {
+        if(write(out->fd, out->buf, out->len) != (ssize_t)out->len)
+            out->error = 1;
+        out->len = 0;
+    }
+    memcpy(out->buf + out->len, line, n);
+    out->len += n;
+}
+
+/*
+Write the buffered output
+@param out Pointer to the output
+*/
+static void prof_flush(struct prof_out *out) {
+    if(out->len && write(out->fd, out->buf, out->len) != (ssize_t)out->len)
+        out->error = 1;
+    out->len = 0;
+}
+
+/*
+Estimate the bytes a site really allocated from its samples
+A block of size s is sampled with probability 1 - exp(-s / rate), the average size of the site is used
+@param bytes Sampled bytes
+@param count Number of samples
+@param r Sampling rate
+@return Estimated bytes
+*/
+static size_t unsample(size_t bytes, size_t count, size_t r) {
+    double p;
+    if(!count || !r)
+        return bytes;
+    p = 1 - prof_exp(-((double)bytes / count) / r);
+    return p > 0 ? (size_t)(bytes / p) : bytes;
+}
+
+/*
+Write the profile in the heap profile format of gperftools that pprof reads, or as collapsed stacks
+The sites are copied under the lock and formatted without it, since dladdr may wait on the dynamic loader
+@param fd File descriptor to write to
+@param format MY_PROF_PPROF, MY_PROF_COLLAPSED_LIVE or MY_PROF_COLLAPSED_TOTAL
+@return 0 on success or -1 if the format is unknown, the profiler never ran or a write failed
+*/
+int prof_dump(int fd, int format) {
+    struct prof_out out;
+    struct prof_site *copy;
+    size_t live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0, r, count, bytes, i;
+    char maps[4096];
+    ssize_t n;
+    Dl_info info;
+    int k, maps_fd;
+    if(format != MY_PROF_PPROF && format != MY_PROF_COLLAPSED_LIVE && format != MY_PROF_COLLAPSED_TOTAL)
+        return -1;
+    copy = mmap(NULL, PROF_SITES * sizeof(struct prof_site), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(copy == MAP_FAILED)
+        return -1;
+    LOCK_PROF();
+    if(!sites) {
+        UNLOCK_PROF();
+        munmap(copy, PROF_SITES * sizeof(struct prof_site));
+        return -1;
+    }
+    memcpy(copy, sites, PROF_SITES * sizeof(struct prof_site));
+    r = rate;
+    UNLOCK_PROF();
+    out.fd = fd;
+    out.len = 0;
+    out.error = 0;
+    if(format == MY_PROF_PPROF) {
+        for(i = 0; i < PROF_SITES; i++) {
+            live_count += copy[i].live_count;
+            live_bytes += copy[i].live_bytes;
+            total_count += copy[i].total_count;
+            total_bytes += copy[i].total_bytes;
+        }
+        prof_printf(&out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                    live_count, live_bytes, total_count, total_bytes, r);
+        for(i = 0; i < PROF_SITES; i++) {
+            if(!copy[i].total_count)
+                continue;
+            prof_printf(&out, "%zu: %zu [%zu: %zu] @", copy[i].live_count, copy[i].live_bytes,
+                        copy[i].total_count, copy[i].total_bytes);
+            for(k = 0; k < (int)copy[i].depth; k++)
+                prof_printf(&out, " %p", copy[i].stack[k]);
+            prof_printf(&out, "\n");
+        }
+        // pprof symbolizes the addresses with the mappings of the process
+        prof_printf(&out, "\nMAPPED_LIBRARIES:\n");
+        prof_flush(&out);
+        maps_fd = open("/proc/self/maps", O_RDONLY);
+        if(maps_fd >= 0) {
+            while((n = read(maps_fd, maps, sizeof(maps))) > 0)
+                if(write(fd, maps, n) != n)
+                    out.error = 1;
+            close(maps_fd);
+        }
+    }
+    else {
+        for(i = 0; i < PROF_SITES; i++) {
+            count = format == MY_PROF_COLLAPSED_LIVE ? copy[i].live_count : copy[i].total_count;
+            bytes = format == MY_PROF_COLLAPSED_LIVE ? copy[i].live_bytes : copy[i].total_bytes;
+            if(!count)
+                continue;
+            // outermost frame first, as flame graph tools expect
+            for(k = copy[i].depth - 1; k >= 0; k--) {
+                if(dladdr(copy[i].stack[k], &info) && info.dli_sname)
+                    prof_printf(&out, "%s%s", info.dli_sname, k ? ";" : "");
+                else
+                    prof_printf(&out, "%p%s", copy[i].stack[k], k ? ";" : "");
+            }
+            prof_printf(&out, " %zu\n", unsample(bytes, count, r));
+        }
+    }
+    prof_flush(&out);
+    munmap(copy, PROF_SITES * sizeof(struct prof_site));
+    return out.error ? -1 : 0;
+}
@@ -0,0 +1,16 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stddef.h>
+
+// Deepest call stack recorded for a sampled allocation
+#define PROF_DEPTH 32
+// Bytes allocated between two checks of the sampling rate while the profiler is off
+#define PROF_RECHECK (1024 * 1024)
+
+size_t prof_sample(void *p, size_t size);
+void   prof_free(void *p);
+void   prof_set_rate(size_t rate);
+int    prof_dump(int fd, int format);
+
+#endif
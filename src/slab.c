@@ -0,0 +1,614 @@
+#define _GNU_SOURCE
+#include "slab.h"
+#include "pagemap.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#ifdef MY_ALLOC_THREADS
+#include <pthread.h>
+#endif
+
+#define SLAB_SIZE (16 * 1024)
+#define SLAB_REGION_SIZE (1UL << 30)
+#define SLAB_MAP_WORDS (SLAB_SIZE / 16 / 64)
+#define SLAB_EMPTY_KEEP 4
+#define SLAB_OWNERS 256
+// remote list of an owner whose thread exited, the slots freed for it go back to their slab
+#define SLAB_OWNER_DEAD ((void *)1)
+#define SLAB_OF(p) ((struct slab *)((uintptr_t)(p) & ~((uintptr_t)SLAB_SIZE - 1)))
+#define FIRST_SLOT(s) ((char*)(s) + ((sizeof(struct slab) + 15) & ~(size_t)15))
+
+#ifdef MY_ALLOC_THREADS
+#define LOCK_SLAB() pthread_mutex_lock(&slab_lock)
+#define TRYLOCK_SLAB() pthread_mutex_trylock(&slab_lock)
+#define UNLOCK_SLAB() pthread_mutex_unlock(&slab_lock)
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+#define LOCK_SLAB()
+#define UNLOCK_SLAB()
+#endif
+
+#ifdef MY_ALLOC_THREADS
+#define COLLECT_REMOTE() do { \
+    if(__atomic_load_n(&remote_slabs, __ATOMIC_RELAXED)) \
+        collect_remote(); \
+} while(0)
+#else
+#define COLLECT_REMOTE()
+#endif
+
+/*
+Header at the start of every slab, the slots that follow have no metadata of their own
+@param next Pointer to the next slab of the same size class that has free slots (or the next empty slab)
+@param prev Pointer to the previous slab of the same size class that has free slots
+@param slot_size Size of every slot of the slab
+@param nslots Number of slots of the slab
+@param nfree Number of free slots of the slab
+@param hint First word of free_map that may have a free slot
+@param free_map Bitmap of the slots, 1->free | 0->claimed
+@param remote Slots freed while another thread held the slab lock, linked through their first word, still claimed
+@param remote_next Pointer to the next slab of remote_slabs
+@param owner Thread that the free slots are handed out to, NULL if any thread may take them
+*/
+struct slab {
+    struct slab *next;
+    struct slab *prev;
+    size_t slot_size;
+    unsigned int nslots;
+    unsigned int nfree;
+    unsigned int hint;
+    uint64_t free_map[SLAB_MAP_WORDS];
+#ifdef MY_ALLOC_THREADS
+    void *remote;
+    struct slab *remote_next;
+    struct slab_owner *owner;
+#endif
+};
+
+static char *region_start = NULL;
+static char *region_end = NULL;
+static char *region_next = NULL;
+static size_t slab_max = SLAB_MAX_SIZE;
+// slabs with free slots, per size class
+static struct slab *partial[SLAB_CLASSES];
+static struct slab *empty_slabs = NULL;
+static unsigned int empty_count = 0;
+#ifdef MY_ALLOC_THREADS
+// slabs with remote frees, pushed without the lock and taken whole by the next allocation
+static struct slab *remote_slabs = NULL;
+// a thread past the last owner takes its slots from the shared slabs
+static struct slab_owner owners[SLAB_OWNERS];
+
+static long slot_index(struct slab *s, void *p);
+static void free_slot(void *p);
+static void remote_free(void *p);
+static void collect_remote(void);
+static void release_owner(struct slab_owner *o);
+#endif
+
+/*
+Reserve the address range of the slabs, aligned to SLAB_SIZE
+Pages are only backed by memory once a slot on them is used
+@return 1 on success or 0 if the mapping failed
+*/
+static int init_region(void) {
+    char *start = mmap(NULL, SLAB_REGION_SIZE + SLAB_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(start == MAP_FAILED)
+        return 0;
+    start = (char*)(((uintptr_t)start + SLAB_SIZE - 1) & ~((uintptr_t)SLAB_SIZE - 1));
+    region_end = start + SLAB_REGION_SIZE;
+    region_next = start;
+    __atomic_store_n(&region_start, start, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+Take an empty slab, reusing a previously emptied one before carving the region, and format it for a size class
+@param slot_size Size of the slots
+@return Pointer to the slab or NULL if the region is exhausted
+*/
+static struct slab *new_slab(size_t slot_size) {
+    struct slab *s;
+    unsigned int i;
+    if(empty_slabs) {
+        s = empty_slabs;
+        empty_slabs = s->next;
+        empty_count--;
+    }
+    else {
+        if(!region_start && !init_region())
+            return NULL;
+        if(region_next == region_end)
+            return NULL;
+        s = (struct slab *)region_next;
+        if(pagemap_set(s, SLAB_SIZE, (uintptr_t)s | PAGEMAP_SLAB))
+            return NULL;
+        // slab_owns reads the end of the used region without the lock
+        __atomic_store_n(&region_next, region_next + SLAB_SIZE, __ATOMIC_RELEASE);
+    }
+#ifdef MY_ALLOC_THREADS
+    __atomic_store_n(&s->owner, NULL, __ATOMIC_RELAXED);
+#endif
+    s->slot_size = slot_size;
+    s->nslots = (SLAB_SIZE - (FIRST_SLOT(s) - (char*)s)) / slot_size;
+    s->nfree = s->nslots;
+    s->hint = 0;
+    for(i = 0; i < SLAB_MAP_WORDS; i++) {
+        if(i < s->nslots / 64)
+            s->free_map[i] = ~0ULL;
+        else if(i == s->nslots / 64 && s->nslots % 64)
+            s->free_map[i] = (1ULL << (s->nslots % 64)) - 1;
+        else
+            s->free_map[i] = 0;
+    }
+    return s;
+}
+
+/*
+Link a slab at the head of a list
+@param list Pointer to the head of the list
+@param s Pointer to the slab
+*/
+static void push_slab(struct slab **list, struct slab *s) {
+    s->prev = NULL;
+    s->next = *list;
+    if(*list)
+        (*list)->prev = s;
+    *list = s;
+}
+
+/*
+Unlink a slab from a list
+@param list Pointer to the head of the list
+@param s Pointer to the slab
+*/
+static void unlink_slab(struct slab **list, struct slab *s) {
+    if(s->prev)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if(s->next)
+        s->next->prev = s->prev;
+}
+
+/*
+List of the slabs with free slots that a slab goes on, the one of its owner or the shared one
+The slabs of an exited thread are shared again the first time one of their slots is freed
+@param s Pointer to the slab
+@return Pointer to the head of the list
+*/
+static struct slab **slab_list(struct slab *s) {
+    size_t cls = (s->slot_size >> 4) - 1;
+#ifdef MY_ALLOC_THREADS
+    if(s->owner && !s->owner->alive)
+        __atomic_store_n(&s->owner, NULL, __ATOMIC_RELAXED);
+    if(s->owner)
+        return &s->owner->partial[cls];
+#endif
+    return &partial[cls];
+}
+
+/*
+Take free slots of a slab, every free slot of a bitmap word is taken in one pass
+A slab that is left full leaves its list
+@param list Pointer to the head of the list of the slab
+@param s Pointer to the slab
+@param n Largest number of slots to take
+@param ptrs Set to the slots
+@return Number of slots taken
+*/
+static size_t take_slots(struct slab **list, struct slab *s, size_t n, void **ptrs) {
+    size_t count = 0;
+    unsigned int w, bit;
+    uint64_t bits;
+    for(w = s->hint; count < n && s->nfree; w++) {
+        for(bits = s->free_map[w]; bits && count < n; count++) {
+            bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            ptrs[count] = FIRST_SLOT(s) + (size_t)(w * 64 + bit) * s->slot_size;
+            s->nfree--;
+        }
+        s->free_map[w] = bits;
+        s->hint = w;
+    }
+    if(!s->nfree)
+        unlink_slab(list, s);
+    return count;
+}
+
+/*
+Allocate a slot of the smallest size class that fits
+@param size Bytes allocated by the user
+@return Pointer to the slot or NULL if the size is not served by slabs or the region is exhausted
+*/
+void *slab_malloc(size_t size) {
+    struct slab *s;
+    size_t cls;
+    unsigned int w, bit;
+    if(size == 0 || size > slab_max)
+        return NULL;
+    cls = (size - 1) >> 4;
+    LOCK_SLAB();
+    COLLECT_REMOTE();
+    s = partial[cls];
+    if(!s) {
+        s = new_slab((cls + 1) << 4);
+        if(!s) {
+            UNLOCK_SLAB();
+            return NULL;
+        }
+        push_slab(&partial[cls], s);
+    }
+    for(w = s->hint; !s->free_map[w]; w++)
+        ;
+    bit = __builtin_ctzll(s->free_map[w]);
+    s->free_map[w] &= ~(1ULL << bit);
+    s->hint = w;
+    if(--s->nfree == 0)
+        unlink_slab(&partial[cls], s);
+    UNLOCK_SLAB();
+    return FIRST_SLOT(s) + (size_t)(w * 64 + bit) * s->slot_size;
+}
+
+/*
+Allocate slots of the same size class under a single lock, every free slot of a bitmap word is taken in one pass
+@param size Bytes allocated by the user for each slot
+@param n Number of slots
+@param ptrs Set to the slots
+@return Number of slots allocated, 0 if the size is not served by slabs
+*/
+size_t slab_malloc_batch(size_t size, size_t n, void **ptrs) {
+    struct slab *s;
+    size_t cls, count = 0;
+    if(size == 0 || size > slab_max)
+        return 0;
+    cls = (size - 1) >> 4;
+    LOCK_SLAB();
+    COLLECT_REMOTE();
+    while(count < n) {
+        s = partial[cls];
+        if(!s) {
+            if(!(s = new_slab((cls + 1) << 4)))
+                break;
+            push_slab(&partial[cls], s);
+        }
+        count += take_slots(&partial[cls], s, n - count, ptrs + count);
+    }
+    UNLOCK_SLAB();
+    return count;
+}
+
+#ifdef MY_ALLOC_THREADS
+/*
+Allocate slots of the same size class for the thread cache of an owner, under a single lock
+The slots come from the slabs of the owner, then from a shared slab that it adopts, then from a new slab
+@param size Bytes allocated by the user for each slot
+@param n Number of slots
+@param ptrs Set to the slots
+@param o Pointer to the owner
+@return Number of slots allocated, 0 if the size is not served by slabs
+*/
+size_t slab_malloc_owned(size_t size, size_t n, void **ptrs, struct slab_owner *o) {
+    struct slab *s;
+    size_t cls, count = 0;
+    if(size == 0 || size > slab_max)
+        return 0;
+    cls = (size - 1) >> 4;
+    LOCK_SLAB();
+    COLLECT_REMOTE();
+    while(count < n) {
+        s = o->partial[cls];
+        if(!s) {
+            if((s = partial[cls]))
+                unlink_slab(&partial[cls], s);
+            else if(!(s = new_slab((cls + 1) << 4)))
+                break;
+            __atomic_store_n(&s->owner, o, __ATOMIC_RELAXED);
+            push_slab(&o->partial[cls], s);
+        }
+        count += take_slots(&o->partial[cls], s, n - count, ptrs + count);
+    }
+    UNLOCK_SLAB();
+    return count;
+}
+
+/*
+Take an owner for the calling thread, an owner released by an exited thread is reused
+@return Pointer to the owner or NULL if every owner is held
+*/
+struct slab_owner *slab_owner_register(void) {
+    struct slab_owner *o = NULL;
+    size_t i;
+    LOCK_SLAB();
+    for(i = 0; i < SLAB_OWNERS && !o; i++) {
+        if(owners[i].alive)
+            continue;
+        o = &owners[i];
+        o->alive = 1;
+        __atomic_store_n(&o->remote, NULL, __ATOMIC_RELAXED);
+    }
+    UNLOCK_SLAB();
+    return o;
+}
+
+/*
+Give the slots of the remote list of an owner back to their slabs and share its slabs, the caller holds the slab lock
+The list is closed, the threads that still free slots for the owner free them in their slab
+@param o Pointer to the owner
+*/
+static void release_owner(struct slab_owner *o) {
+    struct slab *s;
+    void *p, *next;
+    size_t cls;
+    for(p = __atomic_exchange_n(&o->remote, SLAB_OWNER_DEAD, __ATOMIC_ACQUIRE); p; p = next) {
+        next = *(void **)p;
+        free_slot(p);
+    }
+    for(cls = 0; cls < SLAB_CLASSES; cls++)
+        while((s = o->partial[cls])) {
+            unlink_slab(&o->partial[cls], s);
+            __atomic_store_n(&s->owner, NULL, __ATOMIC_RELAXED);
+            push_slab(&partial[cls], s);
+        }
+    // its full slabs are shared when a slot is freed
+    o->alive = 0;
+}
+
+/*
+Release the owner of an exiting thread, after its thread cache was drained
+@param o Pointer to the owner, can be NULL
+*/
+void slab_owner_release(struct slab_owner *o) {
+    if(!o)
+        return;
+    LOCK_SLAB();
+    release_owner(o);
+    UNLOCK_SLAB();
+}
+
+/*
+Release the owners of the threads that did not survive a fork, in the child
+@param keep Pointer to the owner of the thread that forked, can be NULL
+*/
+void slab_owner_fork_child(struct slab_owner *keep) {
+    size_t i;
+    LOCK_SLAB();
+    for(i = 0; i < SLAB_OWNERS; i++)
+        if(owners[i].alive && &owners[i] != keep)
+            release_owner(&owners[i]);
+    UNLOCK_SLAB();
+}
+
+/*
+Owner of the slab of a slot, read without the lock
+@param p Pointer to the slot
+@return Pointer to the owner or NULL if the slab is shared
+*/
+struct slab_owner *slab_owner_of(void *p) {
+    return __atomic_load_n(&SLAB_OF(p)->owner, __ATOMIC_RELAXED);
+}
+
+/*
+Push a slot freed by another thread on the remote list of its owner without locking
+The slot stays claimed until the owner collects it on its next allocation
+@param o Pointer to the owner
+@param p Pointer to the slot
+@return 1 if the slot was pushed or 0 if the owner exited and the slot has to be freed in its slab
+*/
+int slab_remote_push(struct slab_owner *o, void *p) {
+    void *head = __atomic_load_n(&o->remote, __ATOMIC_RELAXED);
+    do {
+        if(head == SLAB_OWNER_DEAD)
+            return 0;
+        *(void **)p = head;
+    } while(!__atomic_compare_exchange_n(&o->remote, &head, p, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+Take the whole remote list of an owner with one exchange, only called by the thread of the owner
+@param o Pointer to the owner
+@return First slot of the list, linked through their first word
+*/
+void *slab_remote_take(struct slab_owner *o) {
+    return __atomic_exchange_n(&o->remote, NULL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+/*
+Checks if a pointer lies in the slab region, without reading memory
+@param p Pointer to check
+@return 1 if the pointer belongs to the slab region or 0 otherwise
+*/
+int slab_owns(void *p) {
+    char *start = __atomic_load_n(&region_start, __ATOMIC_ACQUIRE);
+    return start && (char*)p >= start && (char*)p < __atomic_load_n(&region_next, __ATOMIC_ACQUIRE);
+}
+
+/*
+Finds the slot index of a pointer in its slab
+@param s Pointer to the slab
+@param p Pointer to check
+@return Index of the slot or -1 if p is not the start of a slot
+*/
+static long slot_index(struct slab *s, void *p) {
+    size_t offset;
+    // the header of a released empty slab reads as zeros
+    if(!s->slot_size || (char*)p < FIRST_SLOT(s))
+        return -1;
+    offset = (char*)p - FIRST_SLOT(s);
+    if(offset % s->slot_size || offset / s->slot_size >= s->nslots)
+        return -1;
+    return offset / s->slot_size;
+}
+
+/*
+Usable size of a slot, derived from its slab without locking
+The slab of a claimed slot cannot be formatted again, so its header can be read by the owner of the slot
+@param p Pointer to the slot
+@return Slot size or 0 if p is not the start of a slot
+*/
+size_t slab_slot_size(void *p) {
+    struct slab *s;
+    if(!slab_owns(p))
+        return 0;
+    s = SLAB_OF(p);
+    return slot_index(s, p) < 0 ? 0 : s->slot_size;
+}
+
+/*
+Free a slot of the slab region, the caller holds the slab lock
+An emptied slab is kept for any size class and its pages are released past SLAB_EMPTY_KEEP
+@param p Pointer to the slot
+*/
+static void free_slot(void *p) {
+    struct slab *s = SLAB_OF(p);
+    long i = slot_index(s, p);
+    struct slab **list;
+    // invalid pointers and double frees are ignored
+    if(i < 0 || (s->free_map[i >> 6] & (1ULL << (i & 63))))
+        return;
+    s->free_map[i >> 6] |= 1ULL << (i & 63);
+    if((unsigned int)(i >> 6) < s->hint)
+        s->hint = i >> 6;
+    list = slab_list(s);
+    if(s->nfree++ == 0)
+        push_slab(list, s);
+    if(s->nfree == s->nslots) {
+        unlink_slab(list, s);
+#ifdef MY_ALLOC_THREADS
+        __atomic_store_n(&s->owner, NULL, __ATOMIC_RELAXED);
+#endif
+        if(empty_count >= SLAB_EMPTY_KEEP)
+            madvise(s, SLAB_SIZE, MADV_DONTNEED);
+        s->next = empty_slabs;
+        empty_slabs = s;
+        empty_count++;
+    }
+}
+
+#ifdef MY_ALLOC_THREADS
+/*
+Free a slot without the lock, it is pushed on the remote list of its slab and stays claimed until collected
+The push that makes the list non-empty also queues the slab on remote_slabs, so a slab is queued at most once
+@param p Pointer to the slot, invalid pointers are ignored
+*/
+static void remote_free(void *p) {
+    struct slab *s = SLAB_OF(p), *queued;
+    void *head;
+    if(slot_index(s, p) < 0)
+        return;
+    head = __atomic_load_n(&s->remote, __ATOMIC_RELAXED);
+    do
+        *(void **)p = head;
+    while(!__atomic_compare_exchange_n(&s->remote, &head, p, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if(head)
+        return;
+    queued = __atomic_load_n(&remote_slabs, __ATOMIC_RELAXED);
+    do
+        s->remote_next = queued;
+    while(!__atomic_compare_exchange_n(&remote_slabs, &queued, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+Free every slot of the remote lists, the caller holds the slab lock
+Each list is taken whole with one exchange, the pushes that come after it start a new list
+*/
+static void collect_remote(void) {
+    struct slab *s, *next;
+    void *p, *p_next;
+    for(s = __atomic_exchange_n(&remote_slabs, NULL, __ATOMIC_ACQUIRE); s; s = next) {
+        // read before the list is emptied, a later push may queue the slab again
+        next = s->remote_next;
+        for(p = __atomic_exchange_n(&s->remote, NULL, __ATOMIC_ACQUIRE); p; p = p_next) {
+            p_next = *(void **)p;
+            free_slot(p);
+        }
+    }
+}
+#endif
+
+/*
+Free a slot
+@param p Pointer to the slot
+@return 1 if p belongs to the slab region or 0 otherwise
+*/
+int slab_free(void *p) {
+    if(!slab_owns(p))
+        return 0;
+#ifdef MY_ALLOC_THREADS
+    // the thread that holds the lock is not waited for, it is left the slot
+    if(TRYLOCK_SLAB()) {
+        remote_free(p);
+        return 1;
+    }
+#else
+    LOCK_SLAB();
+#endif
+    free_slot(p);
+    UNLOCK_SLAB();
+    return 1;
+}
+
+/*
+Free slots under a single lock
+@param ptrs Pointers to the slots, all of them in the slab region
+@param n Number of slots
+*/
+void slab_free_batch(void **ptrs, size_t n) {
+    size_t i;
+#ifdef MY_ALLOC_THREADS
+    if(TRYLOCK_SLAB()) {
+        for(i = 0; i < n; i++)
+            remote_free(ptrs[i]);
+        return;
+    }
+#else
+    LOCK_SLAB();
+#endif
+    for(i = 0; i < n; i++)
+        free_slot(ptrs[i]);
+    UNLOCK_SLAB();
+}
+
+/*
+Change the largest size served by slabs, 0 disables the slab tier
+@param max New largest size, clamped to SLAB_MAX_SIZE
+*/
+void slab_set_max(size_t max) {
+    slab_max = max > SLAB_MAX_SIZE ? SLAB_MAX_SIZE : max;
+}
+
+/*
+Take the slab lock before a fork so that the child does not inherit it held by another thread
+*/
+void slab_lock_all(void) {
+    LOCK_SLAB();
+}
+
+/*
+Release the slab lock after a fork, in the parent and in the child
+*/
+void slab_unlock_all(void) {
+    UNLOCK_SLAB();
+}
+
+/*
+Measure the slab region, slabs released to the system read as empty
+@param carved Set to the bytes of the slabs carved from the region
+@param used Set to the bytes of the claimed slots
+*/
+void slab_stats(size_t *carved, size_t *used) {
+    char *s;
+    *carved = *used = 0;
+    LOCK_SLAB();
+    // the slots of the remote lists of the slabs are free for the user, those of the owners are cached like
+    // the thread caches
+    COLLECT_REMOTE();
+    if(region_start) {
+        *carved = region_next - region_start;
+        for(s = region_start; s < region_next; s += SLAB_SIZE)
+            *used += (size_t)(((struct slab *)s)->nslots - ((struct slab *)s)->nfree) * ((struct slab *)s)->slot_size;
+    }
+    UNLOCK_SLAB();
+}
@@ -0,0 +1,43 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_MAX_SIZE 512
+#define SLAB_CLASSES (SLAB_MAX_SIZE / 16)
+
+#ifdef MY_ALLOC_THREADS
+/*
+Thread that owns slabs, the free slots of its slabs are only handed out to its thread cache
+@param remote Slots of its slabs freed by other threads, linked through their first word, still claimed
+@param partial Slabs of the owner that have free slots, per size class
+@param alive 1 while a thread holds the owner
+*/
+struct slab_owner {
+    void *remote;
+    struct slab *partial[SLAB_CLASSES];
+    int alive;
+} __attribute__((aligned(64)));
+#endif
+
+void  *slab_malloc(size_t size);
+int    slab_free(void *p);
+size_t slab_malloc_batch(size_t size, size_t n, void **ptrs);
+void   slab_free_batch(void **ptrs, size_t n);
+int    slab_owns(void *p);
+size_t slab_slot_size(void *p);
+void   slab_set_max(size_t max);
+void   slab_lock_all(void);
+void   slab_unlock_all(void);
+void   slab_stats(size_t *carved, size_t *used);
+#ifdef MY_ALLOC_THREADS
+struct slab_owner *slab_owner_register(void);
+void   slab_owner_release(struct slab_owner *o);
+void   slab_owner_fork_child(struct slab_owner *keep);
+size_t slab_malloc_owned(size_t size, size_t n, void **ptrs, struct slab_owner *o);
+struct slab_owner *slab_owner_of(void *p);
+int    slab_remote_push(struct slab_owner *o, void *p);
+void  *slab_remote_take(struct slab_owner *o);
+#endif
+
+#endif
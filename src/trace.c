@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef MY_ALLOC_THREADS
+#include <pthread.h>
+#endif
+
+// Allocation trace recorder: every call is appended to a buffer of the calling thread and the full
+// buffers are written to the trace file, so a call costs a clock read and a 32-byte store
+
+// records per thread buffer, 64 KiB
+#define TRACE_BUFFER 2048
+
+#ifdef MY_ALLOC_THREADS
+#define LOCK_TRACE() pthread_mutex_lock(&trace_lock)
+#define UNLOCK_TRACE() pthread_mutex_unlock(&trace_lock)
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+#define LOCK_TRACE()
+#define UNLOCK_TRACE()
+#endif
+
+/*
+Buffer of records of a thread, mapped outside of the heap so that tracing does not change what it traces
+@param next Pointer to the next buffer of the list of every buffer
+@param prev Pointer to the previous buffer of the list
+@param count Number of buffered records
+@param thread Number of the thread in the trace
+@param records Buffered records
+*/
+struct trace_buffer {
+    struct trace_buffer *next;
+    struct trace_buffer *prev;
+    unsigned int count;
+    unsigned int thread;
+    struct trace_record records[TRACE_BUFFER];
+};
+
+// read by the allocator on every call
+int trace_enabled = 0;
+static int trace_fd = -1;
+static uint64_t trace_origin;
+static unsigned int trace_threads = 0;
+// every buffer, so that trace_stop can write what the other threads buffered
+static struct trace_buffer *buffers = NULL;
+#ifdef MY_ALLOC_THREADS
+static __thread struct trace_buffer *local;
+#else
+static struct trace_buffer *local;
+#endif
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+Write the records of a buffer to the trace file and empty it, the caller holds the trace lock
+@param b Pointer to the buffer
+*/
+static void flush_buffer(struct trace_buffer *b) {
+    const char *p = (const char *)b->records;
+    size_t left = b->count * sizeof(struct trace_record);
+    ssize_t n;
+    while(trace_fd >= 0 && left) {
+        n = write(trace_fd, p, left);
+        if(n <= 0)
+            break;
+        p += n;
+        left -= n;
+    }
+    b->count = 0;
+}
+
+/*
+Map the buffer of the calling thread and link it in the list of buffers
+@return Pointer to the buffer or NULL if the mapping failed
+*/
+static struct trace_buffer *new_buffer(void) {
+    struct trace_buffer *b = mmap(NULL, sizeof(struct trace_buffer), PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(b == MAP_FAILED)
+        return NULL;
+    LOCK_TRACE();
+    b->thread = trace_threads++ & ((1U << TRACE_THREAD_BITS) - 1);
+    b->prev = NULL;
+    b->next = buffers;
+    if(buffers)
+        buffers->prev = b;
+    buffers = b;
+    UNLOCK_TRACE();
+    local = b;
+    return b;
+}
+
+/*
+Append a call to the buffer of the calling thread, a full buffer is written to the trace file
+Allocations are recorded once they returned and frees before they run, so the order of the
+timestamps respects the order in which blocks move between threads
+@param op TRACE_MALLOC, TRACE_CALLOC, TRACE_REALLOC, TRACE_FREE or TRACE_MEMALIGN
+@param ptr Pointer returned by the allocation or passed to free
+@param old Pointer passed to realloc or alignment of an aligned allocation
+@param size Requested size
+*/
+void trace_record(unsigned int op, void *ptr, void *old, size_t size) {
+    struct trace_buffer *b = local;
+    struct trace_record *r;
+    if(!b && !(b = new_buffer()))
+        return;
+    r = &b->records[b->count];
+    r->head = ((now_ns() - trace_origin) & ((1ULL << TRACE_TIME_BITS) - 1))
+        | (uint64_t)b->thread << TRACE_TIME_BITS | (uint64_t)op << (TRACE_TIME_BITS + TRACE_THREAD_BITS);
+    r->size = size;
+    r->ptr = (uintptr_t)ptr;
+    r->old = (uintptr_t)old;
+    if(++b->count == TRACE_BUFFER) {
+        LOCK_TRACE();
+        flush_buffer(b);
+        UNLOCK_TRACE();
+    }
+}
+
+/*
+Start recording every call in a new trace file
+@param path Path of the trace file, truncated if it exists
+@return 0 on success or -1 if a trace is already recorded or the file can not be written
+*/
+int trace_start(const char *path) {
+    struct trace_buffer *b;
+    int fd;
+    LOCK_TRACE();
+    if(trace_fd >= 0) {
+        UNLOCK_TRACE();
+        return -1;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0 || write(fd, TRACE_MAGIC, TRACE_MAGIC_SIZE) != TRACE_MAGIC_SIZE) {
+        if(fd >= 0)
+            close(fd);
+        UNLOCK_TRACE();
+        return -1;
+    }
+    // records left from an earlier trace are dropped
+    for(b = buffers; b; b = b->next)
+        b->count = 0;
+    trace_fd = fd;
+    trace_origin = now_ns();
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+    UNLOCK_TRACE();
+    return 0;
+}
+
+/*
+Stop recording and write every buffer to the trace file
+The other threads should not allocate meanwhile, a call they record during the stop may be lost
+*/
+void trace_stop(void) {
+    struct trace_buffer *b;
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+    LOCK_TRACE();
+    for(b = buffers; b; b = b->next)
+        flush_buffer(b);
+    if(trace_fd >= 0)
+        close(trace_fd);
+    trace_fd = -1;
+    UNLOCK_TRACE();
+}
+
+/*
+Write and unmap the buffer of a thread that exits
+*/
+void trace_thread_exit(void) {
+    struct trace_buffer *b = local;
+    if(!b)
+        return;
+    LOCK_TRACE();
+    flush_buffer(b);
+    if(b->prev)
+        b->prev->next = b->next;
+    else
+        buffers = b->next;
+    if(b->next)
+        b->next->prev = b->prev;
+    UNLOCK_TRACE();
+    local = NULL;
+    munmap(b, sizeof(struct trace_buffer));
+}
+
+/*
+A forked child does not write to the trace of its parent, its copies of the buffers are dropped
+*/
+void trace_fork_child(void) {
+    struct trace_buffer *b, *next;
+#ifdef MY_ALLOC_THREADS
+    // another thread of the parent may have held the lock during the fork
+    pthread_mutex_init(&trace_lock, NULL);
+#endif
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+    if(trace_fd >= 0)
+        close(trace_fd);
+    trace_fd = -1;
+    for(b = buffers; b; b = next) {
+        next = b->next;
+        if(b != local)
+            munmap(b, sizeof(struct trace_buffer));
+    }
+    buffers = local;
+    if(local) {
+        local->next = local->prev = NULL;
+        local->count = 0;
+    }
+}
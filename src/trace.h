@@ -0,0 +1,45 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Trace files start with this magic, followed by records in the order their buffers were written
+#define TRACE_MAGIC "MYTRACE1"
+#define TRACE_MAGIC_SIZE 8
+// Operations of a record
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_REALLOC 3
+#define TRACE_FREE 4
+#define TRACE_MEMALIGN 5
+// Layout of the head word of a record: time in ns since the start of the trace, thread number and operation
+#define TRACE_TIME_BITS 48
+#define TRACE_THREAD_BITS 12
+#define TRACE_TIME(head) ((head) & ((1ULL << TRACE_TIME_BITS) - 1))
+#define TRACE_THREAD(head) (((head) >> TRACE_TIME_BITS) & ((1ULL << TRACE_THREAD_BITS) - 1))
+#define TRACE_OP(head) ((unsigned int)((head) >> (TRACE_TIME_BITS + TRACE_THREAD_BITS)))
+
+/*
+Record of one call, 32 bytes
+@param head Time, thread and operation packed as described by TRACE_TIME_BITS and TRACE_THREAD_BITS
+@param size Requested size (num * size for calloc)
+@param ptr Pointer returned by the allocation or passed to free, it identifies the block
+@param old Pointer passed to realloc, or the alignment of an aligned allocation
+*/
+struct trace_record {
+    uint64_t head;
+    uint64_t size;
+    uint64_t ptr;
+    uint64_t old;
+};
+
+extern int trace_enabled;
+
+void trace_record(unsigned int op, void *ptr, void *old, size_t size);
+int  trace_start(const char *path);
+void trace_stop(void);
+void trace_thread_exit(void);
+void trace_fork_child(void);
+
+#endif
@@ -1,35 +1,53 @@
 #include "alloc.h"
+#include "slab.h"
+#include "memops.h"
+#include "trace.h"
+#include "pagemap.h"
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <stdint.h>
 #include <err.h>
 #include <CUnit/Basic.h>
 #include <CUnit/CUnit.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <stdint.h>
 
 // Internal declarations for White-Box testing
 struct block {
-    size_t  size;
-    struct block *next;
-    struct block *prev;
-    int free;
-    int padding;
+    size_t prev_size;
+    size_t size;
     char anchor[1];
 };
 typedef struct block *meta_block;
-extern meta_block base;
+// the first field of the default heap is its first block
+extern struct my_heap main_heap;
+#define base (*(meta_block *)&main_heap)
 size_t align_64b(ssize_t x);
-meta_block find_block(meta_block *last, size_t size);
-meta_block extend_heap(meta_block last, size_t new_size);
-void split_block(meta_block b, size_t new_size);
-meta_block fusion(meta_block block, int ok);
+size_t block_size(meta_block b);
+int block_free(meta_block b);
+meta_block next_block(struct my_heap *h, meta_block b);
+meta_block prev_block(struct my_heap *h, meta_block b);
+void mark_block(struct my_heap *h, meta_block b, int free);
+size_t get_bin_index(size_t size);
+size_t get_bin_size(size_t index);
+void insert_free_block(struct my_heap *h, meta_block b);
+meta_block find_block(struct my_heap *h, meta_block *last, size_t size);
+meta_block extend_heap(struct my_heap *h, meta_block last, size_t new_size);
+void split_block(struct my_heap *h, meta_block b, size_t new_size);
+meta_block fusion(struct my_heap *h, meta_block block, int ok);
 meta_block get_pointer_to_meta_block(void *ptr);
 int valid_addr(void *p);
+int heap_valid_addr(struct my_heap *h, void *p);
+int find_owner(void *p, meta_block *meta);
 void copy_block(meta_block original, meta_block copy);
-meta_block find_last_block(void);
+meta_block find_last_block(struct my_heap *h);
+meta_block find_large_block(void *p);
 void reset_heap();
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
 
 
 void test_align_zero(void) {
@@ -38,7 +56,7 @@ void test_align_zero(void) {
 }
 
 void test_align_prime(void) {
-    CU_ASSERT_EQUAL(align_64b(19), 24);
+    CU_ASSERT_EQUAL(align_64b(19), 32);
 }
 
 void test_align_negative(void) {
@@ -52,111 +70,180 @@ void test_align_big_range(void) {
 
 void test_find_block_base(void) {
 
-    base = extend_heap(NULL, 16);
-    base->free = 1;
+    base = extend_heap(&main_heap, NULL, 16);
+    mark_block(&main_heap, base, 1);
+    insert_free_block(&main_heap, base);
     meta_block last = NULL;
-    CU_ASSERT_EQUAL(find_block(&last, 8), base);
+    CU_ASSERT_EQUAL(find_block(&main_heap, &last, 8), base);
 }
 
 void test_find_second_block(void) {
-    base = extend_heap(NULL, 8);
-    base->free = 1;
-    meta_block second_block = extend_heap(base, 27);
-    second_block->free = 1;
+    base = extend_heap(&main_heap, NULL, 8);
+    mark_block(&main_heap, base, 1);
+    meta_block second_block = extend_heap(&main_heap, base, 32);
+    mark_block(&main_heap, second_block, 1);
+    insert_free_block(&main_heap, second_block);
     meta_block last = base;
-    CU_ASSERT_EQUAL(find_block(&last, 24), second_block);
+    CU_ASSERT_EQUAL(find_block(&main_heap, &last, 24), second_block);
     CU_ASSERT_EQUAL(last, base);
 }
 
 void test_find_block_NULL(void) {
     meta_block last;
     base = NULL;
-    CU_ASSERT_EQUAL(find_block(&last, 10), NULL);
+    CU_ASSERT_EQUAL(find_block(&main_heap, &last, 10), NULL);
+}
+
+void test_find_block_size_class(void) {
+    meta_block small, used1, medium, used2, large, used3;
+    base = extend_heap(&main_heap, NULL, 8);
+    small = extend_heap(&main_heap, base, 16);
+    used1 = extend_heap(&main_heap, small, 8);
+    medium = extend_heap(&main_heap, used1, 304);
+    used2 = extend_heap(&main_heap, medium, 8);
+    large = extend_heap(&main_heap, used2, 2000);
+    used3 = extend_heap(&main_heap, large, 8);
+    mark_block(&main_heap, small, 1);
+    mark_block(&main_heap, medium, 1);
+    mark_block(&main_heap, large, 1);
+    insert_free_block(&main_heap, small);
+    insert_free_block(&main_heap, large);
+    insert_free_block(&main_heap, medium);
+    meta_block last = NULL;
+    CU_ASSERT_EQUAL(find_block(&main_heap, &last, 16), small);
+    CU_ASSERT_EQUAL(find_block(&main_heap, &last, 256), medium);
+    CU_ASSERT_EQUAL(find_block(&main_heap, &last, 320), large);
+    CU_ASSERT_EQUAL(last, NULL);
+    CU_ASSERT_EQUAL(find_block(&main_heap, &last, 2048), NULL);
+    CU_ASSERT_EQUAL(last, used3);
+}
+
+void test_bin_index_bounds(void) {
+    int misplaced = 0;
+    for(size_t size = 8; size < (1 << 20); size += 8) {
+        size_t i = get_bin_index(size);
+        if(get_bin_size(i) > size || size >= get_bin_size(i + 1))
+            misplaced++;
+    }
+    CU_ASSERT_EQUAL(misplaced, 0);
 }
 
 void test_extend_heap_base(void) {
-    base = extend_heap(NULL, 24);
+    base = extend_heap(&main_heap, NULL, 24);
     CU_ASSERT_NOT_EQUAL(base, NULL);
-    CU_ASSERT_EQUAL(base->size, 24);
+    CU_ASSERT_EQUAL(block_size(base), 24);
 }
 
 void test_extend_heap_large_size(void) {
     meta_block b1, b2, b3, b4;
     
-    base = extend_heap(NULL, 1e10);
-    b1 = extend_heap(base, 1e10);
-    b2 = extend_heap(b1, 1e10);
-    b3 = extend_heap(b2, 1e10);
-    b4 = extend_heap(b3, 1e10);
+    base = extend_heap(&main_heap, NULL, 1e10);
+    b1 = extend_heap(&main_heap, base, 1e10);
+    b2 = extend_heap(&main_heap, b1, 1e10);
+    b3 = extend_heap(&main_heap, b2, 1e10);
+    b4 = extend_heap(&main_heap, b3, 1e10);
     CU_ASSERT_NOT_EQUAL(b4, NULL);
 }
 
+void test_extend_heap_foreign_sbrk(void) {
+    char *first = my_malloc(4000), *foreign, *p[200];
+    int failed = 0, overlap = 0;
+    memset(first, 'a', 4000);
+    // another user of the program break takes the memory right after the heap
+    foreign = sbrk(4096);
+    memset(foreign, 'f', 4096);
+    for(int i = 0; i < 200; i++) {
+        p[i] = my_malloc(4000);
+        if(!p[i])
+            failed++;
+        else if(p[i] < foreign + 4096 && p[i] + 4000 > foreign)
+            overlap++;
+        else
+            memset(p[i], 'b', 4000);
+    }
+    CU_ASSERT_EQUAL(failed, 0);
+    CU_ASSERT_EQUAL(overlap, 0);
+    // the blocks around the foreign memory are never merged across it
+    my_free(first);
+    for(int i = 0; i < 200; i++)
+        my_free(p[i]);
+    char *big = my_malloc(8000);
+    CU_ASSERT_FALSE(big < foreign + 4096 && big + 8000 > foreign);
+    CU_ASSERT_EQUAL(foreign[0], 'f');
+    CU_ASSERT_EQUAL(foreign[4095], 'f');
+}
+
 void test_split_block_size(void) {
-    base = extend_heap(NULL, 8);
-    meta_block b1 = extend_heap(base, 64);
-    split_block(b1, 16);
-    CU_ASSERT_EQUAL(base->next->size, 16);
-    CU_ASSERT_EQUAL(base->next->next->size, 16);    
+    base = extend_heap(&main_heap, NULL, 8);
+    meta_block b1 = extend_heap(&main_heap, base, 64);
+    split_block(&main_heap, b1, 16);
+    CU_ASSERT_EQUAL(block_size(next_block(&main_heap, base)), 16);
+    CU_ASSERT_EQUAL(block_size(next_block(&main_heap, next_block(&main_heap, base))), 64 - 16 - offsetof(struct block, anchor));
 }
 
 void test_split_block_pointer(void) {
-    base = extend_heap(NULL, 8);
-    meta_block b1 = extend_heap(base, 64);
-    split_block(b1, 16);
-    CU_ASSERT_PTR_NOT_NULL(base->next);
-    CU_ASSERT_PTR_NOT_NULL(base->next->next);
+    base = extend_heap(&main_heap, NULL, 8);
+    meta_block b1 = extend_heap(&main_heap, base, 64);
+    split_block(&main_heap, b1, 16);
+    CU_ASSERT_PTR_NOT_NULL(next_block(&main_heap, base));
+    CU_ASSERT_PTR_NOT_NULL(next_block(&main_heap, next_block(&main_heap, base)));
 }
 
 void test_fusion_2_blocks_fwd(void) {
     meta_block b1;
-    base = extend_heap(NULL, 16);
-    b1 = extend_heap(base, 16);
-    base->free = 1;
-    b1->free = 1;
-    CU_ASSERT_EQUAL(fusion(base, 1), base);
-    CU_ASSERT_EQUAL(base->size, 64);
+    base = extend_heap(&main_heap, NULL, 16);
+    b1 = extend_heap(&main_heap, base, 16);
+    mark_block(&main_heap, base, 1);
+    mark_block(&main_heap, b1, 1);
+    insert_free_block(&main_heap, b1);
+    CU_ASSERT_EQUAL(fusion(&main_heap, base, 1), base);
+    CU_ASSERT_EQUAL(block_size(base), 32 + offsetof(struct block, anchor));
 }
 
 void test_fusion_2_blocks_bck(void) {
     meta_block b1;
-    base = extend_heap(NULL, 16);
-    b1 = extend_heap(base, 16);
-    base->free = 1;
-    b1->free = 1;
-    CU_ASSERT_EQUAL(fusion(b1, 1), base);
-    CU_ASSERT_EQUAL(base->size, 64);
+    base = extend_heap(&main_heap, NULL, 16);
+    b1 = extend_heap(&main_heap, base, 16);
+    mark_block(&main_heap, base, 1);
+    mark_block(&main_heap, b1, 1);
+    insert_free_block(&main_heap, base);
+    CU_ASSERT_EQUAL(fusion(&main_heap, b1, 1), base);
+    CU_ASSERT_EQUAL(block_size(base), 32 + offsetof(struct block, anchor));
 }
 
 void test_fusion_4_blocks(void) {
     meta_block b1, b2, b3, b4, b5;
-    base = extend_heap(NULL, 16);
-    b1 = extend_heap(base, 16);
-    b2 = extend_heap(b1, 16);
-    b3 = extend_heap(b2, 16);
-    b4 = extend_heap(b3, 16);
-    b5 = extend_heap(b4, 16);
-    b1->free = 1;
-    b2->free = 1;
-    b3->free = 1;
-    b4->free = 1;
-    CU_ASSERT_EQUAL(fusion(b3, 1), b1);
-    CU_ASSERT_EQUAL(b1->size, 16*4 + offsetof(struct block, anchor)*3);
+    base = extend_heap(&main_heap, NULL, 16);
+    b1 = extend_heap(&main_heap, base, 16);
+    b2 = extend_heap(&main_heap, b1, 16);
+    b3 = extend_heap(&main_heap, b2, 16);
+    b4 = extend_heap(&main_heap, b3, 16);
+    b5 = extend_heap(&main_heap, b4, 16);
+    mark_block(&main_heap, b1, 1);
+    mark_block(&main_heap, b2, 1);
+    mark_block(&main_heap, b3, 1);
+    mark_block(&main_heap, b4, 1);
+    insert_free_block(&main_heap, b1);
+    insert_free_block(&main_heap, b2);
+    insert_free_block(&main_heap, b4);
+    CU_ASSERT_EQUAL(fusion(&main_heap, b3, 1), b1);
+    CU_ASSERT_EQUAL(block_size(b1), 16*4 + offsetof(struct block, anchor)*3);
 }
 
 void test_get_pointer_to_meta_block(void) {
-    base = extend_heap(NULL, 16);
+    base = extend_heap(&main_heap, NULL, 16);
     void *p = (char*)base + offsetof(struct block, anchor);
     CU_ASSERT_EQUAL(get_pointer_to_meta_block(p), base);
 }
 
 void test_valid_addr_yes(void) {
-    base = extend_heap(NULL, 16);
+    base = extend_heap(&main_heap, NULL, 16);
     void *p = (char*)base + offsetof(struct block, anchor);
     CU_ASSERT_TRUE(valid_addr(p));
 }
 
 void test_valid_addr_no(void) {
-    base = extend_heap(NULL, 16);
+    base = extend_heap(&main_heap, NULL, 16);
     void *p = (char*)base+3190;
     CU_ASSERT_FALSE(valid_addr(p));
     p = (char*)base-300;
@@ -164,7 +251,7 @@ void test_valid_addr_no(void) {
 }
 
 void test_valid_addr_misalign(void) {
-    base = extend_heap(NULL, 16);
+    base = extend_heap(&main_heap, NULL, 16);
     void *p = (char*)base + offsetof(struct block, anchor) + 1;
     CU_ASSERT_FALSE(valid_addr(p));
 }
@@ -175,14 +262,45 @@ void test_my_free_mid(void) {
     void *c = my_malloc(18);
     my_free(b);
     meta_block b1 = get_pointer_to_meta_block(b);
-    CU_ASSERT_TRUE(b1->free);
+    CU_ASSERT_TRUE(block_free(b1));
 }
 
 void test_my_free_end(void) {
-    base = extend_heap(NULL, 16);
-    meta_block b1 = extend_heap(base, 16);
+    base = extend_heap(&main_heap, NULL, 16);
+    meta_block b1 = extend_heap(&main_heap, base, 16);
     my_free((void*)b1->anchor);
-    CU_ASSERT_EQUAL((void*)b1, sbrk(0));
+    // the top chunk keeps the room of a fencepost header
+    CU_ASSERT_EQUAL((char *)b1 + 16, sbrk(0));
+}
+
+void test_my_free_top_pad(void) {
+    my_mallopt(MY_M_TOP_PAD, 64 * 1024);
+    my_mallopt(MY_M_TRIM_THRESHOLD, 128 * 1024);
+    void *first = my_malloc(100);
+    void *end = sbrk(0);
+    CU_ASSERT_EQUAL((uintptr_t)end % sysconf(_SC_PAGESIZE), 0);
+    CU_ASSERT_TRUE((char *)end - (char *)first >= 64 * 1024);
+    // a steady alloc/free loop is served from the top chunk without moving the break
+    for(int i = 0; i < 100; i++) {
+        void *p = my_malloc(1000 + i);
+        my_free(p);
+    }
+    CU_ASSERT_EQUAL(sbrk(0), end);
+    CU_ASSERT_TRUE(valid_addr(first));
+}
+
+void test_my_free_trim(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    my_mallopt(MY_M_TOP_PAD, 64 * 1024);
+    my_mallopt(MY_M_TRIM_THRESHOLD, 128 * 1024);
+    char *first = my_malloc(16);
+    char *big = my_malloc(120 * 1024);
+    char *end = sbrk(0);
+    my_free(big);
+    // the top chunk went over the threshold, only the pad is kept
+    CU_ASSERT_TRUE((char *)sbrk(0) < end);
+    CU_ASSERT_TRUE((char *)sbrk(0) <= first + 16 + 64 * 1024 + page);
+    CU_ASSERT_TRUE((char *)sbrk(0) >= first + 16 + 64 * 1024);
 }
 
 
@@ -219,8 +337,8 @@ void test_my_malloc_split(void) {
     my_free(large);  
     void *small = my_malloc(100);
     meta_block meta = get_pointer_to_meta_block(small);
-    CU_ASSERT_EQUAL(meta->size, 104);
-    CU_ASSERT_PTR_NOT_NULL(meta->next); 
+    CU_ASSERT_EQUAL(block_size(meta), 112);
+    CU_ASSERT_PTR_NOT_NULL(next_block(&main_heap, meta)); 
 }
 
 void test_my_malloc_integrity(void) {
@@ -270,8 +388,8 @@ void test_my_calloc_split(void) {
     my_free(large);  
     void *small = my_calloc(100, 2);
     meta_block meta = get_pointer_to_meta_block(small);
-    CU_ASSERT_EQUAL(meta->size, 200);
-    CU_ASSERT_PTR_NOT_NULL(meta->next); 
+    CU_ASSERT_EQUAL(block_size(meta), 208);
+    CU_ASSERT_PTR_NOT_NULL(next_block(&main_heap, meta)); 
 }
 
 void test_my_calloc_integrity(void) {
@@ -284,27 +402,58 @@ void test_my_calloc_integrity(void) {
 void test_my_calloc_boundaries(void) {
     void *p1 = my_calloc(0, 0);
     CU_ASSERT_PTR_NULL(p1); 
+    // the product wraps around, so the request cannot be served
     void *p2 = my_calloc(SIZE_MAX, SIZE_MAX); 
-    CU_ASSERT_PTR_NOT_NULL(p2);
+    CU_ASSERT_PTR_NULL(p2);
+    void *p3 = my_calloc(SIZE_MAX / 2 + 1, 2);
+    CU_ASSERT_PTR_NULL(p3);
 }
 
 void test_my_calloc_size(void) {
     void *p = my_calloc(39, 71);\
-    CU_ASSERT_EQUAL(get_pointer_to_meta_block(p)->size, 39 * 71 + 8 -((39 * 71) % 8));
+    CU_ASSERT_EQUAL(block_size(get_pointer_to_meta_block(p)), 39 * 71 + 16 -((39 * 71) % 16));
+}
+
+void test_my_calloc_after_trim(void) {
+    char *p = my_malloc(64);
+    memset(p, 'x', 64);
+    my_free(p);
+    char *q = my_calloc(8, 8);
+    int wrong = 0;
+    for(int i = 0; i < 64; i++)
+        if(q[i] != 0)
+            wrong++;
+    CU_ASSERT_EQUAL(wrong, 0);
+}
+
+void test_my_calloc_fresh_pages(void) {
+    size_t size = 16 * 1024 * 1024, page = sysconf(_SC_PAGESIZE), resident = 0;
+    unsigned char vec[size / page];
+    char *p = my_calloc(1, size);
+    CU_ASSERT_PTR_NOT_NULL(p);
+    // the payload of a new mapping is not touched, so only the page of the header is resident
+    char *start = (char *)((uintptr_t)p & ~(page - 1));
+    CU_ASSERT_EQUAL(mincore(start, size, vec), 0);
+    for(size_t i = 0; i < size / page; i++)
+        resident += vec[i] & 1;
+    CU_ASSERT_TRUE(resident <= 1);
+    CU_ASSERT_EQUAL(p[0], 0);
+    CU_ASSERT_EQUAL(p[size - 1], 0);
+    my_free(p);
 }
 
 void test_copy_block_content(void) {
     meta_block b1;
-    base = extend_heap(NULL, 8);
-    b1 = extend_heap(base, 16);
+    base = extend_heap(&main_heap, NULL, 8);
+    b1 = extend_heap(&main_heap, base, 16);
     char *base_pointer = base->anchor;
     char *b1_pointer = b1->anchor;
-    for(int i = 0; i<base->size; i++) {
+    for(int i = 0; i<block_size(base); i++) {
         *base_pointer = 'A';
         base_pointer++;
     }
     copy_block(base, b1);
-    for(int i = 0; i<base->size; i++) {
+    for(int i = 0; i<block_size(base); i++) {
         CU_ASSERT_EQUAL(*b1_pointer, 'A');
         b1_pointer++;
     }
@@ -312,16 +461,16 @@ void test_copy_block_content(void) {
 
 void test_copy_block_size_restriction(void) {
     meta_block b1;
-    base = extend_heap(NULL, 16);
-    b1 = extend_heap(base, 8);
+    base = extend_heap(&main_heap, NULL, 16);
+    b1 = extend_heap(&main_heap, base, 8);
     char *base_pointer = base->anchor;
     char *b1_pointer = b1->anchor;
-    for(int i = 0; i<base->size; i++) {
+    for(int i = 0; i<block_size(base); i++) {
         *base_pointer = 'A';
         base_pointer++;
     }
     copy_block(base, b1);
-    for(int i = 0; i<base->size; i++) {
+    for(int i = 0; i<block_size(base); i++) {
         CU_ASSERT_NOT_EQUAL(*b1_pointer, 'A');
         b1_pointer++;
     }
@@ -331,12 +480,12 @@ void test_my_realloc_null(void) {
     void *p = my_realloc(NULL, 192);
     CU_ASSERT_PTR_NOT_NULL(p);
     meta_block b = get_pointer_to_meta_block(p);
-    CU_ASSERT_EQUAL(b->size, 192);
+    CU_ASSERT_EQUAL(block_size(b), 192);
 }
 
 void test_my_realloc_invalid_address(void) {
-    base = extend_heap(NULL, 16);
-    void *p = base->anchor + base->size + 100;
+    base = extend_heap(&main_heap, NULL, 16);
+    void *p = base->anchor + block_size(base) + 100;
     void *result = my_realloc(p, 16);
     CU_ASSERT_PTR_NULL(result);
 }
@@ -347,23 +496,23 @@ void test_my_realloc_same_size(void) {
     meta_block p_block = get_pointer_to_meta_block(p);
     meta_block result_block = get_pointer_to_meta_block(result);
     CU_ASSERT_EQUAL(p, result);
-    CU_ASSERT_EQUAL(p_block->size, result_block->size);
+    CU_ASSERT_EQUAL(block_size(p_block), block_size(result_block));
 }
 
 void test_my_realloc_split(void) {
     void *p = my_malloc(64);
     void *result = my_realloc(p, 24);
     meta_block first = get_pointer_to_meta_block(result);
-    CU_ASSERT_EQUAL(first->size, 24);
+    CU_ASSERT_EQUAL(block_size(first), 32);
     CU_ASSERT_PTR_NOT_NULL(first);
-    CU_ASSERT_PTR_NOT_NULL(first->next);
-    CU_ASSERT_EQUAL(first->next->size, 8);
+    CU_ASSERT_PTR_NOT_NULL(next_block(&main_heap, first));
+    CU_ASSERT_EQUAL(block_size(next_block(&main_heap, first)), 64 - 32 - offsetof(struct block, anchor));
 }
 
 void test_my_realloc_fusion(void) {
     void *first = my_malloc(16);
     char *second = (char *) my_malloc(8);
-    void *third = my_malloc(24);
+    void *third = my_malloc(48);
     void *fourth = my_malloc(16);
     my_free(first);
     my_free(third);
@@ -373,18 +522,18 @@ void test_my_realloc_fusion(void) {
     second = (char *)my_realloc(second, 104);
     meta_block result_block = get_pointer_to_meta_block(second);
     meta_block fourth_block = get_pointer_to_meta_block(fourth);
-    CU_ASSERT_EQUAL(result_block->size, 112);
-    CU_ASSERT_EQUAL(result_block->next, fourth_block);
-    CU_ASSERT_EQUAL(result_block->prev, NULL);
+    CU_ASSERT_EQUAL(block_size(result_block), 112);
+    CU_ASSERT_EQUAL(next_block(&main_heap, result_block), fourth_block);
+    CU_ASSERT_EQUAL(prev_block(&main_heap, result_block), NULL);
     CU_ASSERT_EQUAL(second[0], 'a');
     CU_ASSERT_EQUAL(second[1], 'b');
     CU_ASSERT_EQUAL(second[2], 'c');
 }
 
 void test_my_realloc_fusion_split(void) {
-    void *first = my_malloc(16);
+    void *first = my_malloc(48);
     char *second = (char *) my_malloc(8);
-    void *third = my_malloc(24+32);
+    void *third = my_malloc(48);
     void *fourth = my_malloc(16);
     my_free(first);
     my_free(third);
@@ -393,9 +542,9 @@ void test_my_realloc_fusion_split(void) {
     second = my_realloc(second, 104);
     meta_block result_block = get_pointer_to_meta_block(second);
     meta_block fourth_block = get_pointer_to_meta_block(fourth);
-    CU_ASSERT_EQUAL(result_block->size, 104);
-    CU_ASSERT_EQUAL(result_block->next->next, fourth_block);
-    CU_ASSERT_EQUAL(result_block->prev, NULL);
+    CU_ASSERT_EQUAL(block_size(result_block), 112);
+    CU_ASSERT_EQUAL(next_block(&main_heap, next_block(&main_heap, result_block)), fourth_block);
+    CU_ASSERT_EQUAL(prev_block(&main_heap, result_block), NULL);
     CU_ASSERT_EQUAL(second[0], 'a');
     CU_ASSERT_EQUAL(second[1], 'b');
 }
@@ -410,36 +559,829 @@ void test_my_realloc_new_block(void) {
     meta_block first_block = get_pointer_to_meta_block(first);
     meta_block second_block = get_pointer_to_meta_block(second);
     meta_block new_block = get_pointer_to_meta_block(new_p);
-    CU_ASSERT_TRUE(first_block->free);
-    CU_ASSERT_EQUAL(second_block->next, new_block);
-    CU_ASSERT_EQUAL(new_block->size, 104);
+    CU_ASSERT_TRUE(block_free(first_block));
+    CU_ASSERT_EQUAL(next_block(&main_heap, second_block), new_block);
+    CU_ASSERT_EQUAL(block_size(new_block), 112);
     CU_ASSERT_EQUAL(new_p[0], 'a');
     CU_ASSERT_EQUAL(new_p[1], 'b');
     CU_ASSERT_EQUAL(new_p[2], 'c');   
 }
 
+void test_my_realloc_grow_next(void) {
+    char *first = (char *)my_malloc(64);
+    void *second = my_malloc(64);
+    void *third = my_malloc(16);
+    first[0] = 'a';
+    my_free(second);
+    char *result = (char *)my_realloc(first, 120);
+    meta_block result_block = get_pointer_to_meta_block(result);
+    CU_ASSERT_EQUAL(result, first);
+    CU_ASSERT_EQUAL(block_size(result_block), 144);
+    CU_ASSERT_EQUAL(next_block(&main_heap, result_block), get_pointer_to_meta_block(third));
+    CU_ASSERT_EQUAL(result[0], 'a');
+}
+
+void test_my_realloc_grow_tail(void) {
+    void *first = my_malloc(32);
+    char *second = (char *)my_malloc(64);
+    second[0] = 'a';
+    char *result = (char *)my_realloc(second, 4096);
+    meta_block result_block = get_pointer_to_meta_block(result);
+    CU_ASSERT_EQUAL(result, second);
+    CU_ASSERT_EQUAL(block_size(result_block), 4096);
+    CU_ASSERT_EQUAL((char *)sbrk(0), result + 4096 + 16);
+    CU_ASSERT_EQUAL(prev_block(&main_heap, result_block), get_pointer_to_meta_block(first));
+    CU_ASSERT_EQUAL(result[0], 'a');
+}
+
+void test_my_realloc_zero_slab(void) {
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    struct my_malloc_stats before = my_malloc_stats(), after;
+    char *p = my_malloc(40);
+    CU_ASSERT_TRUE(slab_owns(p));
+    // the slot is freed, not kept as it was
+    CU_ASSERT_PTR_NULL(my_realloc(p, 0));
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.live_bytes, before.live_bytes);
+    CU_ASSERT_EQUAL(after.slab_used_bytes, before.slab_used_bytes);
+}
+
+void test_my_realloc_zero_heap(void) {
+    struct my_malloc_stats before = my_malloc_stats(), after;
+    char *p = my_malloc(SLAB_MAX_SIZE + 100);
+    CU_ASSERT_TRUE(valid_addr(p));
+    // the block is freed, not shrunk to the smallest block
+    CU_ASSERT_PTR_NULL(my_realloc(p, 0));
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.live_bytes, before.live_bytes);
+    CU_ASSERT_FALSE(valid_addr(p));
+}
+
+void test_my_realloc_zero_large(void) {
+    struct my_malloc_stats before = my_malloc_stats(), after;
+    char *p = my_malloc(2 * DEFAULT_MMAP_THRESHOLD);
+    CU_ASSERT_PTR_NOT_NULL(find_large_block(p));
+    // the mapping is given back, not left in use
+    CU_ASSERT_PTR_NULL(my_realloc(p, 0));
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.live_bytes, before.live_bytes);
+    CU_ASSERT_PTR_NULL(find_large_block(p));
+}
+
 void test_find_last_block(void) {
     void *m1 = my_malloc(8);
     void *m2 = my_malloc(87);
     void *m3 = my_malloc(11);
     meta_block b3 = get_pointer_to_meta_block(m3); 
-    CU_ASSERT_EQUAL(find_last_block(), b3);
+    CU_ASSERT_EQUAL(find_last_block(&main_heap), b3);
 }
 
 void test_my_realloc_split_integrity(void) {
-    char *m1 = (char*) my_malloc(48);
+    char *m1 = (char*) my_malloc(64);
     meta_block b1 = get_pointer_to_meta_block(m1);
-    for(int i = 0; i < 48 ; i++) 
+    for(int i = 0; i < 64 ; i++) 
         m1[i] = 'A';
     m1 = my_realloc(m1, 8);
-    CU_ASSERT_PTR_NOT_NULL(b1->next);
+    CU_ASSERT_PTR_NOT_NULL(next_block(&main_heap, b1));
     for(int i = 0; i < 8; i++) 
         CU_ASSERT_EQUAL(m1[i], 'A');
-    meta_block b2 = b1->next;
-    for(int i = 0; i < b2->size; i++)
+    // the first 16 bytes of the free remainder hold its bin links
+    meta_block b2 = next_block(&main_heap, b1);
+    for(int i = 2 * sizeof(meta_block); i < block_size(b2); i++)
         CU_ASSERT_EQUAL(b2->anchor[i], 'A');  
 }
 
+void test_large_block_mmapped(void) {
+    char *p = my_malloc(DEFAULT_MMAP_THRESHOLD);
+    CU_ASSERT_PTR_NOT_NULL(p);
+    CU_ASSERT_FALSE(valid_addr(p));
+    CU_ASSERT_EQUAL(find_large_block(p), get_pointer_to_meta_block(p));
+    CU_ASSERT_TRUE(block_size(get_pointer_to_meta_block(p)) >= DEFAULT_MMAP_THRESHOLD);
+    p[0] = 'a';
+    p[DEFAULT_MMAP_THRESHOLD - 1] = 'z';
+    my_free(p);
+    CU_ASSERT_PTR_NULL(find_large_block(p));
+}
+
+void test_large_block_cache(void) {
+    void *p = my_malloc(300000);
+    my_free(p);
+    void *q = my_malloc(290000);
+    CU_ASSERT_EQUAL(p, q);
+    my_free(q);
+}
+
+void test_large_block_threshold(void) {
+    my_mallopt(MY_M_MMAP_THRESHOLD, 4096);
+    void *p = my_malloc(4096);
+    void *q = my_malloc(4088);
+    CU_ASSERT_PTR_NOT_NULL(find_large_block(p));
+    CU_ASSERT_TRUE(valid_addr(q));
+    my_free(p);
+    my_mallopt(MY_M_MMAP_THRESHOLD, DEFAULT_MMAP_THRESHOLD);
+}
+
+void test_large_block_realloc(void) {
+    char *p = my_malloc(200000);
+    for(int i = 0; i < 200000; i++)
+        p[i] = (char)i;
+    p = my_realloc(p, 5000000);
+    CU_ASSERT_PTR_NOT_NULL(find_large_block(p));
+    int wrong = 0;
+    for(int i = 0; i < 200000; i++)
+        if(p[i] != (char)i)
+            wrong++;
+    CU_ASSERT_EQUAL(wrong, 0);
+    p = my_realloc(p, 64);
+    CU_ASSERT_TRUE(valid_addr(p));
+    for(int i = 0; i < 64; i++)
+        if(p[i] != (char)i)
+            wrong++;
+    CU_ASSERT_EQUAL(wrong, 0);
+}
+
+void test_pagemap_owner(void) {
+    char stack[16];
+    meta_block meta;
+    char *h = my_malloc(100);
+    char *l = my_malloc(DEFAULT_MMAP_THRESHOLD);
+    CU_ASSERT_EQUAL(find_owner(h, &meta), PAGEMAP_HEAP);
+    CU_ASSERT_EQUAL(meta, get_pointer_to_meta_block(h));
+    CU_ASSERT_EQUAL(find_owner(l, &meta), PAGEMAP_LARGE);
+    CU_ASSERT_EQUAL(meta, get_pointer_to_meta_block(l));
+    CU_ASSERT_EQUAL(PAGEMAP_KIND(pagemap_get(l)), PAGEMAP_LARGE);
+    // pointers inside a block or outside of the allocator are not payloads
+    CU_ASSERT_EQUAL(find_owner(l + 16, &meta), 0);
+    CU_ASSERT_PTR_NULL(meta);
+    CU_ASSERT_EQUAL(find_owner(stack, &meta), 0);
+    CU_ASSERT_EQUAL(pagemap_get(stack), 0);
+    CU_ASSERT_EQUAL(my_usable_size(l + 16), 0);
+    my_free(l + 16);
+    CU_ASSERT_EQUAL(find_owner(l, &meta), PAGEMAP_LARGE);
+    my_free(l);
+    CU_ASSERT_EQUAL(pagemap_get(l), 0);
+    my_free(h);
+}
+
+void test_pagemap_many_large(void) {
+    char *p[64];
+    size_t wrong = 0;
+    int i;
+    for(i = 0; i < 64; i++) {
+        p[i] = my_malloc(DEFAULT_MMAP_THRESHOLD + i * 4096);
+        p[i][0] = (char)i;
+    }
+    for(i = 0; i < 64; i++)
+        if(find_large_block(p[i]) != get_pointer_to_meta_block(p[i]) || my_usable_size(p[i]) < DEFAULT_MMAP_THRESHOLD + i * 4096)
+            wrong++;
+    CU_ASSERT_EQUAL(wrong, 0);
+    // the blocks are freed out of order of allocation
+    for(i = 0; i < 64; i += 2)
+        my_free(p[i]);
+    for(i = 0; i < 64; i++)
+        if(i % 2 ? !find_large_block(p[i]) || p[i][0] != (char)i : find_large_block(p[i]) != NULL)
+            wrong++;
+    CU_ASSERT_EQUAL(wrong, 0);
+    for(i = 1; i < 64; i += 2)
+        my_free(p[i]);
+}
+
+void test_heap_buffer(void) {
+    static char buffer[64 * 1024];
+    struct my_heap *h = my_heap_create(buffer, sizeof(buffer));
+    char *a, *b, *c;
+    CU_ASSERT_PTR_NOT_NULL(h);
+    if(!h)
+        return;
+    CU_ASSERT_PTR_NULL(my_heap_create(buffer, 64));
+    a = my_heap_malloc(h, 100);
+    b = my_heap_malloc(h, 200);
+    c = my_heap_malloc(h, 100);
+    CU_ASSERT_TRUE(a > buffer && c < buffer + sizeof(buffer));
+    CU_ASSERT_EQUAL((uintptr_t)b % 16, 0);
+    // the blocks of the heap are not blocks of the default heap
+    CU_ASSERT_FALSE(valid_addr(b));
+    memset(b, 'x', 200);
+    b = my_heap_realloc(h, b, 300);
+    CU_ASSERT_EQUAL(b[199], 'x');
+    my_heap_free(h, a);
+    // the freed block is reused and the heap does not grow past its buffer
+    CU_ASSERT_EQUAL(my_heap_malloc(h, 100), a);
+    CU_ASSERT_PTR_NULL(my_heap_malloc(h, sizeof(buffer)));
+    my_heap_free(h, b);
+    my_heap_free(h, c);
+    my_heap_free(h, a);
+    CU_ASSERT_PTR_NOT_NULL(my_heap_malloc(h, 32 * 1024));
+    my_heap_destroy(h);
+}
+
+void test_heap_interior(void) {
+    static char buffer[8192];
+    struct my_heap *h = my_heap_create(buffer, sizeof(buffer));
+    char *p, *q;
+    CU_ASSERT_PTR_NOT_NULL(h);
+    if(!h)
+        return;
+    p = my_heap_malloc(h, 256);
+    // the payload holds what looks like the header of a claimed block 32 bytes in
+    memset(p, 0, 256);
+    ((size_t *)p)[3] = 64;
+    CU_ASSERT_FALSE(heap_valid_addr(h, p + 32));
+    my_heap_free(h, p + 32);
+    // the interior pointer was not freed, the block is not handed out again
+    q = my_heap_malloc(h, 64);
+    CU_ASSERT_TRUE(q < p || q >= p + 256);
+    CU_ASSERT_TRUE(heap_valid_addr(h, p));
+    my_heap_destroy(h);
+}
+
+void test_heap_growable(void) {
+    struct my_heap *h = my_heap_create_growable();
+    char *p[100], *first;
+    size_t wrong = 0;
+    int i;
+    CU_ASSERT_PTR_NOT_NULL(h);
+    if(!h)
+        return;
+    for(i = 0; i < 100; i++) {
+        p[i] = my_heap_malloc(h, 4096 + i);
+        memset(p[i], i, 4096 + i);
+    }
+    first = p[0];
+    // a block above the mmap threshold stays in the heap
+    p[0] = my_heap_realloc(h, p[0], 2 * DEFAULT_MMAP_THRESHOLD);
+    CU_ASSERT_PTR_NOT_NULL(p[0]);
+    CU_ASSERT_EQUAL(find_owner(p[0], &(meta_block){0}), 0);
+    for(i = 1; i < 100; i++)
+        if(p[i][4095 + i] != (char)i)
+            wrong++;
+    CU_ASSERT_EQUAL(wrong, 0);
+    // the first allocation of the default heap is not affected
+    CU_ASSERT_PTR_NULL(base);
+    for(i = 0; i < 100; i++)
+        my_heap_free(h, p[i]);
+    // an empty growable heap starts again at its first block
+    CU_ASSERT_EQUAL(my_heap_malloc(h, 16), first);
+    my_heap_destroy(h);
+}
+
+void test_arena_bump_reset(void) {
+    struct my_arena *a = my_arena_create(4096);
+    char *p, *q, *first;
+    size_t wrong = 0;
+    int i;
+    CU_ASSERT_PTR_NOT_NULL(a);
+    if(!a)
+        return;
+    first = my_arena_alloc(a, 1);
+    p = my_arena_alloc(a, 24);
+    q = my_arena_alloc(a, 8);
+    // blocks are carved one after the other on 16-byte boundaries
+    CU_ASSERT_EQUAL(p - first, 16);
+    CU_ASSERT_EQUAL(q - p, 32);
+    CU_ASSERT_PTR_NULL(my_arena_alloc(a, 0));
+    // the chunks are taken from the allocator as the arena fills up, a block larger than a chunk gets its own
+    for(i = 0; i < 1000; i++) {
+        p = my_arena_alloc(a, 100);
+        memset(p, i, 100);
+        if((uintptr_t)p % 16)
+            wrong++;
+    }
+    p = my_arena_alloc(a, 100000);
+    memset(p, 1, 100000);
+    CU_ASSERT_EQUAL(wrong, 0);
+    my_arena_reset(a);
+    // the newest chunk is kept and carved again from its start
+    CU_ASSERT_EQUAL(my_arena_alloc(a, 16), p);
+    my_arena_destroy(a);
+}
+
+void test_arena_marks(void) {
+    struct my_arena *a = my_arena_create(0);
+    struct my_arena_mark outer, inner;
+    char *p, *q;
+    int i;
+    CU_ASSERT_PTR_NOT_NULL(a);
+    if(!a)
+        return;
+    p = my_arena_alloc(a, 64);
+    strcpy(p, "kept");
+    outer = my_arena_mark(a);
+    q = my_arena_alloc(a, 64);
+    inner = my_arena_mark(a);
+    for(i = 0; i < 100; i++)
+        my_arena_alloc(a, 1000);
+    my_arena_restore(a, inner);
+    CU_ASSERT_EQUAL(my_arena_alloc(a, 64), q + 64);
+    my_arena_restore(a, outer);
+    CU_ASSERT_EQUAL(my_arena_alloc(a, 64), q);
+    CU_ASSERT_STRING_EQUAL(p, "kept");
+    my_arena_destroy(a);
+}
+
+void test_batch_heap(void) {
+    void *p[64], *q[64];
+    size_t wrong = 0;
+    int i;
+    CU_ASSERT_EQUAL(my_malloc_batch(100, 64, p), 64);
+    // the blocks are carved back to back from one extension of the heap
+    for(i = 0; i < 64; i++) {
+        if(!valid_addr(p[i]) || block_size(get_pointer_to_meta_block(p[i])) != 112 || (i && (char *)p[i] - (char *)p[i - 1] != 128))
+            wrong++;
+        memset(p[i], i, 100);
+    }
+    CU_ASSERT_EQUAL(wrong, 0);
+    CU_ASSERT_EQUAL(find_last_block(&main_heap), get_pointer_to_meta_block(p[63]));
+    // freed out of order, the neighbours are merged and the heap is empty again
+    for(i = 0; i < 64; i++)
+        q[i] = p[(i * 37) % 64];
+    my_free_batch(q, 64);
+    CU_ASSERT_PTR_NULL(base);
+    CU_ASSERT_EQUAL(my_malloc_batch(0, 4, p), 0);
+}
+
+void test_batch_mixed(void) {
+    void *p[200], *mixed[4];
+    size_t wrong = 0;
+    int i;
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    CU_ASSERT_EQUAL(my_malloc_batch(32, 200, p), 200);
+    for(i = 0; i < 200; i++)
+        if(!slab_owns(p[i]) || slab_slot_size(p[i]) != 32 || (i && p[i] == p[i - 1]))
+            wrong++;
+    CU_ASSERT_EQUAL(wrong, 0);
+    my_free_batch(p + 100, 100);
+    // the freed slots are handed out again
+    CU_ASSERT_EQUAL(my_malloc_batch(32, 100, p + 100), 100);
+    my_free_batch(p, 200);
+    // pointers of every tier can be freed together, NULL is ignored
+    mixed[0] = my_malloc(16);
+    mixed[1] = my_malloc(2000);
+    mixed[2] = my_malloc(DEFAULT_MMAP_THRESHOLD);
+    mixed[3] = NULL;
+    my_free_batch(mixed, 4);
+    CU_ASSERT_FALSE(valid_addr(mixed[1]));
+    CU_ASSERT_PTR_NULL(find_large_block(mixed[2]));
+}
+
+void test_inplace_heap(void) {
+    char *a = my_malloc(100);
+    char *b = my_malloc(100);
+    char *c = my_malloc(100);
+    CU_ASSERT_EQUAL(my_usable_size(a), 112);
+    my_free(b);
+    strcpy(a, "data");
+    // the free neighbour is absorbed, the block does not move
+    CU_ASSERT_EQUAL(my_try_expand(a, 200, 240), 240);
+    CU_ASSERT_EQUAL(my_usable_size(a), 240);
+    CU_ASSERT_PTR_EQUAL(next_block(&main_heap, get_pointer_to_meta_block(a)), get_pointer_to_meta_block(c));
+    // a claimed neighbour stops it
+    CU_ASSERT_EQUAL(my_try_expand(a, 1000, 2000), 240);
+    // the end goes back to the heap as a free block
+    CU_ASSERT_EQUAL(my_shrink_in_place(a, 50), 64);
+    CU_ASSERT_TRUE(block_free(next_block(&main_heap, get_pointer_to_meta_block(a))));
+    CU_ASSERT_STRING_EQUAL(a, "data");
+    // the last block grows with the top chunk
+    CU_ASSERT_EQUAL(my_try_expand(c, 5000, 10000), 10000);
+    CU_ASSERT_EQUAL(my_shrink_in_place(c, 0), 16);
+    CU_ASSERT_EQUAL(my_try_expand(NULL, 10, 10), 0);
+    my_free(a);
+    my_free(c);
+}
+
+void test_inplace_large_slab(void) {
+    char *l = my_malloc(DEFAULT_MMAP_THRESHOLD);
+    char *s;
+    size_t size;
+    l[0] = 'x';
+    size = my_shrink_in_place(l, 10000);
+    // the pages past the size are unmapped
+    CU_ASSERT_TRUE(size >= 10000 && size < 16384);
+    CU_ASSERT_EQUAL(my_usable_size(l), size);
+    CU_ASSERT_EQUAL(l[0], 'x');
+    // the mapping only grows if the pages after it are free, the block never moves
+    size = my_try_expand(l, DEFAULT_MMAP_THRESHOLD, DEFAULT_MMAP_THRESHOLD);
+    CU_ASSERT_TRUE(size >= DEFAULT_MMAP_THRESHOLD || size < 16384);
+    CU_ASSERT_EQUAL(my_usable_size(l), size);
+    my_free(l);
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    s = my_malloc(20);
+    CU_ASSERT_EQUAL(my_try_expand(s, 32, 64), 32);
+    CU_ASSERT_EQUAL(my_shrink_in_place(s, 1), 32);
+    my_free(s);
+}
+
+void test_free_sized_tiers(void) {
+    struct my_malloc_stats before, after;
+    void *s, *h, *l;
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    before = my_malloc_stats();
+    s = my_malloc(100);
+    h = my_malloc(1000);
+    l = my_malloc(DEFAULT_MMAP_THRESHOLD);
+    my_free_sized(s, 100);
+    my_free_sized(h, 1000);
+    my_free_sized(l, DEFAULT_MMAP_THRESHOLD);
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.frees - before.frees, 3);
+    CU_ASSERT_EQUAL(after.live_bytes, before.live_bytes);
+    // the slot went back to its size class
+    CU_ASSERT_PTR_EQUAL(my_malloc(97), s);
+    my_free_sized(s, 97);
+}
+
+void test_free_sized_slack(void) {
+    struct my_malloc_stats before = my_malloc_stats(), after;
+    char *a = my_malloc(100);
+    char *b = my_malloc(100);
+    // the size of the request is enough, the block may hold more
+    CU_ASSERT_EQUAL(my_try_expand(b, 200, 400), 400);
+    my_free_sized(b, 100);
+    my_free_sized(a, 0);
+    my_free_sized(NULL, 100);
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.live_bytes, before.live_bytes);
+    CU_ASSERT_PTR_NULL(base);
+}
+
+void test_free_sized_shrunk(void) {
+    struct my_malloc_stats before, after;
+    void *p;
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    before = my_malloc_stats();
+    p = my_malloc(500);
+    // the slot keeps its size class, the size of the realloc is still a valid size for the free
+    p = my_realloc(p, 100);
+    CU_ASSERT_EQUAL(my_usable_size(p), 512);
+    my_free_sized(p, 100);
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.live_bytes, before.live_bytes);
+}
+
+void test_fast_reuse(void) {
+    void *a, *b, *c;
+    my_mallopt(MY_M_MXFAST, 1024);
+    a = my_malloc(100);
+    b = my_malloc(100);
+    c = my_malloc(100);
+    my_free(a);
+    my_free(b);
+    // the blocks wait unmerged, still marked as claimed
+    CU_ASSERT_FALSE(block_free(get_pointer_to_meta_block(a)));
+    CU_ASSERT_FALSE(block_free(get_pointer_to_meta_block(b)));
+    CU_ASSERT_FALSE(get_pointer_to_meta_block(c)->size & 2);
+    // the same size is served back in LIFO order without a split
+    CU_ASSERT_PTR_EQUAL(my_malloc(100), b);
+    CU_ASSERT_PTR_EQUAL(my_malloc(97), a);
+    my_free(a);
+    my_free(b);
+    my_free(c);
+}
+
+void test_fast_consolidate(void) {
+    void *a, *b, *c, *d;
+    my_mallopt(MY_M_MXFAST, 1024);
+    a = my_malloc(100);
+    b = my_malloc(100);
+    c = my_malloc(100);
+    d = my_malloc(100);
+    my_free(b);
+    my_free(a);
+    my_free(c);
+    // no bin holds 300 bytes, the fast bins are merged before the heap grows
+    CU_ASSERT_PTR_EQUAL(my_malloc(300), a);
+    CU_ASSERT_EQUAL(block_size(base), 304);
+    CU_ASSERT_EQUAL(block_size(next_block(&main_heap, base)), 3 * 112 + 2 * 16 - 304 - 16);
+    my_free(a);
+    CU_ASSERT_FALSE(block_free(base));
+    // turning the fast bins off merges the blocks they hold
+    my_mallopt(MY_M_MXFAST, 0);
+    CU_ASSERT_TRUE(block_free(base));
+    CU_ASSERT_PTR_EQUAL(next_block(&main_heap, base), get_pointer_to_meta_block(d));
+    my_free(d);
+    CU_ASSERT_PTR_NULL(base);
+}
+
+void test_slab_header_free(void) {
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    char *p = my_malloc(1);
+    char *q = my_malloc(9);
+    CU_ASSERT_TRUE(slab_owns(p));
+    CU_ASSERT_FALSE(valid_addr(p));
+    CU_ASSERT_EQUAL(slab_slot_size(p), 16);
+    // slots of the same size class are contiguous
+    CU_ASSERT_EQUAL(q - p, 16);
+    my_free(p);
+    my_free(q);
+}
+
+void test_slab_reuse(void) {
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    void *p = my_malloc(200);
+    CU_ASSERT_EQUAL(slab_slot_size(p), 208);
+    my_free(p);
+    CU_ASSERT_EQUAL(my_malloc(200), p);
+    my_free(p);
+}
+
+void test_slab_invalid_free(void) {
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    char *p = my_malloc(64);
+    my_free(p + 8);
+    CU_ASSERT_EQUAL(slab_slot_size(p + 8), 0);
+    CU_ASSERT_NOT_EQUAL(my_malloc(64), p);
+    my_free(p);
+}
+
+void test_slab_realloc(void) {
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    char *p = my_malloc(20);
+    strcpy(p, "slab slot");
+    CU_ASSERT_EQUAL(my_realloc(p, 32), p);
+    char *q = my_realloc(p, SLAB_MAX_SIZE + 1);
+    CU_ASSERT_FALSE(slab_owns(q));
+    CU_ASSERT_STRING_EQUAL(q, "slab slot");
+    my_free(q);
+}
+
+void test_aligned_default(void) {
+    int misaligned = 0;
+    for(int i = 1; i < 300; i += 7)
+        if((uintptr_t)my_malloc(i) % 16)
+            misaligned++;
+    CU_ASSERT_EQUAL(misaligned, 0);
+}
+
+void test_aligned_alloc_heap(void) {
+    void *first = my_malloc(24);
+    char *p = my_aligned_alloc(4096, 100);
+    CU_ASSERT_PTR_NOT_NULL(p);
+    CU_ASSERT_EQUAL((uintptr_t)p % 4096, 0);
+    CU_ASSERT_TRUE(valid_addr(p));
+    // the leading slack is a free block that can be reused
+    meta_block slack = prev_block(&main_heap, get_pointer_to_meta_block(p));
+    CU_ASSERT_PTR_NOT_NULL(slack);
+    CU_ASSERT_TRUE(block_free(slack));
+    CU_ASSERT_EQUAL(prev_block(&main_heap, slack), get_pointer_to_meta_block(first));
+    void *small = my_malloc(64);
+    CU_ASSERT_TRUE((char *)small < p);
+    my_free(p);
+}
+
+void test_aligned_alloc_large(void) {
+    size_t alignment = 2 * 1024 * 1024;
+    char *p = my_aligned_alloc(alignment, 300000);
+    CU_ASSERT_PTR_NOT_NULL(p);
+    CU_ASSERT_EQUAL((uintptr_t)p % alignment, 0);
+    CU_ASSERT_FALSE(valid_addr(p));
+    CU_ASSERT_EQUAL(find_large_block(p), get_pointer_to_meta_block(p));
+    p[0] = 'a';
+    p[299999] = 'z';
+    p = my_realloc(p, 5000000);
+    CU_ASSERT_EQUAL(p[0], 'a');
+    CU_ASSERT_EQUAL(p[299999], 'z');
+    my_free(p);
+}
+
+void test_posix_memalign(void) {
+    void *p = NULL;
+    CU_ASSERT_EQUAL(my_posix_memalign(&p, 24, 100), EINVAL);
+    CU_ASSERT_EQUAL(my_posix_memalign(&p, 4, 100), EINVAL);
+    CU_ASSERT_PTR_NULL(p);
+    CU_ASSERT_EQUAL(my_posix_memalign(&p, 64, 100), 0);
+    CU_ASSERT_EQUAL((uintptr_t)p % 64, 0);
+    CU_ASSERT_PTR_NULL(my_memalign(48, 100));
+    CU_ASSERT_EQUAL((uintptr_t)my_memalign(256, 10) % 256, 0);
+}
+
+void test_my_usable_size(void) {
+    my_mallopt(MY_M_SLAB_MAX, SLAB_MAX_SIZE);
+    void *slot = my_malloc(20);
+    my_mallopt(MY_M_SLAB_MAX, 0);
+    void *heap = my_malloc(100);
+    void *large = my_malloc(DEFAULT_MMAP_THRESHOLD);
+    CU_ASSERT_EQUAL(my_usable_size(slot), 32);
+    CU_ASSERT_EQUAL(my_usable_size(heap), 112);
+    CU_ASSERT_TRUE(my_usable_size(large) >= DEFAULT_MMAP_THRESHOLD);
+    CU_ASSERT_EQUAL(my_usable_size(NULL), 0);
+    CU_ASSERT_EQUAL(my_usable_size((char *)heap + 16), 0);
+    my_free(slot);
+    my_free(large);
+}
+
+void test_stats_counters(void) {
+    struct my_malloc_stats before = my_malloc_stats(), after;
+    void *p = my_malloc(100);
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.mallocs - before.mallocs, 1);
+    CU_ASSERT_EQUAL(after.live_bytes - before.live_bytes, 112);
+    CU_ASSERT_EQUAL(after.extend_heap - before.extend_heap, 1);
+    CU_ASSERT_EQUAL(after.size_histogram[3] - before.size_histogram[3], 1);
+    my_free(p);
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.frees - before.frees, 1);
+    CU_ASSERT_EQUAL(after.live_bytes, before.live_bytes);
+}
+
+void test_stats_split_fusion(void) {
+    void *a = my_malloc(64), *b = my_malloc(64), *c = my_malloc(64);
+    struct my_malloc_stats before = my_malloc_stats(), after;
+    my_free(a);
+    my_free(b);
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.fusion - before.fusion, 1);
+    CU_ASSERT_EQUAL(after.heap_free_bytes - before.heap_free_bytes, 64 + 64 + 16);
+    CU_ASSERT_EQUAL(before.header_bytes - after.header_bytes, 16);
+    a = my_malloc(32);
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.split_block - before.split_block, 1);
+    CU_ASSERT_EQUAL(after.searches - before.searches, 1);
+    CU_ASSERT_EQUAL(after.search_misses, before.search_misses);
+    my_free(a);
+    my_free(c);
+}
+
+void test_stats_realloc(void) {
+    void *p = my_malloc(64);
+    struct my_malloc_stats before = my_malloc_stats(), after;
+    p = my_realloc(p, 256);
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.reallocs - before.reallocs, 1);
+    CU_ASSERT_EQUAL(after.live_bytes - before.live_bytes, 256 - 64);
+    CU_ASSERT_EQUAL(after.mallocs, before.mallocs);
+    my_free(p);
+}
+
+static struct my_heap_block walked[8];
+static size_t walked_count;
+
+static void collect_block(const struct my_heap_block *block, void *arg) {
+    (void)arg;
+    if(walked_count < 8)
+        walked[walked_count] = *block;
+    walked_count++;
+}
+
+void test_heap_walk(void) {
+    void *a = my_malloc(64), *b = my_malloc(32), *c = my_malloc(128), *d = my_malloc(16);
+    struct my_heap_summary sum;
+    my_free(a);
+    my_free(c);
+    walked_count = 0;
+    sum = my_heap_walk(collect_block, NULL);
+    CU_ASSERT_EQUAL(walked_count, 4);
+    CU_ASSERT_PTR_EQUAL(walked[1].address, b);
+    CU_ASSERT_TRUE(walked[0].free && !walked[1].free && walked[2].free && !walked[3].free);
+    CU_ASSERT_EQUAL(walked[2].size, 128);
+    CU_ASSERT_EQUAL(walked[2].gap, 16);
+    CU_ASSERT_EQUAL(sum.free_bytes, 64 + 128);
+    CU_ASSERT_EQUAL(sum.used_bytes, 32 + 16);
+    CU_ASSERT_EQUAL(sum.largest_free, 128);
+    CU_ASSERT_EQUAL(sum.trapped_bytes, 64 + 128);
+    CU_ASSERT_DOUBLE_EQUAL(sum.fragmentation, 1.0 - 128.0 / 192.0, 1e-9);
+    my_free(b);
+    my_free(d);
+}
+
+void test_heap_walk_fast(void) {
+    struct my_malloc_stats before, after;
+    struct my_heap_summary sum;
+    void *a, *b, *c;
+    my_mallopt(MY_M_MXFAST, 1024);
+    a = my_malloc(100);
+    b = my_malloc(100);
+    c = my_malloc(100);
+    before = my_malloc_stats();
+    // the block waits in its fast bin, still marked as claimed
+    my_free(a);
+    after = my_malloc_stats();
+    CU_ASSERT_EQUAL(after.heap_free_bytes - before.heap_free_bytes, 112);
+    walked_count = 0;
+    sum = my_heap_walk(collect_block, NULL);
+    CU_ASSERT_EQUAL(walked_count, 3);
+    CU_ASSERT_TRUE(walked[0].free);
+    CU_ASSERT_EQUAL(sum.free_bytes, 112);
+    CU_ASSERT_EQUAL(sum.used_bytes, 2 * 112);
+    my_mallopt(MY_M_MXFAST, 0);
+    my_free(b);
+    my_free(c);
+}
+
+void test_heap_dump(void) {
+    char out[1024];
+    ssize_t n;
+    int fds[2];
+    void *a = my_malloc(64), *b = my_malloc(64);
+    my_free(a);
+    CU_ASSERT_EQUAL(pipe(fds), 0);
+    CU_ASSERT_EQUAL(my_heap_dump(fds[1], MY_HEAP_DUMP_CSV), 0);
+    n = read(fds[0], out, sizeof(out) - 1);
+    out[n > 0 ? n : 0] = 0;
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, "address,size,free,gap\n"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, ",64,1,16\n"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, "trapped_bytes=64"));
+    CU_ASSERT_EQUAL(my_heap_dump(fds[1], MY_HEAP_DUMP_JSON), 0);
+    n = read(fds[0], out, sizeof(out) - 1);
+    out[n > 0 ? n : 0] = 0;
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, "\"size\": 64, \"free\": true"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, "\"largest_free\": 64"));
+    CU_ASSERT_EQUAL(my_heap_dump(fds[1], 7), -1);
+    close(fds[0]);
+    close(fds[1]);
+    my_free(b);
+}
+
+static size_t read_profile(int format, char *out, size_t len) {
+    FILE *f = tmpfile();
+    size_t n = 0;
+    if(f && my_heap_profile(fileno(f), format) == 0) {
+        rewind(f);
+        n = fread(out, 1, len - 1, f);
+    }
+    out[n] = 0;
+    if(f)
+        fclose(f);
+    return n;
+}
+
+void test_prof_collapsed(void) {
+    static char out[8192];
+    void *blocks[10], *warm;
+    my_mallopt(MY_M_PROF_SAMPLE, 1);
+    warm = my_malloc(1000);
+    for(int i = 0; i < 10; i++)
+        blocks[i] = my_malloc(1000);
+    read_profile(MY_PROF_COLLAPSED_LIVE, out, sizeof(out));
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, " 10000\n"));
+    for(int i = 0; i < 10; i++)
+        my_free(blocks[i]);
+    my_free(warm);
+    CU_ASSERT_EQUAL(read_profile(MY_PROF_COLLAPSED_LIVE, out, sizeof(out)), 0);
+    read_profile(MY_PROF_COLLAPSED_TOTAL, out, sizeof(out));
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, " 10000\n"));
+    my_mallopt(MY_M_PROF_SAMPLE, 0);
+}
+
+void test_prof_pprof(void) {
+    static char out[8192];
+    void *p;
+    my_mallopt(MY_M_PROF_SAMPLE, 1);
+    my_free(my_malloc(100));
+    p = my_malloc(100);
+    read_profile(MY_PROF_PPROF, out, sizeof(out));
+    CU_ASSERT_EQUAL(strncmp(out, "heap profile: ", 14), 0);
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, "@ heap_v2/1\n"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, "1: 100 ["));
+    CU_ASSERT_PTR_NOT_NULL(strstr(out, "MAPPED_LIBRARIES:\n"));
+    CU_ASSERT_EQUAL(my_heap_profile(1, 9), -1);
+    my_free(p);
+    my_mallopt(MY_M_PROF_SAMPLE, 0);
+}
+
+void test_memops_copy(void) {
+    void (*kernels[])(void *, const void *, size_t) = {mem_copy, copy_sse2, copy_avx2};
+    static char src[MEMOPS_NT_THRESHOLD + 100], dst[MEMOPS_NT_THRESHOLD + 100];
+    size_t sizes[] = {0, 1, 31, 32, 63, 64, 1000, MEMOPS_NT_THRESHOLD + 33};
+    int wrong = 0;
+    for(size_t i = 0; i < sizeof(src); i++)
+        src[i] = (char)(i * 7 + 3);
+    for(size_t k = 0; k < 3; k++) {
+        if(kernels[k] == copy_avx2 && !memops_has_avx2())
+            continue;
+        for(size_t s = 0; s < 8; s++)
+            for(size_t offset = 0; offset < 3; offset++) {
+                memset(dst, 0, sizeof(dst));
+                kernels[k](dst + offset, src + 5, sizes[s]);
+                if(memcmp(dst + offset, src + 5, sizes[s]) || dst[offset + sizes[s]] != 0)
+                    wrong++;
+            }
+    }
+    CU_ASSERT_EQUAL(wrong, 0);
+}
+
+void test_memops_zero(void) {
+    void (*kernels[])(void *, size_t) = {mem_zero, zero_sse2, zero_avx2};
+    static char buf[MEMOPS_NT_THRESHOLD + 100];
+    size_t sizes[] = {1, 31, 32, 64, 1000, MEMOPS_NT_THRESHOLD + 33};
+    int wrong = 0;
+    for(size_t k = 0; k < 3; k++) {
+        if(kernels[k] == zero_avx2 && !memops_has_avx2())
+            continue;
+        for(size_t s = 0; s < 6; s++) {
+            memset(buf, 'x', sizeof(buf));
+            kernels[k](buf + 3, sizes[s]);
+            for(size_t i = 0; i < sizes[s]; i++)
+                if(buf[3 + i] != 0) {
+                    wrong++;
+                    break;
+                }
+            if(buf[2] != 'x' || buf[3 + sizes[s]] != 'x')
+                wrong++;
+        }
+    }
+    CU_ASSERT_EQUAL(wrong, 0);
+}
+
 /*
 Helper method to create a suite
 @param name Pointer to the name of the suite
@@ -457,16 +1399,83 @@ static CU_pSuite create_suite(const char* name) {
 Tear down method to reset the heap after every test
 */
 void reset_heap() {
+    // the white-box tests expect a freed block to be merged right away
+    my_mallopt(MY_M_MXFAST, 0);
     if (base != NULL) {
         brk(base); 
         base = NULL;
     }
+    // the white-box tests inspect heap blocks, so small sizes must not go to the slabs
+    my_mallopt(MY_M_SLAB_MAX, 0);
+    // and they expect the heap to grow and shrink by exactly the size of a block
+    my_mallopt(MY_M_TOP_PAD, 0);
+    my_mallopt(MY_M_TRIM_THRESHOLD, 0);
+}
+
+static size_t read_trace(const char *path, struct trace_record *records, size_t max) {
+    FILE *f = fopen(path, "rb");
+    char magic[TRACE_MAGIC_SIZE];
+    size_t n = 0;
+    if(f && fread(magic, 1, TRACE_MAGIC_SIZE, f) == TRACE_MAGIC_SIZE && !memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE))
+        n = fread(records, sizeof(struct trace_record), max, f);
+    if(f)
+        fclose(f);
+    return n;
+}
+
+void test_trace_calls(void) {
+    char path[] = "/tmp/test_traceXXXXXX";
+    struct trace_record r[8];
+    void *p, *q, *c;
+    int fd = mkstemp(path);
+    close(fd);
+    CU_ASSERT_EQUAL(my_trace_start(path), 0);
+    p = my_malloc(40);
+    q = my_realloc(p, 100);
+    c = my_calloc(2, 8);
+    my_free(q);
+    my_free(c);
+    my_trace_stop();
+    CU_ASSERT_EQUAL(read_trace(path, r, 8), 5);
+    CU_ASSERT_EQUAL(TRACE_OP(r[0].head), TRACE_MALLOC);
+    CU_ASSERT_EQUAL(r[0].size, 40);
+    CU_ASSERT_EQUAL(r[0].ptr, (uintptr_t)p);
+    CU_ASSERT_EQUAL(TRACE_OP(r[1].head), TRACE_REALLOC);
+    CU_ASSERT_EQUAL(r[1].ptr, (uintptr_t)q);
+    CU_ASSERT_EQUAL(r[1].old, (uintptr_t)p);
+    CU_ASSERT_EQUAL(TRACE_OP(r[2].head), TRACE_CALLOC);
+    CU_ASSERT_EQUAL(r[2].size, 16);
+    CU_ASSERT_EQUAL(TRACE_OP(r[3].head), TRACE_FREE);
+    CU_ASSERT_EQUAL(r[3].ptr, (uintptr_t)q);
+    CU_ASSERT(TRACE_TIME(r[3].head) >= TRACE_TIME(r[0].head));
+    unlink(path);
+}
+
+void test_trace_start_stop(void) {
+    char path[] = "/tmp/test_traceXXXXXX";
+    struct trace_record r[4];
+    void *p;
+    int fd = mkstemp(path);
+    close(fd);
+    CU_ASSERT_EQUAL(my_trace_start("/nonexistent/trace"), -1);
+    CU_ASSERT_EQUAL(my_trace_start(path), 0);
+    // a single trace is recorded at a time
+    CU_ASSERT_EQUAL(my_trace_start(path), -1);
+    p = my_aligned_alloc(256, 64);
+    my_trace_stop();
+    // calls after the stop are not recorded
+    my_free(p);
+    CU_ASSERT_EQUAL(read_trace(path, r, 4), 1);
+    CU_ASSERT_EQUAL(TRACE_OP(r[0].head), TRACE_MEMALIGN);
+    CU_ASSERT_EQUAL(r[0].old, 256);
+    unlink(path);
 }
 
 int main(void) {
     // initialize registry
     if (CU_initialize_registry() != CUE_SUCCESS)
         errx(EXIT_FAILURE, "can't initialize test registry");
+    reset_heap();
 
     // initialize test suites
 
@@ -484,12 +1493,15 @@ int main(void) {
     CU_add_test(find_block_suite, "find_block_base", test_find_block_base);
     CU_add_test(find_block_suite, "find_second_block", test_find_second_block);
     CU_add_test(find_block_suite, "find_block_NULL", test_find_block_NULL);
+    CU_add_test(find_block_suite, "find_block_size_class", test_find_block_size_class);
+    CU_add_test(find_block_suite, "bin_index_bounds", test_bin_index_bounds);
 
     // extend_heap suite
     CU_pSuite extend_heap_suite = create_suite("extend_heap_suite");
 
     CU_add_test(extend_heap_suite, "extend_heap_base", test_extend_heap_base);
     CU_add_test(extend_heap_suite, "extend_heap_large_size", test_extend_heap_large_size);
+    CU_add_test(extend_heap_suite, "extend_heap_foreign_sbrk", test_extend_heap_foreign_sbrk);
 
     // split_block suite
     CU_pSuite split_block_suite = create_suite("split_block_suite");
@@ -521,6 +1533,8 @@ int main(void) {
 
     CU_add_test(my_free_suite, "my_free_mid", test_my_free_mid);
     CU_add_test(my_free_suite, "my_free_end", test_my_free_end);
+    CU_add_test(my_free_suite, "my_free_top_pad", test_my_free_top_pad);
+    CU_add_test(my_free_suite, "my_free_trim", test_my_free_trim);
 
     // my_malloc suite
     CU_pSuite my_malloc_suite = create_suite("my_malloc suite");
@@ -531,6 +1545,7 @@ int main(void) {
     CU_add_test(my_malloc_suite, "my_malloc_split", test_my_malloc_split);
     CU_add_test(my_malloc_suite, "my_malloc_integrity", test_my_malloc_integrity);
     CU_add_test(my_malloc_suite, "my_malloc_boundaries", test_my_malloc_boundaries);
+    CU_add_test(my_malloc_suite, "my_usable_size", test_my_usable_size);
 
     // my_calloc suite
     CU_pSuite my_calloc_suite = create_suite("my_calloc suite");
@@ -542,6 +1557,8 @@ int main(void) {
     CU_add_test(my_calloc_suite, "my_calloc_integrity", test_my_calloc_integrity);
     CU_add_test(my_calloc_suite, "my_calloc_boundaries", test_my_calloc_boundaries);
     CU_add_test(my_calloc_suite, "my_calloc_size", test_my_calloc_size);
+    CU_add_test(my_calloc_suite, "my_calloc_after_trim", test_my_calloc_after_trim);
+    CU_add_test(my_calloc_suite, "my_calloc_fresh_pages", test_my_calloc_fresh_pages);
 
     // copy_block suite
     CU_pSuite copy_block_suite = create_suite("copy_block suite");
@@ -560,12 +1577,117 @@ int main(void) {
     CU_add_test(my_realloc_suite, "my_realloc_fusion_split", test_my_realloc_fusion_split);
     CU_add_test(my_realloc_suite, "my_realloc_new_block", test_my_realloc_new_block);
     CU_add_test(my_realloc_suite, "my_realloc_split_integrity", test_my_realloc_split_integrity);
+    CU_add_test(my_realloc_suite, "my_realloc_grow_next", test_my_realloc_grow_next);
+    CU_add_test(my_realloc_suite, "my_realloc_grow_tail", test_my_realloc_grow_tail);
+    CU_add_test(my_realloc_suite, "my_realloc_zero_slab", test_my_realloc_zero_slab);
+    CU_add_test(my_realloc_suite, "my_realloc_zero_heap", test_my_realloc_zero_heap);
+    CU_add_test(my_realloc_suite, "my_realloc_zero_large", test_my_realloc_zero_large);
 
     // find_last_block suite
     CU_pSuite find_last_block_suite = create_suite("find_last_block suite"); 
     
     CU_add_test(find_last_block_suite, "find_last_block", test_find_last_block);
 
+    // large_block suite
+    CU_pSuite large_block_suite = create_suite("large_block suite");
+
+    CU_add_test(large_block_suite, "large_block_mmapped", test_large_block_mmapped);
+    CU_add_test(large_block_suite, "large_block_cache", test_large_block_cache);
+    CU_add_test(large_block_suite, "large_block_threshold", test_large_block_threshold);
+    CU_add_test(large_block_suite, "large_block_realloc", test_large_block_realloc);
+
+    // pagemap suite
+    CU_pSuite pagemap_suite = create_suite("pagemap suite");
+
+    CU_add_test(pagemap_suite, "pagemap_owner", test_pagemap_owner);
+    CU_add_test(pagemap_suite, "pagemap_many_large", test_pagemap_many_large);
+
+    // heap suite
+    CU_pSuite heap_suite = create_suite("heap suite");
+
+    CU_add_test(heap_suite, "heap_buffer", test_heap_buffer);
+    CU_add_test(heap_suite, "heap_interior", test_heap_interior);
+    CU_add_test(heap_suite, "heap_growable", test_heap_growable);
+
+    // arena suite
+    CU_pSuite arena_suite = create_suite("arena suite");
+
+    CU_add_test(arena_suite, "arena_bump_reset", test_arena_bump_reset);
+    CU_add_test(arena_suite, "arena_marks", test_arena_marks);
+
+    // batch suite
+    CU_pSuite batch_suite = create_suite("batch suite");
+
+    CU_add_test(batch_suite, "batch_heap", test_batch_heap);
+    CU_add_test(batch_suite, "batch_mixed", test_batch_mixed);
+
+    // inplace suite
+    CU_pSuite inplace_suite = create_suite("inplace suite");
+
+    CU_add_test(inplace_suite, "inplace_heap", test_inplace_heap);
+    CU_add_test(inplace_suite, "inplace_large_slab", test_inplace_large_slab);
+
+    // free_sized suite
+    CU_pSuite free_sized_suite = create_suite("free_sized suite");
+
+    CU_add_test(free_sized_suite, "free_sized_tiers", test_free_sized_tiers);
+    CU_add_test(free_sized_suite, "free_sized_slack", test_free_sized_slack);
+    CU_add_test(free_sized_suite, "free_sized_shrunk", test_free_sized_shrunk);
+
+    // fastbin suite
+    CU_pSuite fastbin_suite = create_suite("fastbin suite");
+
+    CU_add_test(fastbin_suite, "fast_reuse", test_fast_reuse);
+    CU_add_test(fastbin_suite, "fast_consolidate", test_fast_consolidate);
+
+    // slab suite
+    CU_pSuite slab_suite = create_suite("slab suite");
+
+    CU_add_test(slab_suite, "slab_header_free", test_slab_header_free);
+    CU_add_test(slab_suite, "slab_reuse", test_slab_reuse);
+    CU_add_test(slab_suite, "slab_invalid_free", test_slab_invalid_free);
+    CU_add_test(slab_suite, "slab_realloc", test_slab_realloc);
+
+    // aligned suite
+    CU_pSuite aligned_suite = create_suite("aligned suite");
+
+    CU_add_test(aligned_suite, "aligned_default", test_aligned_default);
+    CU_add_test(aligned_suite, "aligned_alloc_heap", test_aligned_alloc_heap);
+    CU_add_test(aligned_suite, "aligned_alloc_large", test_aligned_alloc_large);
+    CU_add_test(aligned_suite, "posix_memalign", test_posix_memalign);
+
+    // memops suite
+    CU_pSuite memops_suite = create_suite("memops suite");
+
+    CU_add_test(memops_suite, "memops_copy", test_memops_copy);
+    CU_add_test(memops_suite, "memops_zero", test_memops_zero);
+
+    // stats suite
+    CU_pSuite stats_suite = create_suite("stats suite");
+
+    CU_add_test(stats_suite, "stats_counters", test_stats_counters);
+    CU_add_test(stats_suite, "stats_split_fusion", test_stats_split_fusion);
+    CU_add_test(stats_suite, "stats_realloc", test_stats_realloc);
+
+    // heap_walk suite
+    CU_pSuite heap_walk_suite = create_suite("heap_walk suite");
+
+    CU_add_test(heap_walk_suite, "heap_walk", test_heap_walk);
+    CU_add_test(heap_walk_suite, "heap_walk_fast", test_heap_walk_fast);
+    CU_add_test(heap_walk_suite, "heap_dump", test_heap_dump);
+
+    // prof suite
+    CU_pSuite prof_suite = create_suite("prof suite");
+
+    CU_add_test(prof_suite, "prof_collapsed", test_prof_collapsed);
+    CU_add_test(prof_suite, "prof_pprof", test_prof_pprof);
+
+    // trace suite
+    CU_pSuite trace_suite = create_suite("trace suite");
+
+    CU_add_test(trace_suite, "trace_calls", test_trace_calls);
+    CU_add_test(trace_suite, "trace_start_stop", test_trace_start_stop);
+
     // run the tests
     CU_basic_run_tests();
 
@@ -0,0 +1,484 @@
+#define _GNU_SOURCE
+#include "alloc.h"
+#include "slab.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <CUnit/Basic.h>
+#include <CUnit/CUnit.h>
+
+// Tests for the thread-safe build, compiled with -DMY_ALLOC_THREADS -pthread
+
+#define NUM_THREADS 8
+#define ITERATIONS 20000
+#define LIVE_BLOCKS 64
+#define TRANSFER_BLOCKS 4096
+#define RING_PAIRS 4
+#define RING_SIZE 256
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+// more than the address space reserved for a per-CPU heap
+#define PAST_CPU_HEAP ((1UL << 30) + (1UL << 20))
+// more threads alive at once than there are slab owners
+#define OWNER_THREADS 300
+
+/*
+Worker that keeps a window of live blocks filled with its own pattern and checks it before freeing
+@param arg Pointer to the thread number
+@return Number of corrupted blocks found as a pointer-sized integer
+*/
+static void *integrity_worker(void *arg) {
+    unsigned char *live[LIVE_BLOCKS] = {0};
+    size_t sizes[LIVE_BLOCKS] = {0};
+    unsigned char pattern = (unsigned char)(uintptr_t)arg;
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    uintptr_t corrupted = 0;
+    for(int i = 0; i < ITERATIONS; i++) {
+        int slot = rand_r(&seed) % LIVE_BLOCKS;
+        if(live[slot]) {
+            for(size_t j = 0; j < sizes[slot]; j++)
+                if(live[slot][j] != pattern) {
+                    corrupted++;
+                    break;
+                }
+            my_free(live[slot]);
+        }
+        sizes[slot] = 1 + rand_r(&seed) % 2048;
+        live[slot] = my_malloc(sizes[slot]);
+        for(size_t j = 0; j < sizes[slot]; j++)
+            live[slot][j] = pattern;
+    }
+    for(int i = 0; i < LIVE_BLOCKS; i++)
+        my_free(live[i]);
+    return (void *)corrupted;
+}
+
+static void *producer(void *arg) {
+    void **blocks = arg;
+    for(int i = 0; i < TRANSFER_BLOCKS; i++) {
+        blocks[i] = my_malloc(16 + i % 256);
+        *(int *)blocks[i] = i;
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    void **blocks = arg;
+    uintptr_t wrong = 0;
+    for(int i = 0; i < TRANSFER_BLOCKS; i++) {
+        if(*(int *)blocks[i] != i)
+            wrong++;
+        my_free(blocks[i]);
+    }
+    return (void *)wrong;
+}
+
+static void *cache_and_exit(void *arg) {
+    void **blocks = arg;
+    for(int i = 0; i < 8; i++)
+        blocks[i] = my_malloc(64);
+    for(int i = 0; i < 8; i++)
+        my_free(blocks[i]);
+    return NULL;
+}
+
+/*
+Ring of blocks passed from a producer to a consumer while both run
+@param slots Blocks in flight
+@param head Next slot written by the producer
+@param tail Next slot read by the consumer
+@param wrong Blocks whose pattern the consumer found changed
+*/
+struct ring {
+    unsigned char *slots[RING_SIZE];
+    size_t head;
+    size_t tail;
+    uintptr_t wrong;
+};
+
+static void *ring_producer(void *arg) {
+    struct ring *q = arg;
+    unsigned int seed = 1;
+    unsigned char *p;
+    size_t size;
+    for(int i = 0; i < ITERATIONS; i++) {
+        // slots and heap blocks, in and above the sizes of the thread cache
+        size = 1 + rand_r(&seed) % 2048;
+        p = my_malloc(size);
+        p[0] = p[size - 1] = (unsigned char)i;
+        while(__atomic_load_n(&q->head, __ATOMIC_RELAXED) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+            sched_yield();
+        q->slots[q->head % RING_SIZE] = p;
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *ring_consumer(void *arg) {
+    struct ring *q = arg;
+    unsigned int seed = 1;
+    unsigned char *p;
+    size_t size;
+    for(int i = 0; i < ITERATIONS; i++) {
+        size = 1 + rand_r(&seed) % 2048;
+        while(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail)
+            sched_yield();
+        p = q->slots[q->tail % RING_SIZE];
+        __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+        if(p[0] != (unsigned char)i || p[size - 1] != (unsigned char)i)
+            q->wrong++;
+        my_free(p);
+    }
+    return NULL;
+}
+
+/*
+State of the per-CPU reuse test
+@param cpu CPU both threads are pinned to
+@param block Block freed by the first thread
+@param reused Block allocated by the second thread
+@param freed Barrier passed once the block is freed
+@param done Barrier passed once the test no longer needs the first thread
+*/
+struct percpu_share {
+    cpu_set_t cpu;
+    void *block;
+    void *reused;
+    pthread_barrier_t freed;
+    pthread_barrier_t done;
+};
+
+static void *free_block(void *arg) {
+    my_free(arg);
+    return NULL;
+}
+
+/*
+Consumer that frees a block of another thread then allocates a block of the same size
+@param arg Pointer to the block, set to the block it allocated
+*/
+static void *free_and_malloc(void *arg) {
+    void **block = arg;
+    my_free(*block);
+    *block = my_malloc(48);
+    return NULL;
+}
+
+/*
+Walker that frees a block from another thread while the walk holds the heap lock
+The free must not wait for the lock, the walk would never end
+*/
+static void free_during_walk(const struct my_heap_block *block, void *arg) {
+    void **victim = arg;
+    pthread_t t;
+    (void)block;
+    if(!*victim)
+        return;
+    pthread_create(&t, NULL, free_block, *victim);
+    pthread_join(t, NULL);
+    *victim = NULL;
+}
+
+/*
+Thread pinned to a CPU that frees a block and stays alive until the test is done with its CPU
+@param arg Pointer to the shared state of the test
+*/
+static void *free_and_wait(void *arg) {
+    struct percpu_share *share = arg;
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &share->cpu);
+    share->block = my_malloc(100);
+    my_free(share->block);
+    pthread_barrier_wait(&share->freed);
+    pthread_barrier_wait(&share->done);
+    return NULL;
+}
+
+static void *malloc_block(void *arg) {
+    (void)arg;
+    return my_malloc(100);
+}
+
+/*
+Thread that allocates and frees a block and stays alive until the test is done
+@param arg Pointer to the barrier of the test
+*/
+static void *malloc_and_wait(void *arg) {
+    pthread_barrier_t *barrier = arg;
+    my_free(my_malloc(100));
+    pthread_barrier_wait(barrier);
+    pthread_barrier_wait(barrier);
+    return NULL;
+}
+
+static void *malloc_on_cpu(void *arg) {
+    struct percpu_share *share = arg;
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &share->cpu);
+    share->reused = my_malloc(100);
+    return NULL;
+}
+
+void test_threads_integrity(void) {
+    pthread_t threads[NUM_THREADS];
+    void *corrupted;
+    uintptr_t total = 0;
+    for(uintptr_t i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, integrity_worker, (void *)(i + 1));
+    for(int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], &corrupted);
+        total += (uintptr_t)corrupted;
+    }
+    CU_ASSERT_EQUAL(total, 0);
+}
+
+void test_threads_cross_free(void) {
+    static void *blocks[TRANSFER_BLOCKS];
+    pthread_t t;
+    void *wrong;
+    pthread_create(&t, NULL, producer, blocks);
+    pthread_join(t, NULL);
+    pthread_create(&t, NULL, consumer, blocks);
+    pthread_join(t, &wrong);
+    CU_ASSERT_EQUAL((uintptr_t)wrong, 0);
+}
+
+void test_threads_ring(void) {
+    static struct ring rings[RING_PAIRS];
+    pthread_t t[2 * RING_PAIRS];
+    uintptr_t wrong = 0;
+    for(int i = 0; i < RING_PAIRS; i++) {
+        pthread_create(&t[2 * i], NULL, ring_producer, &rings[i]);
+        pthread_create(&t[2 * i + 1], NULL, ring_consumer, &rings[i]);
+    }
+    for(int i = 0; i < 2 * RING_PAIRS; i++)
+        pthread_join(t[i], NULL);
+    for(int i = 0; i < RING_PAIRS; i++)
+        wrong += rings[i].wrong;
+    CU_ASSERT_EQUAL(wrong, 0);
+}
+
+void test_threads_remote_free(void) {
+    void *keep = my_malloc(1000);
+    void *p = my_malloc(1000), *victim = p, *after = NULL, *b;
+    // the block may have taken a free block a little larger than asked, it goes to the fast bin of that size
+    size_t size = my_usable_size(p);
+    // a claimed block above it keeps the collected block out of the top chunk, the holes below are filled first
+    do {
+        b = my_malloc(1000);
+        *(void **)b = after;
+        after = b;
+    } while(b < p);
+    my_heap_walk(free_during_walk, &victim);
+    CU_ASSERT_PTR_NULL(victim);
+    // the block waited on the remote list of the heap, the next allocation collects it
+    CU_ASSERT_PTR_EQUAL(my_malloc(size), p);
+    my_free(p);
+    for(; after; after = b) {
+        b = *(void **)after;
+        my_free(after);
+    }
+    my_free(keep);
+}
+
+void test_threads_remote_owner(void) {
+    void *p = my_malloc(48), *q = p;
+    pthread_t t;
+    pthread_create(&t, NULL, free_and_malloc, &q);
+    pthread_join(t, NULL);
+    // the consumer did not keep the slot in its cache, it went back to the producer that owns its slab
+    CU_ASSERT_PTR_NOT_EQUAL(q, p);
+    CU_ASSERT_PTR_EQUAL(my_malloc(48), p);
+    my_free(p);
+    my_free(q);
+}
+
+void test_threads_percpu(void) {
+    static void *blocks[TRANSFER_BLOCKS];
+    pthread_t threads[NUM_THREADS];
+    void *corrupted, *wrong;
+    uintptr_t total = 0;
+    CU_ASSERT_EQUAL(my_mallopt(MY_M_PERCPU, 1), 1);
+    for(uintptr_t i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, integrity_worker, (void *)(i + 1));
+    for(int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], &corrupted);
+        total += (uintptr_t)corrupted;
+    }
+    CU_ASSERT_EQUAL(total, 0);
+    pthread_create(&threads[0], NULL, producer, blocks);
+    pthread_join(threads[0], NULL);
+    // the blocks of the per-CPU heaps are still freed in their heap once the mode is off
+    my_mallopt(MY_M_PERCPU, 0);
+    pthread_create(&threads[0], NULL, consumer, blocks);
+    pthread_join(threads[0], &wrong);
+    CU_ASSERT_EQUAL((uintptr_t)wrong, 0);
+}
+
+void test_threads_percpu_reuse(void) {
+    static struct percpu_share share;
+    pthread_t first, second;
+    CPU_ZERO(&share.cpu);
+    CPU_SET(sched_getcpu(), &share.cpu);
+    pthread_barrier_init(&share.freed, NULL, 2);
+    pthread_barrier_init(&share.done, NULL, 2);
+    my_mallopt(MY_M_PERCPU, 1);
+    pthread_create(&first, NULL, free_and_wait, &share);
+    pthread_barrier_wait(&share.freed);
+    // the first thread is still alive, a thread cache would keep its block from any other thread
+    pthread_create(&second, NULL, malloc_on_cpu, &share);
+    pthread_join(second, NULL);
+    CU_ASSERT_PTR_EQUAL(share.reused, share.block);
+    pthread_barrier_wait(&share.done);
+    pthread_join(first, NULL);
+    CU_ASSERT_TRUE(my_usable_size(share.reused) >= 100);
+    my_mallopt(MY_M_PERCPU, 0);
+    my_free(share.reused);
+    pthread_barrier_destroy(&share.freed);
+    pthread_barrier_destroy(&share.done);
+}
+
+void test_threads_percpu_stats(void) {
+    struct my_malloc_stats before, after;
+    pthread_t t;
+    void *p;
+    my_mallopt(MY_M_PERCPU, 1);
+    before = my_malloc_stats();
+    pthread_create(&t, NULL, malloc_block, NULL);
+    pthread_join(t, &p);
+    my_free(p);
+    after = my_malloc_stats();
+    // the thread only used its per-CPU heap, its counters were still flushed when it exited
+    CU_ASSERT_EQUAL(after.live_bytes, before.live_bytes);
+    CU_ASSERT_EQUAL(after.mallocs - before.mallocs, 1);
+    my_mallopt(MY_M_PERCPU, 0);
+}
+
+void test_threads_percpu_heap_bytes(void) {
+    struct my_malloc_stats before, after;
+    void *p[8];
+    int i;
+    my_mallopt(MY_M_PERCPU, 1);
+    for(i = 0; i < 8; i++)
+        p[i] = my_malloc(936);
+    before = my_malloc_stats();
+    // the blocks that are not the last of their heap stay in it as free blocks
+    for(i = 0; i < 4; i++)
+        my_free(p[i]);
+    after = my_malloc_stats();
+    CU_ASSERT_TRUE(after.heap_free_bytes - before.heap_free_bytes >= 944);
+    for(i = 4; i < 8; i++)
+        my_free(p[i]);
+    my_mallopt(MY_M_PERCPU, 0);
+}
+
+void test_threads_percpu_owners(void) {
+    static pthread_t t[OWNER_THREADS];
+    pthread_barrier_t barrier;
+    struct slab_owner *o;
+    int i;
+    my_mallopt(MY_M_PERCPU, 1);
+    pthread_barrier_init(&barrier, NULL, OWNER_THREADS + 1);
+    for(i = 0; i < OWNER_THREADS; i++)
+        pthread_create(&t[i], NULL, malloc_and_wait, &barrier);
+    pthread_barrier_wait(&barrier);
+    // the threads only used their per-CPU heap, none of them took a slab owner
+    o = slab_owner_register();
+    CU_ASSERT_PTR_NOT_NULL(o);
+    slab_owner_release(o);
+    pthread_barrier_wait(&barrier);
+    for(i = 0; i < OWNER_THREADS; i++)
+        pthread_join(t[i], NULL);
+    pthread_barrier_destroy(&barrier);
+    my_mallopt(MY_M_PERCPU, 0);
+}
+
+void test_threads_percpu_free_slot(void) {
+    struct my_malloc_stats before, after;
+    void *p = my_malloc(48);
+    my_mallopt(MY_M_PERCPU, 1);
+    before = my_malloc_stats();
+    my_free(p);
+    after = my_malloc_stats();
+    // the thread cache is not read in the per-CPU mode, the slot went back to its slab
+    CU_ASSERT_EQUAL(before.slab_used_bytes - after.slab_used_bytes, 48);
+    my_mallopt(MY_M_PERCPU, 0);
+}
+
+void test_threads_percpu_realloc_full(void) {
+    char *p, *q;
+    my_mallopt(MY_M_PERCPU, 1);
+    my_mallopt(MY_M_MMAP_THRESHOLD, PAST_CPU_HEAP + 1);
+    p = my_malloc(100);
+    p[0] = 'k';
+    // the heap of the CPU can not hold the block, it moves to the default heap
+    q = my_realloc(p, PAST_CPU_HEAP);
+    CU_ASSERT_PTR_NOT_NULL(q);
+    if(q) {
+        CU_ASSERT_EQUAL(q[0], 'k');
+        my_free(q);
+    }
+    my_mallopt(MY_M_MMAP_THRESHOLD, DEFAULT_MMAP_THRESHOLD);
+    my_mallopt(MY_M_PERCPU, 0);
+}
+
+void test_threads_drain_on_exit(void) {
+    void *cached[8], *reused[8];
+    int found = 0;
+    pthread_t t;
+    pthread_create(&t, NULL, cache_and_exit, cached);
+    pthread_join(t, NULL);
+    // the main thread has no cached 64-byte blocks, so they are refilled from the heap
+    for(int i = 0; i < 8; i++)
+        reused[i] = my_malloc(64);
+    for(int i = 0; i < 8; i++)
+        for(int j = 0; j < 8; j++)
+            if(reused[i] == cached[j])
+                found++;
+    CU_ASSERT_TRUE(found > 0);
+    for(int i = 0; i < 8; i++)
+        my_free(reused[i]);
+}
+
+/*
+Helper method to create a suite
+@param name Pointer to the name of the suite
+@return CUnit suite object
+*/
+static CU_pSuite create_suite(const char* name) {
+    CU_pSuite suite = CU_add_suite(name, NULL, NULL);
+    if (CU_get_error() != CUE_SUCCESS)
+        errx(EXIT_FAILURE, "%s", CU_get_error_msg());
+    return suite;
+}
+
+int main(void) {
+    // initialize registry
+    if (CU_initialize_registry() != CUE_SUCCESS)
+        errx(EXIT_FAILURE, "can't initialize test registry");
+
+    // threads suite
+    CU_pSuite threads_suite = create_suite("threads suite");
+
+    CU_add_test(threads_suite, "threads_integrity", test_threads_integrity);
+    CU_add_test(threads_suite, "threads_cross_free", test_threads_cross_free);
+    CU_add_test(threads_suite, "threads_drain_on_exit", test_threads_drain_on_exit);
+    CU_add_test(threads_suite, "threads_ring", test_threads_ring);
+    CU_add_test(threads_suite, "threads_remote_free", test_threads_remote_free);
+    CU_add_test(threads_suite, "threads_remote_owner", test_threads_remote_owner);
+    CU_add_test(threads_suite, "threads_percpu", test_threads_percpu);
+    CU_add_test(threads_suite, "threads_percpu_reuse", test_threads_percpu_reuse);
+    CU_add_test(threads_suite, "threads_percpu_stats", test_threads_percpu_stats);
+    CU_add_test(threads_suite, "threads_percpu_heap_bytes", test_threads_percpu_heap_bytes);
+    CU_add_test(threads_suite, "threads_percpu_owners", test_threads_percpu_owners);
+    CU_add_test(threads_suite, "threads_percpu_free_slot", test_threads_percpu_free_slot);
+    CU_add_test(threads_suite, "threads_percpu_realloc_full", test_threads_percpu_realloc_full);
+
+    // run the tests
+    CU_basic_run_tests();
+
+    // clean the registry
+    CU_cleanup_registry();
+    return 0;
+}